@@ -0,0 +1,82 @@
+// Throughput of the binary trace path from 1 to N threads.
+//
+//   clang -O2 -pthread bench/trace_threads.c runtime/core_runtime.c
+//         -o bench_trace_threads
+//   ./bench_trace_threads [max_threads] [records_per_thread]
+//
+// Every thread hammers print_i32_with_id like an instrumented hot loop does.
+// With per-thread buffers the aggregate rate should grow close to linearly
+// until the disk (or DEFUSE_TRACE_FILE=/dev/null to take it out) saturates.
+
+// setenv and clock_gettime under -std=c11
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../include/TraceFormat.h"
+
+#define SITES 64
+
+unsigned defuse_register_sites(const char *const *ids,
+                               const unsigned char *tags, unsigned count);
+void print_i32_with_id(int value, const char *node_id, const char *name,
+                       unsigned site);
+
+static const char *site_ids[SITES];
+static unsigned char site_tags[SITES];
+static char site_names[SITES][16];
+static long records_per_thread = 4000000;
+
+static void *worker(void *arg) {
+    long i;
+    int seed = (int)(long)arg;
+    for (i = 0; i < records_per_thread; i++)
+        print_i32_with_id(seed + (int)i, "", "", (unsigned)(i % SITES));
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    pthread_t *threads;
+    double base_rate = 0;
+    int n, i;
+
+    if (argc > 2)
+        records_per_thread = atol(argv[2]);
+
+    setenv("DEFUSE_TRACE", "binary", 0);
+    setenv("DEFUSE_TRACE_FILE", "bench_trace_threads.trace", 0);
+
+    for (i = 0; i < SITES; i++) {
+        snprintf(site_names[i], sizeof(site_names[i]), "bench_%d", i);
+        site_ids[i] = site_names[i];
+        site_tags[i] = DEFUSE_TAG_I32;
+    }
+    defuse_register_sites(site_ids, site_tags, SITES);
+
+    threads = (pthread_t *)calloc((size_t)max_threads, sizeof(*threads));
+    printf("threads  records/s      speedup\n");
+    for (n = 1; n <= max_threads; n *= 2) {
+        double start = now(), elapsed, rate;
+        for (i = 0; i < n; i++)
+            pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+        for (i = 0; i < n; i++)
+            pthread_join(threads[i], NULL);
+        elapsed = now() - start;
+        rate = (double)n * records_per_thread / elapsed;
+        if (n == 1)
+            base_rate = rate;
+        printf("%7d  %12.0f  %7.2fx\n", n, rate, rate / base_rate);
+    }
+    free(threads);
+    return 0;
+}
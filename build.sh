@@ -10,10 +10,10 @@ CXX=${CXX:-clang++}
 # TODO[flops]: On build stage you also can spot where opt tool is located, abort build & force user to provide correct path and pass it as macro to the app 
 # [flops]: (instead of std::system("which opt > /dev/null 2>&1") != 0)) in app runtime.
 
-CXXFLAGS="-std=c++17 -O0 -g -Wall -Wextra -Wpedantic -fno-exceptions -fno-rtti" # TODO[flops]: Add -Iinclude
+CXXFLAGS="-std=c++17 -O0 -g -fPIC -Wall -Wextra -Wpedantic -fno-exceptions -fno-rtti" # TODO[flops]: Add -Iinclude
 LLVM_CXXFLAGS="$($LLVM_CONFIG --cxxflags | sed 's/-std=c++[^ ]*//g')"
 LLVM_LDFLAGS="$($LLVM_CONFIG --ldflags)"
-LLVM_LIBS="$($LLVM_CONFIG --libs core irreader support analysis)"
+LLVM_LIBS="$($LLVM_CONFIG --libs core irreader bitwriter passes support analysis transformutils orcjit native)"
 LLVM_SYS="$($LLVM_CONFIG --system-libs)"
 
 # TODO[DKay]: Why not to use incremental build system like Makefile here?
@@ -22,8 +22,20 @@ rm -f obj/*.o
 
 $CXX $CXXFLAGS $LLVM_CXXFLAGS -Iinclude -c src/main.cpp            -o obj/main.o
 $CXX $CXXFLAGS $LLVM_CXXFLAGS -Iinclude -c src/GraphVisualizer.cpp -o obj/GraphVisualizer.o
+$CXX $CXXFLAGS $LLVM_CXXFLAGS -Iinclude -c src/GraphQuery.cpp      -o obj/GraphQuery.o
 $CXX $CXXFLAGS $LLVM_CXXFLAGS -Iinclude -c src/Instrumentation.cpp -o obj/Instrumentation.o
+$CXX $CXXFLAGS $LLVM_CXXFLAGS -Iinclude -c src/SiteManifest.cpp    -o obj/SiteManifest.o
+$CXX $CXXFLAGS $LLVM_CXXFLAGS -Iinclude -c src/TraceDecoder.cpp    -o obj/TraceDecoder.o
+$CXX $CXXFLAGS $LLVM_CXXFLAGS -Iinclude -c src/RuntimeProfile.cpp  -o obj/RuntimeProfile.o
+$CXX $CXXFLAGS $LLVM_CXXFLAGS -Iinclude -c src/Reconstruction.cpp  -o obj/Reconstruction.o
+$CXX $CXXFLAGS $LLVM_CXXFLAGS -Iinclude -c src/JitRunner.cpp       -o obj/JitRunner.o
+$CXX $CXXFLAGS $LLVM_CXXFLAGS -Iinclude -c src/DefUsePlugin.cpp    -o obj/DefUsePlugin.o
 
-$CXX obj/*.o $LLVM_LDFLAGS $LLVM_LIBS $LLVM_SYS -o bin/defuse-analyzer
+$CXX $(ls obj/*.o | grep -v DefUsePlugin) $LLVM_LDFLAGS $LLVM_LIBS $LLVM_SYS -o bin/defuse-analyzer
 
-echo "[build] ok -> bin/defuse-analyzer"
+# pass plugin for opt/clang, LLVM itself comes from the host tool
+$CXX -shared obj/DefUsePlugin.o obj/Instrumentation.o obj/Reconstruction.o \
+    obj/SiteManifest.o \
+    -o bin/DefUseInstrument.so
+
+echo "[build] ok -> bin/defuse-analyzer bin/DefUseInstrument.so"
@@ -0,0 +1,94 @@
+#ifndef GRAPH_FORMAT_H
+#define GRAPH_FORMAT_H
+
+// Saved graph layout, written by GraphVisualizer::saveGraph and memory-mapped
+// by GraphVisualizer::loadGraph. Everything exportToDot needs is in the file,
+// node ids and labels already formatted, so a saved graph is exported again
+// without the IR. Runtime values and execution counts are not part of it,
+// they are loaded on top like after a build.
+//
+// file = DefuseGraphHeader
+//        sections at the offsets in the header, each 8-byte aligned:
+//        DefuseGraphNode[nodeCount]
+//        uint32_t functionNames[functionCount]     string offsets
+//        uint32_t functionNodes[functionCount + 1] first node of each
+//        uint32_t functionBlocks[functionCount + 1] first block of each
+//        uint32_t functionEntries[functionCount]   NoIndex without one
+//        uint32_t blockBegin[blockCount], blockEnd[blockCount]
+//        per edge kind (cfg, def-use, call) the compressed sparse rows of
+//        GraphVisualizer::EdgeList: uint32_t offsets[nodeCount + 1],
+//        uint32_t targets[edge count]
+//        uint32_t callOrders[call edge count]
+//        string table: uint32_t length, bytes, padding to 4, for each string
+//
+// A string offset points at the length of the string in the table, offset 0
+// is the empty string. Integers are in host byte order.
+
+#include <cstdint>
+
+#define DEFUSE_GRAPH_MAGIC "DUGRAPH1"
+#define DEFUSE_GRAPH_MAGIC_SIZE 8
+#define DEFUSE_GRAPH_VERSION 1u
+
+enum DefuseGraphSection {
+  DEFUSE_GRAPH_NODES,
+  DEFUSE_GRAPH_FUNCTION_NAMES,
+  DEFUSE_GRAPH_FUNCTION_NODES,
+  DEFUSE_GRAPH_FUNCTION_BLOCKS,
+  DEFUSE_GRAPH_FUNCTION_ENTRIES,
+  DEFUSE_GRAPH_BLOCK_BEGIN,
+  DEFUSE_GRAPH_BLOCK_END,
+  DEFUSE_GRAPH_CFG_OFFSETS,
+  DEFUSE_GRAPH_CFG_TARGETS,
+  DEFUSE_GRAPH_DEFUSE_OFFSETS,
+  DEFUSE_GRAPH_DEFUSE_TARGETS,
+  DEFUSE_GRAPH_CALL_OFFSETS,
+  DEFUSE_GRAPH_CALL_TARGETS,
+  DEFUSE_GRAPH_CALL_ORDERS,
+  DEFUSE_GRAPH_STRINGS,
+  DEFUSE_GRAPH_SECTION_COUNT
+};
+
+struct DefuseGraphHeader {
+  char magic[DEFUSE_GRAPH_MAGIC_SIZE];
+  uint32_t version;
+  uint32_t nodeCount;
+  uint32_t functionCount;
+  uint32_t blockCount;
+  uint32_t cfgEdgeCount;
+  uint32_t defUseEdgeCount;
+  uint32_t callEdgeCount;
+  uint32_t callCount; // call sites of defined functions, with or without edge
+  // byte offset and size of each DefuseGraphSection
+  uint64_t sectionOffsets[DEFUSE_GRAPH_SECTION_COUNT];
+  uint64_t sectionSizes[DEFUSE_GRAPH_SECTION_COUNT];
+};
+
+// how exportToDot draws an instruction
+enum DefuseGraphShape {
+  DEFUSE_SHAPE_PLAIN = 0,
+  DEFUSE_SHAPE_TERMINATOR = 1,
+  DEFUSE_SHAPE_PHI = 2,
+  DEFUSE_SHAPE_COMPARE = 3,
+  DEFUSE_SHAPE_CALL = 4
+};
+
+// the runtime records values of the node's type
+#define DEFUSE_NODE_RECORDABLE 1u
+
+struct DefuseGraphNode {
+  uint32_t function;
+  uint32_t block; // NoIndex for arguments and constants
+  uint32_t id;    // string offsets: the id in DOT output,
+  uint32_t label; // the label without runtime value,
+  uint32_t key;   // the site id the instrumenter gives the value
+  uint32_t constantValue; // "VALUE=" text of constants without a record
+  uint8_t kind;  // GraphVisualizer::NodeKind
+  uint8_t shape; // DefuseGraphShape
+  uint8_t flags; // DEFUSE_NODE_*
+  uint8_t padding[5];
+};
+
+static_assert(sizeof(DefuseGraphNode) == 32, "node records are fixed-width");
+
+#endif // GRAPH_FORMAT_H
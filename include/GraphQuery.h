@@ -0,0 +1,67 @@
+#ifndef GRAPH_QUERY_H
+#define GRAPH_QUERY_H
+
+#include "GraphVisualizer.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/StringMap.h"
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Answers questions about a built or loaded graph in batch (-query), instead
+// of scripts grepping the DOT file. Nodes are named by their DOT ids. One
+// query per line, '#' starts a comment, one answer line per query:
+//
+//   reach <from> <to> [calls]      "yes" or "no"
+//   path <from> <to> [calls]       a shortest path "a -> b -> c", or "none"
+//   ancestors <node> [calls] [opcode=<op>] [function=<name>]
+//   descendants <node> [calls] [opcode=<op>] [function=<name>]
+//                                  the ids in node order, or "none"
+//   degree <node>                  "in=N out=M" def-use edges
+//   degrees [function=<name>]      fan-in and fan-out of all nodes
+//
+// Paths follow def-use edges, which stay inside their function. With "calls"
+// they also go through calls the way -slice-calls does. Opcodes are LLVM's
+// ("add", "load"), "arg" and "const" for the other nodes. A query that can't
+// be answered gets "error: ..." as its answer.
+//
+// reach without calls is looked up in a bitset index per function, made the
+// first time a query needs it: the nodes reachable from each strongly
+// connected component of the function's def-use edges. Functions with more
+// than IndexLimit nodes are searched instead.
+class GraphQuery {
+public:
+  explicit GraphQuery(const GraphVisualizer &graph);
+
+  // answers the queries of queryFile to out, false if it can't be read
+  bool run(const std::string &queryFile, std::ostream &out);
+  std::string answer(const std::string &query);
+  size_t answered() const { return answered_; }
+
+private:
+  using SliceDirection = GraphVisualizer::SliceDirection;
+  static constexpr uint32_t NoIndex = UINT32_MAX;
+  static constexpr uint32_t IndexLimit = 8192;
+
+  // by node index minus the first node of the function
+  struct FunctionIndex {
+    std::vector<uint32_t> components;       // per node
+    std::vector<llvm::BitVector> reachable; // per component
+  };
+
+  const FunctionIndex &indexOf(uint32_t func);
+  bool reaches(uint32_t from, uint32_t to, bool followCalls);
+  std::string path(uint32_t from, uint32_t to, bool followCalls);
+  std::string degrees(const std::string &function) const;
+  std::string opcodeOf(uint32_t node) const;
+
+  const GraphVisualizer &graph_;
+  llvm::StringMap<uint32_t> nodes_; // by DOT id
+  std::vector<std::unique_ptr<FunctionIndex>> indexes_;
+  size_t answered_ = 0;
+};
+
+#endif // GRAPH_QUERY_H
@@ -1,12 +1,23 @@
 #ifndef GRAPH_VISUALIZER_H
 #define GRAPH_VISUALIZER_H
 
+#include "GraphFormat.h"
+#include "Reconstruction.h"
+#include "SiteManifest.h"
+#include "TraceDecoder.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/Value.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include <cstdint> //TODO[Dkay]: my LSP says that this header is unused. Pls, setup yours too
 #include <map>
+#include <optional>
 #include <set> //TODO[Dkay]: my LSP says that this header is unused. Pls, setup yours too
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 // FIXME{Dkay}: this is weird. Why not to use `#inlcude` directive like
@@ -32,50 +43,204 @@ public:
   bool buildCombinedGraph(llvm::Module &module,
                           const std::string &runtimeLogFile = "");
 
+  // threads buildCombinedGraph builds functions on and exportToDot renders
+  // them on, 0 for one per core. The output is the same for any number.
+  void setJobs(unsigned jobs) { jobs_ = jobs; }
+
+  // sites of the instrumented module, before buildCombinedGraph and kept
+  // across builds. Runtime values are then joined with nodes by position,
+  // without one the ids are matched against what the instrumenter would have
+  // named the node.
+  void setSiteManifest(SiteManifest manifest) {
+    siteManifest_ = std::move(manifest);
+  }
+
+  // content hash of each function of the next module by name, before
+  // buildCombinedGraph. Instruction labels and DOT text of a function whose
+  // hash is the one it had in the previous build are reused, so a rebuild
+  // after a small edit formats and renders only the edited functions.
+  // Without hashes nothing is kept between builds.
+  void setFunctionHashes(llvm::StringMap<uint64_t> hashes) {
+    functionHashes_ = std::move(hashes);
+  }
+  // functions the last build had nothing cached for, in module order
+  const std::vector<std::string> &changedFunctions() const {
+    return changedFunctions_;
+  }
+
+  // block and CFG edge counts from a -counters run ("func:block:N" and
+  // "func:from->to:N" lines), after buildCombinedGraph. exportToDot then
+  // draws CFG edges and instructions by execution frequency.
+  bool loadExecutionCounts(const std::string &countsFile);
+
   bool exportToDot(const std::string &filename) const;
+  // the graph split for rendering: one DOT file per function into dir, calls
+  // going to a box for the callee, and index.dot with a box per function and
+  // the calls between them. files gets every file written, index first. A
+  // file whose text did not change is left alone, so it keeps its time and
+  // pictures rendered from it stay valid.
+  bool exportShards(const std::string &dir,
+                    std::vector<std::string> &files) const;
+  // nodes the next export writes: the slice, or the whole graph
+  size_t exportedNodeCount() const;
+  // the same nodes and edges for other tools, streamed from the arrays. Each
+  // node has its DOT id, kind, opcode, function, block, label and runtime
+  // value; each edge its kind: cfg, def-use, input (def-use from an argument
+  // or a constant) or call, the call's order, and the execution counts if
+  // loaded. JSON has an array per attribute, null where it doesn't apply:
+  //   {"graph": "CombinedCFGDefUse",
+  //    "nodes": {"id": [...], "kind": [...], "opcode": [...], ...},
+  //    "edges": {"source": [0, ...], "target": [3, ...], "kind": [...], ...}}
+  // with source and target positions in the node arrays. GraphML has the
+  // same attributes as data keys, nodes are "n<position>".
+  bool exportToJson(const std::string &filename) const;
+  bool exportToGraphML(const std::string &filename) const;
+
+  enum class SliceDirection { Backward, Forward };
+  // restricts the next exports to a slice: the nodes that reach (Backward)
+  // or are reached from (Forward) the node with DOT id nodeId over def-use
+  // edges, at most depth edges away (0: any). With followCalls it goes
+  // through calls too: from the operands of a call to the callee's arguments
+  // and from its returns back to the call. Only those nodes, the edges
+  // between them and the clusters holding them are written. False if no
+  // node has that id.
+  bool selectSlice(const std::string &nodeId, SliceDirection direction,
+                   unsigned depth, bool followCalls);
+
+  // the graph without runtime values and counts (see GraphFormat.h). A
+  // saved graph is loaded with loadGraph instead of buildCombinedGraph and
+  // exported again without the IR.
+  bool saveGraph(const std::string &file) const;
+  // memory-maps a saved graph. Runtime values are matched by the instrumenter
+  // ids saved with the nodes (or the site manifest); values a minimal trace
+  // left out need the IR and stay empty.
+  bool loadGraph(const std::string &file,
+                 const std::string &runtimeLogFile = "");
 
   void printStatistics() const;
 
+  // live mode: bytes of a binary trace as they arrive from a pipe, then
+  // refreshRuntimeValues() to update node labels before the next export.
+  // Returns false once the stream turned out to be malformed.
+  bool feedRuntimeStream(const char *data, size_t size);
+  // number of sites that changed since the last refresh
+  size_t refreshRuntimeValues();
+  // values captured without a trace file (-jit), replacing loaded ones
+  void setRuntimeValues(RuntimeValueMap values);
+  size_t streamRecordCount() const { return streamDecoder_.recordCount(); }
+  bool streamStarted() const { return streamDecoder_.headerSeen(); }
+
 private:
-  // TODO[Dkay]: why to hide GraphNode interface inside, move it outside the class to improve code radability.
-  struct GraphNode {
-    llvm::Value *value = nullptr;
-    std::string id;
-    std::string label;
-    std::string type;
-    std::string runtimeValue;
-
-    bool isInstruction =
-        false; // FIXME[flops]: Use enum for this or determine value type via
-               // llvm isa (or dyn_cast: it uses isa and casts value to needed
-               // class if possible)
-               // [Dkay]: +++
-    
-    bool isBasicBlock = false;
-    bool isConstant = false;
-    bool isArgument = false;
-    bool isTerminator = false;
-    bool hasRuntimeValue = false;
-
-    llvm::BasicBlock *parentBlock = nullptr; // TODO[flops]: use union there
-
-    std::vector<std::string> operands;
-    std::vector<std::string> defUseSuccessors;
-    std::vector<std::string> cfgSuccessors;
-
-    std::string functionName;
+  // answers questions on the arrays below
+  friend class GraphQuery;
+
+  // Nodes are dense indices into the per-node arrays below. Each function
+  // gets a contiguous range: its arguments, its instructions block by block,
+  // then the constants it uses. String ids are only made on export (nodeId).
+  enum class NodeKind : uint8_t { Argument, Instruction, Constant };
+  static constexpr uint32_t NoIndex = UINT32_MAX;
+
+  // edges of one kind in compressed sparse row form, the targets of node n
+  // are targets[offsets[n] .. offsets[n + 1])
+  struct EdgeList {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> targets;
+
+    uint32_t begin(uint32_t node) const { return offsets[node]; }
+    uint32_t end(uint32_t node) const { return offsets[node + 1]; }
+    llvm::ArrayRef<uint32_t> of(uint32_t node) const {
+      return llvm::makeArrayRef(targets.data() + begin(node),
+                                targets.data() + end(node));
+    }
+    // (source, target) pairs, kept in their order per source
+    void assign(size_t nodeCount,
+                const std::vector<std::pair<uint32_t, uint32_t>> &edges);
+    // the same edges from target to source, sources in node order
+    EdgeList reversed() const;
+    void clear() {
+      offsets.clear();
+      targets.clear();
+    }
   };
 
-  struct BasicBlockInfo { // FIXME[flops]: BasicBlock class already contains
-                          // that info
-    std::string id;
-    std::string label;
-    llvm::BasicBlock *blockPtr = nullptr;
-    std::vector<std::string> instructions;
-    std::string functionName;
+  using EdgePairs = std::vector<std::pair<uint32_t, uint32_t>>;
+
+  // nodes and edges of one function with indices local to it, made on a
+  // worker thread. Only reads the IR.
+  struct FunctionGraph {
+    std::vector<llvm::Value *> values;
+    std::vector<NodeKind> kinds;
+    std::vector<uint32_t> blocks;
+    std::vector<llvm::BasicBlock *> blockPtrs;
+    std::vector<uint32_t> blockBegin;
+    std::vector<uint32_t> blockEnd;
+    uint32_t entry = NoIndex;
+    EdgePairs cfg;
+    EdgePairs defUse;
+    std::vector<uint32_t> callSites; // calls of defined functions
   };
 
+  // what a function looks like without runtime values, kept across builds
+  // while its content hash stays the same
+  struct FunctionCache {
+    uint64_t hash = 0;
+    std::vector<std::string> labels; // per node, set for instructions
+    // rendered by exportToDot, empty until then
+    std::string cluster;
+    std::string cfgEdges;
+    std::string defUseEdges;
+  };
+
+  void reset();
+  static FunctionGraph buildFunctionGraph(llvm::Function &function);
+  // appends graph in module order; its edges go to cfg and defUse and its
+  // call sites to callSites, all with graph indices
+  void addFunctionGraph(llvm::Function &function, FunctionGraph &graph,
+                        EdgePairs &cfg, EdgePairs &defUse,
+                        std::vector<uint32_t> &callSites);
+  // call edges, once all functions have their nodes
+  void addCallEdges(const std::vector<uint32_t> &callSites);
+  // counters, sites and runtime values of a built or loaded graph
+  void finishGraph();
+  // functionCaches_ of a built graph from functionHashes_
+  void attachFunctionCaches();
+  uint32_t nodeCount() const { return nodeKinds_.size(); }
+
   bool loadRuntimeValues(const std::string &logFile);
+  // nodeSites_ and liveInSites_ from siteManifest_
+  void resolveSites();
+  // plans_ of a built graph, made when runtime values are first joined with
+  // it; a graph without values never needs them
+  void buildPlans();
+  // (re)computes runtime labels of all nodes from runtimeValues_
+  void applyRuntimeValues();
+  // values a minimal trace left out, recomputed from the recorded ones and
+  // added to runtimeValues_ (see Reconstruction.h)
+  void reconstructValues();
+  std::vector<std::string> runtimeKeysFor(uint32_t node) const;
+  // the instrumenter's id of an unnamed argument or instruction
+  std::string positionalId(uint32_t node) const;
+  // key of the live-in copy of value recorded for segment
+  std::string liveInKeyFor(llvm::Value *value, unsigned segment) const;
+  // tries the keys of node in order until found returns true
+  bool
+  findRuntimeKey(uint32_t node,
+                 llvm::function_ref<bool(const std::string &)> found) const;
+
+  // id of the node in DOT output and runtime logs
+  std::string nodeId(uint32_t node) const;
+  // label without the runtime value, formatted on first use
+  llvm::StringRef staticLabel(uint32_t node) const;
+  void formatInstructionLabels() const;
+  std::string nodeLabel(uint32_t node) const;
+  bool isTerminatorNode(uint32_t node) const;
+  // of an instruction node
+  DefuseGraphShape shapeOf(uint32_t node) const;
+  bool isRecordableNode(uint32_t node) const;
+  // "add", "call", ... of an instruction node, empty for the others
+  llvm::StringRef opcodeName(uint32_t node) const;
+  // string of the saved graph at offset
+  llvm::StringRef savedString(uint32_t offset) const;
 
   std::string getNodeId(llvm::Value *value) const;
   std::string getValueLabel(llvm::Value *value) const;
@@ -83,24 +248,127 @@ private:
   std::string getInstructionLabel(llvm::Instruction &instr) const;
   std::string getBasicBlockLabel(llvm::BasicBlock &block) const;
   std::string escapeForDot(const std::string &text) const;
+
+  // parts of exportToDot for the nodes of one function, rendered in parallel
+  void renderCluster(uint32_t func, std::string &out) const;
+  void renderCfgEdges(uint32_t func, std::string &out) const;
+  void renderDefUseEdges(uint32_t func, std::string &out) const;
+  void renderCallEdges(uint32_t func, std::string &out) const;
+  // render* output may be cached with the function
+  bool textCacheable() const;
+  using RenderFn = void (GraphVisualizer::*)(uint32_t, std::string &) const;
+  // text of render for func: the cached text if useCache and there is one,
+  // else rendered into buffer and cached. Functions run in parallel.
+  const std::string &renderedText(uint32_t func, RenderFn render,
+                                  std::string FunctionCache::*cached,
+                                  bool useCache, std::string &buffer) const;
+  // the shard of func for exportShards, callees linked to their shards
+  void renderShard(uint32_t func, const std::vector<std::string> &shardNames,
+                   bool useCache, std::string &out) const;
+  // def-use and call edges from target to source, made on first use
+  const EdgeList &defUseSources() const;
+  const EdgeList &callSitesOf() const;
+  // node with that DOT id, NoIndex if none
+  uint32_t findNode(const std::string &id) const;
+  // nodes of the slice from origin (see selectSlice). parents gets the node
+  // each one was first reached from, NoIndex for origin and the others.
+  std::vector<bool> walkSlice(uint32_t origin, SliceDirection direction,
+                              unsigned depth, bool followCalls,
+                              std::vector<uint32_t> *parents = nullptr) const;
+  enum class EdgeKind : uint8_t { Cfg, DefUse, Input, Call };
+  // edges of the export in the order of the DOT sections; edge indexes the
+  // targets of the kind's EdgeList
+  void forEachExportedEdge(
+      llvm::function_ref<void(uint32_t from, uint32_t to, EdgeKind kind,
+                              uint32_t edge)>
+          visit) const;
+  // executions of the block of node or of a CFG edge, false without counts
+  bool blockCount(uint32_t node, uint64_t &count) const;
+  bool cfgEdgeCount(uint32_t node, uint32_t edge, uint64_t &count) const;
+  // position of each node in the export, NoIndex outside the slice
+  std::vector<uint32_t> exportPositions() const;
+  // the node's label, escaped
+  void appendLabel(std::string &out, uint32_t node) const;
+  bool inSlice(uint32_t node) const { return slice_.empty() || slice_[node]; }
   std::string getInstructionName(llvm::Instruction &instr) const;
-  std::string getShortInstructionLabel(const GraphNode &node) const;
+  std::string describeRuntimeValue(const RuntimeValue &value) const;
+  std::string describeRecordedValue(const RuntimeValue &value) const;
 
-  std::unordered_map<std::string, GraphNode> nodes_;
-  std::unordered_map<std::string, BasicBlockInfo> basicBlocks_;
-  std::unordered_map<std::string, std::string> runtimeValues_;
+  // per node. nodeValues_ and the other IR pointers are empty for a loaded
+  // graph, which has savedNodes_ instead.
+  std::vector<llvm::Value *> nodeValues_;
+  std::vector<NodeKind> nodeKinds_;
+  std::vector<uint32_t> nodeFunctions_;
+  std::vector<uint32_t> nodeBlocks_; // NoIndex for arguments and constants
+  mutable std::vector<std::string> staticLabels_; // empty until formatted
+  mutable bool instructionLabelsDone_ = false;
+  std::vector<std::string> runtimeTexts_; // "VALUE=...", empty without one
+  std::vector<bool> sampled_; // runtime value comes from a sampled trace
+  // site of the node's own record, NoIndex without one; empty without a
+  // manifest
+  std::vector<uint32_t> nodeSites_;
+  // arguments and instructions; constants are per function
+  llvm::DenseMap<const llvm::Value *, uint32_t> valueNodes_;
 
-  bool runtimeValuesLoaded_;
+  // per function, blocks of function f are
+  // functionBlocks_[f] .. functionBlocks_[f + 1], its nodes likewise
+  std::vector<llvm::Function *> functions_;
+  std::vector<std::string> functionNames_;
+  std::vector<uint32_t> functionBlocks_;
+  std::vector<uint32_t> functionNodes_;
+  std::vector<uint32_t> functionEntries_; // target of call edges
 
-  struct FunctionCallInfo { // FIXME[Dkay]: llvm's function callee has same info
-    std::string caller;
-    std::string callee;
-    int callOrder;
-    std::string callSiteId;
-  };
+  // per block, instructions of block b are nodes blockBegin_[b] ..
+  // blockEnd_[b]
+  std::vector<llvm::BasicBlock *> blockPtrs_;
+  std::vector<uint32_t> blockBegin_;
+  std::vector<uint32_t> blockEnd_;
+  std::vector<uint64_t> blockExecCounts_;
+  std::vector<bool> blockCounted_;
+
+  EdgeList cfgEdges_;
+  EdgeList defUseEdges_;
+  EdgeList callEdges_;
+  mutable EdgeList defUseSources_; // empty until needed
+  mutable EdgeList callSitesOf_;
+  std::vector<uint32_t> callOrders_; // parallel to callEdges_.targets
+  size_t callCount_ = 0;
+
+  // parallel to cfgEdges_.targets, set for edges between blocks
+  std::vector<uint64_t> cfgEdgeCounts_;
+  std::vector<bool> cfgEdgeCounted_;
+  uint64_t maxExecCount_ = 0;
+  bool executionCountsLoaded_ = false;
+
+  unsigned jobs_ = 1;
+
+  llvm::StringMap<uint64_t> functionHashes_; // for the next build
+  llvm::StringMap<FunctionCache> functionCache_; // by function name
+  // per function, null without a hash. Filled on format and export.
+  std::vector<FunctionCache *> functionCaches_;
+  std::vector<std::string> changedFunctions_;
+
+  // nodes and functions of the selected slice, empty for the whole graph
+  std::vector<bool> slice_;
+  std::vector<bool> sliceFunctions_;
+  uint32_t sliceOrigin_ = NoIndex;
+
+  // the file of a loaded graph, node records and strings used in place
+  std::unique_ptr<llvm::MemoryBuffer> graphFile_;
+  llvm::ArrayRef<DefuseGraphNode> savedNodes_;
+  llvm::StringRef savedStrings_;
+
+  SiteManifest siteManifest_;
+  // (node, segment) -> site of the live-in copy
+  llvm::DenseMap<std::pair<uint32_t, uint32_t>, uint32_t> liveInSites_;
+
+  RuntimeValueMap runtimeValues_;
+  bool runtimeValuesLoaded_;
+  TraceDecoder streamDecoder_;
 
-  std::vector<FunctionCallInfo> functionCalls_;
-  std::map<std::string, std::string> functionToEntryNode_;
+  std::unordered_map<const llvm::Function *, ReconstructionPlan> plans_;
+  // runtimeValues_ entries made by reconstructValues, redone on every apply
+  std::vector<std::string> reconstructedKeys_;
 };
 
 #endif // GRAPH_VISUALIZER_H
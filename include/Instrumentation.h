@@ -1,9 +1,14 @@
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include "Reconstruction.h"
+#include "SiteManifest.h"
+
 #include <sstream> //TODO[Dkay]: my LSP says that this header is unused. Pls, setup yours too
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 // FIXME[Dkay]: He was afraid of `include`. But why.
 namespace llvm {
@@ -13,11 +18,35 @@ class Value;
 class Instruction;
 class Constant;
 class Type;
+class BasicBlock;
+class GlobalVariable;
+class IRBuilderBase;
 } // namespace llvm
 
+// what instrumentModule inserts
+struct InstrumentationOptions {
+  bool values = true; // a runtime call per def-use value
+  // values only for loads, call results, arguments, phis and whatever else
+  // the analyzer can't recompute (see Reconstruction.h), no constants
+  bool minimal = false;
+  // per-block and per-CFG-edge execution counters in a global array, dumped
+  // by the runtime at exit (DEFUSE_COUNTERS_FILE)
+  bool counters = false;
+  // the values of a basic block go into a stack buffer and reach the runtime
+  // in one call before the terminator instead of one call each
+  bool batched = false;
+
+  // value types recorded, the runtime only knows these three
+  bool i32 = true;
+  bool i64 = true;
+  bool floats = true;
+  bool recordsType(const llvm::Type *type) const;
+};
+
 class Instrumentation {
 public:
-  Instrumentation();
+  explicit Instrumentation(
+      const InstrumentationOptions &options = InstrumentationOptions());
 
   // FIXME[Dkay]: Class should be either marked final or have an virtual dtor
   // FIXME[Dkay]: break of the rule of zero: class has untrivial dtor
@@ -29,22 +58,71 @@ public:
   // Pass some args to ctor, save them as fields and make your methods interface thiner
   bool instrumentModule(const std::string &inputFile,
                         const std::string &outputFile);
+  // in place, e.g. from the pass plugin; the module must not have been
+  // instrumented before. The runtime's entry points are left as they are,
+  // and so is the runtime's own module (it defines defuse_runtime).
+  void instrumentModule(llvm::Module &module);
+
+  // sites of the last instrumentModule, the file variant also writes them to
+  // manifestPathFor(outputFile)
+  const SiteManifest &siteManifest() const { return manifest_; }
 
 private:
   void instrumentFunction(llvm::Function &function, llvm::Module &module);
+  // records value once more at the start of a block segment, see
+  // ReconstructionPlan
+  void instrumentLiveIn(const ReconstructionPlan::LiveIn &liveIn,
+                        llvm::Module &module, const std::string &funcName);
+  // segment >= 0 records the live-in copy of value for that segment
   void instrumentValue(llvm::Value *value, llvm::Module &module,
-                       const std::string &funcName,
-                       const std::string &valueType);
+                       const std::string &funcName, int segment = -1,
+                       llvm::Instruction *insertPoint = nullptr);
+
+  // a value waiting for its runtime call
+  struct PendingRecord {
+    llvm::Value *value;
+    std::string valueId;
+    std::string valueName;
+    llvm::Instruction *insertPoint; // nullptr: default place for the value
+    SitePosition position;
+  };
+  void emitPrintCall(llvm::Module &module, const PendingRecord &record);
+  // batched mode: stores into the block buffer plus one defuse_record_block
+  // call per block, plain print calls where that can't work
+  void flushBlockRecords(llvm::Function &function, llvm::Module &module);
 
   llvm::Constant *createGlobalString(llvm::Module &module,
                                      const std::string &str,
                                      const std::string &globalName);
 
-  std::string getValueId(llvm::Value *value, const std::string &funcName);
+  // unnamed values get positional ids, see positionalSiteId
+  std::string getValueId(llvm::Value *value, const SitePosition &at);
+  SitePosition positionOf(llvm::Value *value,
+                          const std::string &funcName) const;
 
   void insertPrintCall(llvm::Module &module, llvm::Function &printFunc,
                        llvm::Value *value, llvm::Constant *idStr,
-                       llvm::Constant *nameStr, const std::string &funcName);
+                       llvm::Constant *nameStr, unsigned siteId,
+                       llvm::Instruction *insertPoint);
+  // the runtime's number of the module's site: site plus the base
+  // defuse_register_sites gave the module, so several instrumented modules
+  // can share one trace
+  llvm::Value *runtimeSite(llvm::Module &module, llvm::IRBuilderBase &builder,
+                           unsigned site);
+  // right after the value's definition
+  llvm::Instruction *recordInsertPoint(llvm::Module &module,
+                                       llvm::Value *value);
+
+  // module ctor registering the site table and the counters with the runtime
+  void emitModuleCtor(llvm::Module &module);
+  // emits the dense site table and its registration, so binary traces can
+  // carry integer site ids instead of strings
+  void emitSiteTable(llvm::Module &module, llvm::BasicBlock &ctorEntry);
+
+  // block and edge counters; have to run after the value instrumentation,
+  // they split critical edges
+  void instrumentCounters(llvm::Module &module);
+  void emitCounterTable(llvm::Module &module, llvm::BasicBlock &ctorEntry);
 
   llvm::Function *getOrDeclarePrintI32WithId(llvm::Module &module);
   llvm::Function *getOrDeclarePrintI64WithId(llvm::Module &module);
@@ -54,7 +132,29 @@ private:
                                             const std::string &name,
                                             llvm::Type *valueType);
 
+  InstrumentationOptions options_;
+
   std::unordered_set<std::string> instrumentedValues_;
+
+  // indexed by site id
+  SiteManifest manifest_;
+  std::vector<unsigned char> siteTags_;
+  // set by the module ctor, see runtimeSite
+  llvm::GlobalVariable *siteBase_ = nullptr;
+
+  // (block, instruction) of every instruction of the module, taken before
+  // any call is inserted
+  std::unordered_map<const llvm::Instruction *, std::pair<uint32_t, uint32_t>>
+      positions_;
+
+  // batched mode, values of the function being instrumented by block
+  std::unordered_map<llvm::BasicBlock *, std::vector<PendingRecord>>
+      blockRecords_;
+
+  // indexed by counter: "func:block" or "func:from->to", block indices in
+  // function order of the input IR
+  std::vector<std::string> counterNames_;
+  llvm::GlobalVariable *counters_ = nullptr;
 };
 
 #endif // INSTRUMENTATON_H
@@ -0,0 +1,55 @@
+#ifndef JIT_RUNNER_H
+#define JIT_RUNNER_H
+
+#include "TraceDecoder.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Runs an instrumented module in process through ORC LLJIT (-jit). The
+// runtime entry points it calls (print_*_with_id, defuse_record_block, the
+// site and counter registrations) are bound to host functions that record
+// straight into a TraceDecoder, so no program is built and no trace or log is
+// written. The program's stdout goes to /dev/null like with -run; exit() ends
+// the program, not the analyzer. A crash or abort() takes the analyzer with
+// it, use -mmap for such programs.
+class JitRunner {
+public:
+  // runs main() of an instrumented module; false if it couldn't be compiled
+  // or has no main
+  bool run(llvm::orc::ThreadSafeModule module);
+
+  // values recorded by the last run, see TraceDecoder::publish
+  size_t publish(RuntimeValueMap &values) { return decoder_.publish(values); }
+  uint64_t recordCount() const { return decoder_.recordCount(); }
+  int exitCode() const { return exitCode_; }
+
+  // "name:count" lines like the runtime writes to DEFUSE_COUNTERS_FILE,
+  // false if the module had no counters
+  bool writeCounts(const std::string &path) const;
+
+  // called by the host side of the runtime entry points
+  void registerSites(const char *const *ids, const unsigned char *tags,
+                     unsigned count);
+  void registerCounters(const uint64_t *counters, const char *const *names,
+                        unsigned count);
+  void record(unsigned site, uint16_t tag, uint64_t payload);
+
+private:
+  TraceDecoder decoder_;
+  bool sitesSeen_ = false;
+  int exitCode_ = 0;
+  // counter values are copied out before the JIT frees their memory
+  std::vector<std::pair<std::string, uint64_t>> counts_;
+  struct CounterTable {
+    const uint64_t *counters;
+    const char *const *names;
+    unsigned count;
+  };
+  std::vector<CounterTable> counterTables_;
+};
+
+#endif // JIT_RUNNER_H
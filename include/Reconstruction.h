@@ -0,0 +1,83 @@
+#ifndef RECONSTRUCTION_H
+#define RECONSTRUCTION_H
+
+#include "llvm/ADT/ArrayRef.h"
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+class Constant;
+class Function;
+class Instruction;
+class PHINode;
+class Type;
+class Value;
+} // namespace llvm
+
+// Which values of a function the analyzer recomputes offline instead of
+// recording them. Shared by the instrumenter (minimal mode) and the analyzer,
+// so both sides agree on the set.
+//
+// Graphs show the last value of every node, so a value can only be recomputed
+// from inputs of the same execution. Blocks are cut into segments at calls (a
+// call may run the block again and overwrite the last values of everything
+// before it). Inside a segment the pure integer ops (arithmetic, compares,
+// casts, selects) are recomputed from constants and from values recorded in
+// the segment: loads, call results, phis and arguments at the start of the
+// function. Inputs from other blocks or segments are recorded once more at the
+// segment start, under "<value id>@<segment>": their own last record may be
+// newer than what the segment used, e.g. a loop header runs once more than the
+// body. A segment is recomputed only if that takes fewer records than it saves.
+//
+// Float arithmetic is always recorded, the text trace prints floats with %f
+// and recomputing from that would not match the program.
+
+// types the runtime records values of
+bool isRecordableType(const llvm::Type *type);
+
+class ReconstructionPlan {
+public:
+  explicit ReconstructionPlan(llvm::Function &function);
+
+  struct LiveIn {
+    llvm::Value *value;
+    llvm::Instruction *insertBefore; // start of the segment
+    unsigned segment;
+  };
+
+  bool isReconstructible(const llvm::Instruction *instr) const {
+    return reconstructible_.count(instr) != 0;
+  }
+  // phis a segment recomputes from; minimal traces leave out the others
+  bool needsRecord(const llvm::PHINode *phi) const {
+    return recordedPhis_.count(phi) != 0;
+  }
+  const std::vector<LiveIn> &liveIns() const { return liveIns_; }
+  // segment whose live-in copy of operand instr reads, -1 if it reads the
+  // operand's own record
+  int liveInSegment(const llvm::Instruction *instr,
+                    const llvm::Value *operand) const;
+
+  static std::string liveInKey(const std::string &valueId, unsigned segment) {
+    return valueId + "@" + std::to_string(segment);
+  }
+
+private:
+  std::unordered_set<const llvm::Instruction *> reconstructible_;
+  std::unordered_set<const llvm::PHINode *> recordedPhis_;
+  std::vector<LiveIn> liveIns_;
+  std::unordered_map<const llvm::Instruction *, unsigned> segmentOf_;
+  std::set<std::pair<unsigned, const llvm::Value *>> liveInSet_;
+};
+
+// instr folded with constant operands (in operand order), nullptr when the
+// result isn't a plain integer, e.g. for a division by zero
+llvm::Constant *evaluateReconstructible(const llvm::Instruction &instr,
+                                        llvm::ArrayRef<llvm::Constant *> ops);
+
+#endif // RECONSTRUCTION_H
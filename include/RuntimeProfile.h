@@ -0,0 +1,25 @@
+#ifndef RUNTIME_PROFILE_H
+#define RUNTIME_PROFILE_H
+
+#include "TraceDecoder.h"
+
+#include <string>
+
+// Reading runtime logs outside a graph, and merging the logs of several runs
+// of the program, one per input (-analyze -inputs), into one value profile.
+
+// values of a runtime log of any format (binary, memory-mapped or aggregate
+// trace, text lines) added to values. False if it has none.
+bool readRuntimeLog(const std::string &logFile, RuntimeValueMap &values);
+
+// adds the values of the run on input to merged, site by site. Each site
+// gets the values the run saw with input added to their inputs
+// (RuntimeValue::byInput): the distinct values of an aggregate trace, else
+// (or if there were too many) the last value overall and per thread. Counts
+// and dropped hits add up, min and max are over all runs, value is the last
+// run's. Per-thread values are dropped: thread ids of different runs have
+// nothing to do with each other.
+void mergeInputRun(RuntimeValueMap &merged, const std::string &input,
+                   const RuntimeValueMap &run);
+
+#endif // RUNTIME_PROFILE_H
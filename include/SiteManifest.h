@@ -0,0 +1,48 @@
+#ifndef SITE_MANIFEST_H
+#define SITE_MANIFEST_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Where the value of each instrumented site is in the IR. Written by the
+// instrumenter next to the instrumented module, read by the analyzer to join
+// runtime values with graph nodes by position instead of by guessing from
+// the site id.
+//
+// Blocks and instructions are counted in function order of the IR before
+// instrumentation, the IR the graph is built from (mem2reg runs first).
+struct SitePosition {
+  enum Kind : uint8_t { Argument, Instruction, Constant };
+  Kind kind = Instruction;
+  std::string function;
+  uint32_t block = 0; // instructions only
+  uint32_t index = 0; // argument number or instruction in its block
+  // the live-in copy recorded at the start of this segment, -1 for the
+  // value's own record (see ReconstructionPlan)
+  int32_t segment = -1;
+};
+
+// one line per site in site id order:
+// "<kind> <block> <index> <segment> <function>\t<site id>"
+struct SiteManifest {
+  std::vector<std::string> ids; // as in traces and text logs
+  std::vector<SitePosition> positions;
+
+  bool empty() const { return ids.empty(); }
+  void clear() {
+    ids.clear();
+    positions.clear();
+  }
+  bool write(const std::string &file) const;
+  bool read(const std::string &file);
+};
+
+// "prog_instrumented.sites" for "prog_instrumented.ll"
+std::string manifestPathFor(const std::string &modulePath);
+
+// site id of a value without a name, unique in its function: "f::add.2.5" for
+// the sixth instruction of the third block, "f::arg.1" for the second argument
+std::string positionalSiteId(const SitePosition &at, const std::string &what);
+
+#endif // SITE_MANIFEST_H
@@ -0,0 +1,99 @@
+#ifndef TRACE_DECODER_H
+#define TRACE_DECODER_H
+
+#include "TraceFormat.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// what the analyzer knows about one site after reading a trace
+struct RuntimeValue {
+  std::string value; // last recorded value, formatted like the text log
+  // last value per thread id, only for sites hit by several threads
+  std::map<unsigned, std::string> perThread;
+
+  // summary from an aggregate trace, value is then the last value
+  bool aggregated = false;
+  uint64_t count = 0;
+  std::string min;
+  std::string max;
+  std::vector<std::string> distinct;
+  bool distinctOverflow = false;
+
+  // hits the runtime left out because of sampling or the trace budget
+  uint64_t dropped = 0;
+
+  // merged runs over several inputs: every value seen, in the order first
+  // seen, with the inputs it was seen on (see RuntimeProfile.h)
+  struct InputValues {
+    std::string value;
+    std::vector<std::string> inputs;
+  };
+  std::vector<InputValues> byInput;
+
+  bool empty() const { return value.empty() && dropped == 0; }
+};
+
+using RuntimeValueMap = std::unordered_map<std::string, RuntimeValue>;
+
+// Incremental reader for the binary format from TraceFormat.h. Bytes can be
+// fed in chunks of any size (a pipe hands them out as they come), only the
+// last record of every site (overall and per thread) is kept and values are
+// formatted when published, once per changed site instead of once per record.
+class TraceDecoder {
+public:
+  // whole trace in memory; honours recordCursor of memory-mapped traces
+  bool decode(const char *data, size_t size);
+
+  // next bytes of a streamed trace. False once the trace turned out to be
+  // malformed, everything fed after that is ignored.
+  bool feed(const char *data, size_t size);
+
+  // records captured in process (-jit) instead of read from a trace: the
+  // site table the module constructor registers, then one record per hit
+  void setSites(const char *const *ids, const unsigned char *tags,
+                unsigned count);
+  void addRecord(const DefuseTraceRecord &record);
+
+  // writes the sites that changed since the last call into values, returns
+  // how many
+  size_t publish(RuntimeValueMap &values);
+
+  bool headerSeen() const { return headerSeen_; }
+  uint64_t recordCount() const { return recordCount_; }
+  size_t threadCount() const { return lastByThread_.size(); }
+
+private:
+  void parseHeader();
+  void resetTables();
+  void consume(const char *data, size_t size);
+  void addAggregate(const DefuseTraceAggregate &aggregate);
+  void markDirty(uint32_t site);
+  std::string siteName(uint32_t site) const;
+
+  DefuseTraceHeader header_ = DefuseTraceHeader();
+  bool headerSeen_ = false;
+  bool broken_ = false;
+  size_t entrySize_ = 0;
+  // header bytes or the tail of a record split across two chunks
+  std::vector<char> pending_;
+
+  std::vector<DefuseTraceSite> sites_;
+  std::vector<char> strings_;
+
+  // a zero tag marks sites without records, the runtime never writes it
+  std::vector<DefuseTraceRecord> last_;
+  std::vector<std::vector<DefuseTraceRecord>> lastByThread_;
+  std::vector<unsigned> threadsPerSite_;
+  std::vector<uint64_t> dropped_;
+  std::vector<DefuseTraceAggregate> aggregates_;
+  std::vector<bool> dirty_;
+  std::vector<uint32_t> dirtySites_;
+  uint64_t recordCount_ = 0;
+};
+
+#endif // TRACE_DECODER_H
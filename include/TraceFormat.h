@@ -0,0 +1,85 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+// Binary trace layout shared by runtime/core_runtime.c (writer) and
+// GraphVisualizer (reader). This header must stay valid C.
+//
+// file = DefuseTraceHeader
+//        DefuseTraceSite[siteCount]
+//        site names (NUL-terminated, stringBytes total)
+//        padding up to recordsOffset
+//        DefuseTraceRecord[...] or DefuseTraceAggregate[...] (by kind) until
+//        end of file
+
+#include <stdint.h>
+
+#define DEFUSE_TRACE_MAGIC "DUTRACE1"
+#define DEFUSE_TRACE_MAGIC_SIZE 8
+#define DEFUSE_TRACE_VERSION 5u
+
+// type of the raw payload, also used by the instrumenter for site tags
+enum DefuseTraceTag {
+  DEFUSE_TAG_NONE = 0,
+  DEFUSE_TAG_I32 = 1,
+  DEFUSE_TAG_I64 = 2,
+  DEFUSE_TAG_FLOAT = 3,
+  DEFUSE_TAG_DOUBLE = 4,
+  // not a value: payload is the number of hits of the site the thread did
+  // not record because of sampling or the trace budget
+  DEFUSE_TAG_DROPPED = 5
+};
+
+enum DefuseTraceKind {
+  DEFUSE_KIND_RECORDS = 0,  // one record per dynamic execution
+  DEFUSE_KIND_AGGREGATE = 1 // one summary per site, written at exit
+};
+
+struct DefuseTraceHeader {
+  char magic[DEFUSE_TRACE_MAGIC_SIZE];
+  uint32_t version;
+  uint32_t kind; // DefuseTraceKind
+  uint32_t siteCount;
+  uint32_t stringBytes;
+  uint32_t recordsOffset;
+  uint32_t padding;
+  // records reserved so far, bumped atomically by writers of memory-mapped
+  // traces. Records past it are garbage, reserved ones not written yet have a
+  // zero tag. 0 in streamed traces, which end at the end of the file.
+  uint64_t recordCursor;
+};
+
+struct DefuseTraceSite {
+  uint32_t nameOffset; // into the string block
+  uint32_t tag;        // DefuseTraceTag
+};
+
+// fixed-size record: one per dynamic execution of an instrumented site.
+// Threads flush their own buffers, so records are ordered per thread only.
+// Writers of memory-mapped traces store the tag last.
+struct DefuseTraceRecord {
+  uint32_t site;
+  uint16_t tag;
+  uint16_t thread; // dense, in order of the thread's first record
+  uint64_t payload; // sign-extended ints, float bits in the low 32 bits,
+                    // double bits as is
+};
+
+// distinct values are tracked exactly up to this many per site
+#define DEFUSE_DISTINCT_SLOTS 8
+// DefuseTraceAggregate::distinct value once a site saw more than that
+#define DEFUSE_DISTINCT_OVERFLOW 0xffffu
+
+// per-site summary; min/max/last/values use the DefuseTraceRecord encoding
+struct DefuseTraceAggregate {
+  uint32_t site;
+  uint16_t tag;
+  uint16_t distinct; // number of valid values[], or DEFUSE_DISTINCT_OVERFLOW
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t last;
+  uint64_t dropped; // hits left out of the summary by sampling
+  uint64_t values[DEFUSE_DISTINCT_SLOTS];
+};
+
+#endif // TRACE_FORMAT_H
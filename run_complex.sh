@@ -39,7 +39,7 @@ RLOG=outputs/complex/runtime.log
 bin/defuse-analyzer -instrument "$M2R" "$INS" > logs/complex.instrument.log 2>&1 \
   || (tail -n 120 logs/complex.instrument.log && exit 1)
 
-$CC -O0 runtime/core_runtime.c "$INS" -o "$PROG" > logs/complex.buildprog.log 2>&1 \
+$CC -O0 -pthread runtime/core_runtime.c "$INS" -o "$PROG" > logs/complex.buildprog.log 2>&1 \
   || (tail -n 120 logs/complex.buildprog.log && exit 1)
 
 "$PROG" > "$RLOG" 2>/dev/null || true
@@ -32,7 +32,7 @@ $OPT -S -passes=mem2reg "$LL" -o "$M2R"
 bin/defuse-analyzer -instrument "$M2R" "$INS" > logs/medium.instrument.log 2>&1 \
   || (tail -n 120 logs/medium.instrument.log && exit 1)
 
-$CC -O0 runtime/core_runtime.c "$INS" -o "$PROG" > logs/medium.buildprog.log 2>&1 \
+$CC -O0 -pthread runtime/core_runtime.c "$INS" -o "$PROG" > logs/medium.buildprog.log 2>&1 \
   || (tail -n 120 logs/medium.buildprog.log && exit 1)
 
 "$PROG" > "$RLOG" 2>/dev/null || true
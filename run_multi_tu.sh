@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# два модуля, каждый инструментирован плагином отдельно (как clang -fpass-plugin),
+# один бинарный трейс: значения не должны путаться между модулями
+
+# запускать из корня проекта: ./run_multi_tu.sh
+
+mkdir -p llvm logs outputs/multi_tu
+
+[ -x bin/defuse-analyzer ] || { echo "ERROR: bin/defuse-analyzer not found. Run ./build.sh"; exit 1; }
+[ -f bin/DefUseInstrument.so ] || { echo "ERROR: bin/DefUseInstrument.so not found. Run ./build.sh"; exit 1; }
+command -v clang     >/dev/null 2>&1 || { echo "ERROR: clang not found"; exit 1; }
+command -v opt       >/dev/null 2>&1 || { echo "ERROR: opt not found"; exit 1; }
+command -v llvm-link >/dev/null 2>&1 || { echo "ERROR: llvm-link not found"; exit 1; }
+
+CC=${CC:-clang}
+OPT=${OPT:-opt}
+LINK=${LINK:-llvm-link}
+
+M2R=llvm/multi_tu_mem2reg.ll
+PROG=outputs/multi_tu/program
+TRACE=outputs/multi_tu/runtime.trace
+DOT=outputs/multi_tu/enhanced_graph.dot
+
+# 1) per-module IR, instrumented one module at a time
+for tu in main bfun; do
+  $CC -S -emit-llvm -O0 -Xclang -disable-O0-optnone -fno-discard-value-names tests/multi_tu/$tu.c -o llvm/multi_tu_$tu.ll
+  $OPT -S -passes=mem2reg llvm/multi_tu_$tu.ll -o llvm/multi_tu_${tu}_mem2reg.ll
+  $OPT -load-pass-plugin bin/DefUseInstrument.so -passes=defuse-instrument \
+    llvm/multi_tu_${tu}_mem2reg.ll -o outputs/multi_tu/$tu.bc > logs/multi_tu.instrument.log 2>&1 \
+    || (tail -n 120 logs/multi_tu.instrument.log && exit 1)
+done
+
+# 2) build (the runtime without the plugin) + run
+$CC -O0 -pthread outputs/multi_tu/main.bc outputs/multi_tu/bfun.bc runtime/core_runtime.c -o "$PROG" \
+  > logs/multi_tu.buildprog.log 2>&1 || (tail -n 120 logs/multi_tu.buildprog.log && exit 1)
+
+DEFUSE_TRACE=binary DEFUSE_TRACE_FILE="$TRACE" "$PROG" > /dev/null 2>&1 || true
+
+# 3) runtime graph of both modules
+$LINK -S llvm/multi_tu_main_mem2reg.ll llvm/multi_tu_bfun_mem2reg.ll -o "$M2R"
+bin/defuse-analyzer -graph "$M2R" "$TRACE" "$DOT" > logs/multi_tu.runtime.log 2>&1 \
+  || (tail -n 120 logs/multi_tu.runtime.log && exit 1)
+
+# 4) main's constant 40 has its own value, not a site of bfun with the same number
+grep -q 'label="i32 40    VALUE=40"' "$DOT" \
+  || { echo "ERROR: main::const_40 has a value of another module"; exit 1; }
+grep -q 'label="  %add = add nsw i32 %mul, 6    VALUE=126"' "$DOT" \
+  || { echo "ERROR: wrong value for bfun's q"; exit 1; }
+
+echo "[run_multi_tu] ok -> outputs/multi_tu"
@@ -35,7 +35,7 @@ $OPT -S -passes=mem2reg "$LL" -o "$M2R"
 bin/defuse-analyzer -instrument "$M2R" "$INS" > logs/simple.instrument.log 2>&1 \
   || (tail -n 120 logs/simple.instrument.log && exit 1)
 
-$CC -O0 runtime/core_runtime.c "$INS" -o "$PROG" > logs/simple.buildprog.log 2>&1 \
+$CC -O0 -pthread runtime/core_runtime.c "$INS" -o "$PROG" > logs/simple.buildprog.log 2>&1 \
   || (tail -n 120 logs/simple.buildprog.log && exit 1)
 
 "$PROG" > "$RLOG" 2>/dev/null || true
@@ -1,10 +1,900 @@
 // Core runtime library for def-use graph instrumentation
+
+// CLOCK_MONOTONIC_COARSE, MAP_NORESERVE, ftruncate and PIPE_BUF are not in
+// strict ISO C; users link this file into builds with -std=c11 and the like
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>// TODO[Dkay]: my LSP says that this header is unused. Pls, setup yours too 
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/TraceFormat.h"
+
+// Trace mode is read once from the environment:
+//   DEFUSE_TRACE=text       (default) "node_id:value" lines on stdout, for
+//                           debugging
+//   DEFUSE_TRACE=binary     fixed-size records (see TraceFormat.h) appended to
+//                           DEFUSE_TRACE_FILE, "runtime.trace" by default
+//   DEFUSE_TRACE=aggregate  one count/min/max/last/distinct summary per site,
+//                           written to DEFUSE_TRACE_FILE once at exit
+//   DEFUSE_TRACE=mmap       binary records stored straight into a shared
+//                           mapping of DEFUSE_TRACE_FILE; survives crashes,
+//                           _exit and kills of the program
+//
+// In binary and aggregate modes every thread works on its own state without
+// locking. Record buffers are flushed with a single O_APPEND write, aggregate
+// tables are merged into the process-wide table. State of exited threads is
+// handled by the TLS destructor, the rest at exit.
+//
+// In mmap mode threads reserve chunks of record slots by bumping the
+// recordCursor in the mapped header and write records in place, tag last.
+// Nothing is buffered in the process, so a crash loses at most the records
+// being written at that moment. The file grows on demand.
+//
+// DEFUSE_TRACE_FILE may be a FIFO the analyzer reads while the program runs
+// (-stream). Writes to it are split at record boundaries into PIPE_BUF sized
+// pieces, which the kernel never interleaves with writes of other threads,
+// and buffers are also flushed when they are older than TRACE_PIPE_FLUSH_MS,
+// so a live view doesn't wait for slow threads to fill them.
+//
+// Limits for binary, mmap and aggregate traces, all optional:
+//   DEFUSE_TRACE_FIRST_N=N  record only the first N hits of every site
+//   DEFUSE_TRACE_SAMPLE=K   record every K-th hit (after the first N, if set)
+//   DEFUSE_TRACE_BUDGET=B   stop recording after B bytes of records (binary
+//                           and mmap only), accepts K/M/G suffixes
+// Hits are counted per thread, so limits apply to each thread separately.
+// Left out hits are counted per site and reported in the trace.
+//
+// Modules instrumented with -counters increment per-block and per-edge
+// counters in their own global array instead of calling in here. The arrays
+// are registered by the module constructor and written at exit as
+// "name:count" lines to DEFUSE_COUNTERS_FILE, "runtime.counts" by default.
+//
+// Modules instrumented with -batched hand over all values of a basic block in
+// one defuse_record_block call; they are traced like separate calls.
+enum trace_mode { TRACE_TEXT, TRACE_BINARY, TRACE_AGGREGATE, TRACE_MMAP };
+
+#define TRACE_BUFFER_RECORDS 4096
+// DefuseTraceRecord::thread of the 65536th thread and all after it
+#define TRACE_MAX_THREAD_ID 0xffffu
+#define TRACE_PIPE_FLUSH_MS 100
+// records a thread takes from the shared budget at once
+#define TRACE_BUDGET_CHUNK 256
+// record slots a thread reserves in the mapping at once
+#define TRACE_MMAP_CHUNK 256
+#define TRACE_MMAP_INITIAL_SIZE (1u << 20)
+// address space reserved for the mapping, the file itself grows on demand
+#define TRACE_MMAP_MAX_SIZE (1ull << 36)
+// end of the mapping only DEFUSE_TAG_DROPPED records go into, so the counts
+// of what didn't fit still get to the trace
+#define TRACE_MMAP_DROPPED_RESERVE (1ull << 20)
+
+struct trace_site_hits {
+    uint64_t hits;
+    uint64_t dropped;
+};
+
+struct trace_thread {
+    struct DefuseTraceRecord *records; // binary mode
+    unsigned count;
+    struct DefuseTraceRecord *chunk; // mmap mode, next reserved slot
+    unsigned chunk_left;
+    struct DefuseTraceAggregate *aggregates; // aggregate mode, by site
+    unsigned aggregate_capacity;
+    struct trace_site_hits *site_hits; // with limits only, by site
+    unsigned site_hits_capacity;
+    uint64_t budget_records; // taken from trace_budget_left, not used yet
+    uint64_t flushed_ms; // pipes only, time of the last flush
+    uint16_t thread;
+    struct trace_thread *next;
+};
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static int trace_initialized;
+static enum trace_mode trace_mode;
+static int trace_fd = -1;
+static int trace_header_written;
+static int trace_to_pipe;
+
+static struct DefuseTraceHeader *trace_map;
+static uint64_t trace_map_size; // current file size
+// value records no longer fit: the size limit is reached or the file can't
+// grow
+static int trace_map_full;
+static pthread_mutex_t trace_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t trace_first_n;
+static uint64_t trace_sample;
+static int trace_limited;
+static int trace_budgeted;
+static uint64_t trace_budget_left; // records, shared by all threads
+
+static pthread_key_t trace_thread_key;
+static __thread struct trace_thread *current_thread;
+static pthread_mutex_t trace_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_thread *trace_threads;
+static unsigned trace_thread_count;
+
+// merged tables of finished threads, guarded by trace_threads_lock
+static struct DefuseTraceAggregate *merged_aggregates;
+static unsigned merged_capacity;
+
+// tells the instrumenter this module is the runtime, which it must not
+// instrument (see isRuntimeModule in Instrumentation.cpp)
+const char defuse_runtime[] = "defuse runtime";
+
+// the site tables of all instrumented modules one after the other, each
+// module's sites numbered from the base defuse_register_sites gave it.
+// Grown under trace_threads_lock; replaced arrays are not freed, threads
+// read them without the lock.
+static const char **site_ids;
+static unsigned char *site_tags;
+static unsigned site_count;
+static unsigned site_capacity;
+// sites in the header of a records trace, later ones can't be added to it
+static unsigned header_site_count;
+
+static void *trace_alloc(size_t count, size_t size) {
+    void *data = calloc(count, size);
+    if (!data) {
+        fprintf(stderr, "defuse runtime: out of memory\n");
+        abort();
+    }
+    return data;
+}
+
+static void write_all(int fd, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return;
+        p += n;
+        size -= (size_t)n;
+    }
+}
+
+static void trace_write_header(uint32_t kind) {
+    struct DefuseTraceHeader header;
+    struct DefuseTraceSite site;
+    static const char zeros[16];
+    uint32_t string_bytes = 0;
+    unsigned i;
+
+    trace_header_written = 1;
+    header_site_count = site_count;
+
+    for (i = 0; i < site_count; i++)
+        string_bytes += (uint32_t)strlen(site_ids[i]) + 1;
+
+    memcpy(header.magic, DEFUSE_TRACE_MAGIC, DEFUSE_TRACE_MAGIC_SIZE);
+    header.version = DEFUSE_TRACE_VERSION;
+    header.kind = kind;
+    header.siteCount = site_count;
+    header.stringBytes = string_bytes;
+    header.recordsOffset = (uint32_t)(sizeof(header) +
+                                      site_count * sizeof(site) +
+                                      string_bytes + 15) & ~15u;
+    header.padding = 0;
+    header.recordCursor = 0;
+    write_all(trace_fd, &header, sizeof(header));
+
+    string_bytes = 0;
+    for (i = 0; i < site_count; i++) {
+        site.nameOffset = string_bytes;
+        site.tag = site_tags[i];
+        write_all(trace_fd, &site, sizeof(site));
+        string_bytes += (uint32_t)strlen(site_ids[i]) + 1;
+    }
+    for (i = 0; i < site_count; i++)
+        write_all(trace_fd, site_ids[i], strlen(site_ids[i]) + 1);
+
+    write_all(trace_fd, zeros,
+              header.recordsOffset -
+                  (sizeof(header) + site_count * sizeof(site) + string_bytes));
+}
+
+// coarse clock: read on every record that goes to a pipe
+static uint64_t trace_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// one write per buffer: O_APPEND keeps concurrent flushes from overlapping.
+// Pipes only guarantee that for writes up to PIPE_BUF.
+static void trace_flush_records(struct trace_thread *state) {
+    const size_t piece = PIPE_BUF / sizeof(struct DefuseTraceRecord);
+    size_t done = 0;
+
+    if (!trace_to_pipe) {
+        write_all(trace_fd, state->records,
+                  state->count * sizeof(struct DefuseTraceRecord));
+        state->count = 0;
+        return;
+    }
+    while (done < state->count) {
+        size_t n = state->count - done < piece ? state->count - done : piece;
+        write_all(trace_fd, state->records + done,
+                  n * sizeof(struct DefuseTraceRecord));
+        done += n;
+    }
+    state->count = 0;
+    state->flushed_ms = trace_now_ms();
+}
+
+static int trace_records_mode(void) {
+    return trace_mode == TRACE_BINARY || trace_mode == TRACE_MMAP;
+}
+
+// makes sure the file covers `size` bytes, so stores into the mapping below
+// it can't fault
+static int trace_mmap_ensure(uint64_t size) {
+    int ok = 1;
+    if (size <= __atomic_load_n(&trace_map_size, __ATOMIC_ACQUIRE))
+        return 1;
+    if (size > TRACE_MMAP_MAX_SIZE)
+        return 0;
+
+    pthread_mutex_lock(&trace_map_lock);
+    if (size > trace_map_size) {
+        uint64_t new_size = trace_map_size;
+        while (new_size < size)
+            new_size *= 2;
+        if (new_size > TRACE_MMAP_MAX_SIZE)
+            new_size = TRACE_MMAP_MAX_SIZE;
+        if (ftruncate(trace_fd, (off_t)new_size) == 0)
+            __atomic_store_n(&trace_map_size, new_size, __ATOMIC_RELEASE);
+        else
+            ok = 0;
+    }
+    pthread_mutex_unlock(&trace_map_lock);
+    return ok;
+}
+
+static void trace_mmap_start(void) {
+    void *map;
+
+    trace_map_size = TRACE_MMAP_INITIAL_SIZE;
+    if (ftruncate(trace_fd, (off_t)trace_map_size) != 0) {
+        fprintf(stderr, "defuse runtime: can't size trace file\n");
+        return;
+    }
+    map = mmap(NULL, TRACE_MMAP_MAX_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_NORESERVE, trace_fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "defuse runtime: can't map trace file\n");
+        return;
+    }
+    trace_map = (struct DefuseTraceHeader *)map;
+}
+
+// callers hold trace_threads_lock
+static void trace_start_records(void) {
+    trace_write_header(DEFUSE_KIND_RECORDS);
+    if (trace_mode == TRACE_MMAP)
+        trace_mmap_start();
+}
+
+// hits of site in the thread's table, grown on demand
+static struct trace_site_hits *trace_site_hits(struct trace_thread *state,
+                                               unsigned site) {
+    if (site >= state->site_hits_capacity) {
+        unsigned capacity = site_count > site ? site_count : site + 1;
+        struct trace_site_hits *grown = (struct trace_site_hits *)trace_alloc(
+            capacity, sizeof(*grown));
+        if (state->site_hits) {
+            memcpy(grown, state->site_hits,
+                   state->site_hits_capacity * sizeof(*grown));
+            free(state->site_hits);
+        }
+        state->site_hits = grown;
+        state->site_hits_capacity = capacity;
+    }
+    return &state->site_hits[site];
+}
+
+// The cursor only moves past slots the file already covers, so it never
+// points beyond the file, however many records don't fit.
+static struct DefuseTraceRecord *trace_mmap_slot(struct trace_thread *state,
+                                                 int dropped) {
+    if (!trace_map)
+        return NULL;
+    if (state->chunk_left == 0) {
+        uint64_t limit = dropped
+                             ? TRACE_MMAP_MAX_SIZE
+                             : TRACE_MMAP_MAX_SIZE - TRACE_MMAP_DROPPED_RESERVE;
+        uint64_t first, end;
+
+        if (!dropped && __atomic_load_n(&trace_map_full, __ATOMIC_RELAXED))
+            return NULL;
+        first = __atomic_load_n(&trace_map->recordCursor, __ATOMIC_RELAXED);
+        do {
+            end = trace_map->recordsOffset +
+                  (first + TRACE_MMAP_CHUNK) * sizeof(struct DefuseTraceRecord);
+            if (end > limit || !trace_mmap_ensure(end)) {
+                if (!dropped &&
+                    !__atomic_exchange_n(&trace_map_full, 1, __ATOMIC_RELAXED))
+                    fprintf(stderr, "defuse runtime: trace file full, further "
+                                    "records are counted as dropped\n");
+                return NULL;
+            }
+        } while (!__atomic_compare_exchange_n(
+            &trace_map->recordCursor, &first, first + TRACE_MMAP_CHUNK, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        state->chunk = (struct DefuseTraceRecord *)((char *)trace_map +
+                                                    trace_map->recordsOffset) +
+                       first;
+        state->chunk_left = TRACE_MMAP_CHUNK;
+    }
+    state->chunk_left--;
+    return state->chunk++;
+}
+
+// stores one record into the thread's buffer or, in mmap mode, in place
+static void trace_emit(struct trace_thread *state, unsigned site, uint32_t tag,
+                       uint64_t payload) {
+    struct DefuseTraceRecord *record;
+
+    if (trace_mode == TRACE_MMAP) {
+        record = trace_mmap_slot(state, tag == DEFUSE_TAG_DROPPED);
+        if (!record) {
+            // reported like hits left out by sampling
+            if (tag != DEFUSE_TAG_DROPPED)
+                trace_site_hits(state, site)->dropped++;
+            return;
+        }
+        record->site = site;
+        record->thread = state->thread;
+        record->payload = payload;
+        // readers take a non-zero tag as "record complete"
+        __atomic_store_n(&record->tag, (uint16_t)tag, __ATOMIC_RELEASE);
+        return;
+    }
+
+    record = &state->records[state->count++];
+    record->site = site;
+    record->tag = (uint16_t)tag;
+    record->thread = state->thread;
+    record->payload = payload;
+    if (state->count == TRACE_BUFFER_RECORDS ||
+        (trace_to_pipe &&
+         trace_now_ms() - state->flushed_ms >= TRACE_PIPE_FLUSH_MS))
+        trace_flush_records(state);
+}
+
+// ordering of raw payloads, by their type
+static int payload_less(uint16_t tag, uint64_t a, uint64_t b) {
+    switch (tag) {
+    case DEFUSE_TAG_FLOAT: {
+        uint32_t bits_a = (uint32_t)a, bits_b = (uint32_t)b;
+        float value_a, value_b;
+        memcpy(&value_a, &bits_a, sizeof(value_a));
+        memcpy(&value_b, &bits_b, sizeof(value_b));
+        return value_a < value_b;
+    }
+    case DEFUSE_TAG_DOUBLE: {
+        double value_a, value_b;
+        memcpy(&value_a, &a, sizeof(value_a));
+        memcpy(&value_b, &b, sizeof(value_b));
+        return value_a < value_b;
+    }
+    default:
+        return (int64_t)a < (int64_t)b;
+    }
+}
+
+static void aggregate_add_distinct(struct DefuseTraceAggregate *aggregate,
+                                   uint64_t payload) {
+    unsigned i;
+    if (aggregate->distinct == DEFUSE_DISTINCT_OVERFLOW)
+        return;
+    for (i = 0; i < aggregate->distinct; i++) {
+        if (aggregate->values[i] == payload)
+            return;
+    }
+    if (aggregate->distinct == DEFUSE_DISTINCT_SLOTS) {
+        aggregate->distinct = DEFUSE_DISTINCT_OVERFLOW;
+        return;
+    }
+    aggregate->values[aggregate->distinct++] = payload;
+}
+
+static void aggregate_add(struct DefuseTraceAggregate *aggregate, uint16_t tag,
+                          uint64_t payload) {
+    if (aggregate->count == 0) {
+        aggregate->tag = tag;
+        aggregate->min = payload;
+        aggregate->max = payload;
+    } else {
+        if (payload_less(tag, payload, aggregate->min))
+            aggregate->min = payload;
+        if (payload_less(tag, aggregate->max, payload))
+            aggregate->max = payload;
+    }
+    aggregate->count++;
+    aggregate->last = payload;
+    aggregate_add_distinct(aggregate, payload);
+}
+
+static void aggregate_merge(struct DefuseTraceAggregate *into,
+                            const struct DefuseTraceAggregate *from) {
+    unsigned i;
+    uint64_t dropped = into->dropped + from->dropped;
+    if (from->count == 0) {
+        into->dropped = dropped;
+        return;
+    }
+    if (into->count == 0) {
+        *into = *from;
+        into->dropped = dropped;
+        return;
+    }
+    into->dropped = dropped;
+    into->count += from->count;
+    if (payload_less(from->tag, from->min, into->min))
+        into->min = from->min;
+    if (payload_less(from->tag, into->max, from->max))
+        into->max = from->max;
+    into->last = from->last;
+    if (from->distinct == DEFUSE_DISTINCT_OVERFLOW) {
+        into->distinct = DEFUSE_DISTINCT_OVERFLOW;
+        return;
+    }
+    for (i = 0; i < from->distinct; i++)
+        aggregate_add_distinct(into, from->values[i]);
+}
+
+// grows a per-site table to hold `site`; new entries have count == 0
+static void aggregate_reserve(struct DefuseTraceAggregate **table,
+                              unsigned *capacity, unsigned site) {
+    unsigned new_capacity;
+    struct DefuseTraceAggregate *grown;
+
+    if (site < *capacity)
+        return;
+    new_capacity = site_count > site ? site_count : site + 1;
+    grown = (struct DefuseTraceAggregate *)trace_alloc(new_capacity,
+                                                       sizeof(*grown));
+    if (*table) {
+        memcpy(grown, *table, *capacity * sizeof(*grown));
+        free(*table);
+    }
+    *table = grown;
+    *capacity = new_capacity;
+}
+
+// callers hold trace_threads_lock
+static void trace_merge_thread(struct trace_thread *state) {
+    unsigned site;
+    if (state->aggregate_capacity > 0)
+        aggregate_reserve(&merged_aggregates, &merged_capacity,
+                          state->aggregate_capacity - 1);
+    if (state->site_hits_capacity > 0)
+        aggregate_reserve(&merged_aggregates, &merged_capacity,
+                          state->site_hits_capacity - 1);
+
+    for (site = 0; site < state->aggregate_capacity; site++)
+        aggregate_merge(&merged_aggregates[site], &state->aggregates[site]);
+    for (site = 0; site < state->site_hits_capacity; site++) {
+        merged_aggregates[site].dropped += state->site_hits[site].dropped;
+        state->site_hits[site].dropped = 0;
+    }
+    if (state->aggregates)
+        memset(state->aggregates, 0,
+               state->aggregate_capacity * sizeof(*state->aggregates));
+}
+
+// record modes, when the thread is done: DEFUSE_TAG_DROPPED record per site
+static void trace_flush_dropped(struct trace_thread *state) {
+    unsigned site;
+    for (site = 0; site < state->site_hits_capacity; site++) {
+        if (state->site_hits[site].dropped == 0)
+            continue;
+        trace_emit(state, site, DEFUSE_TAG_DROPPED,
+                   state->site_hits[site].dropped);
+        state->site_hits[site].dropped = 0;
+    }
+    if (state->records)
+        trace_flush_records(state);
+}
+
+static void trace_release_thread(void *data) {
+    struct trace_thread *state = (struct trace_thread *)data;
+    struct trace_thread **link;
+
+    pthread_mutex_lock(&trace_threads_lock);
+    if (state->records)
+        trace_flush_records(state);
+    if (trace_records_mode())
+        trace_flush_dropped(state);
+    trace_merge_thread(state);
+    for (link = &trace_threads; *link; link = &(*link)->next) {
+        if (*link == state) {
+            *link = state->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&trace_threads_lock);
+    // runs in the exiting thread; later destructors may still record values,
+    // they get a fresh state, which this destructor is called again for
+    current_thread = NULL;
+    free(state->records);
+    free(state->aggregates);
+    free(state->site_hits);
+    free(state);
+}
+
+static void trace_flush_all(void) {
+    struct trace_thread *state;
+    unsigned site;
+
+    pthread_mutex_lock(&trace_threads_lock);
+    if (trace_records_mode()) {
+        if (!trace_header_written)
+            trace_start_records();
+        for (state = trace_threads; state; state = state->next) {
+            if (state->records)
+                trace_flush_records(state);
+            trace_flush_dropped(state);
+        }
+    } else {
+        for (state = trace_threads; state; state = state->next)
+            trace_merge_thread(state);
+        trace_write_header(DEFUSE_KIND_AGGREGATE);
+        for (site = 0; site < merged_capacity; site++) {
+            if (merged_aggregates[site].count == 0 &&
+                merged_aggregates[site].dropped == 0)
+                continue;
+            merged_aggregates[site].site = site;
+            write_all(trace_fd, &merged_aggregates[site],
+                      sizeof(merged_aggregates[site]));
+        }
+    }
+    pthread_mutex_unlock(&trace_threads_lock);
+}
+
+static uint64_t env_size(const char *name) {
+    const char *text = getenv(name);
+    char *end;
+    unsigned long long value;
+
+    if (!text || !text[0])
+        return 0;
+    value = strtoull(text, &end, 10);
+    switch (*end) {
+    case 'g':
+    case 'G':
+        value <<= 10;
+        // fall through
+    case 'm':
+    case 'M':
+        value <<= 10;
+        // fall through
+    case 'k':
+    case 'K':
+        value <<= 10;
+        break;
+    default:
+        break;
+    }
+    return value;
+}
+
+static void trace_init_limits(void) {
+    uint64_t budget = env_size("DEFUSE_TRACE_BUDGET");
+
+    trace_first_n = env_size("DEFUSE_TRACE_FIRST_N");
+    trace_sample = env_size("DEFUSE_TRACE_SAMPLE");
+    if (trace_records_mode() && budget > 0) {
+        trace_budgeted = 1;
+        trace_budget_left = budget / sizeof(struct DefuseTraceRecord);
+    }
+    trace_limited = trace_first_n > 0 || trace_sample > 1 || trace_budgeted;
+}
+
+static void trace_init(void) {
+    const char *mode = getenv("DEFUSE_TRACE");
+    const char *path = getenv("DEFUSE_TRACE_FILE");
+
+    trace_mode = TRACE_TEXT;
+    if (mode && strcmp(mode, "binary") == 0)
+        trace_mode = TRACE_BINARY;
+    else if (mode && strcmp(mode, "aggregate") == 0)
+        trace_mode = TRACE_AGGREGATE;
+    else if (mode && strcmp(mode, "mmap") == 0)
+        trace_mode = TRACE_MMAP;
+
+    if (trace_mode != TRACE_TEXT) {
+        // the header is written with write() in every mode, mmap mode maps
+        // the file afterwards
+        int flags = trace_mode == TRACE_MMAP
+                        ? O_RDWR | O_CREAT | O_TRUNC
+                        : O_WRONLY | O_CREAT | O_TRUNC | O_APPEND;
+        trace_fd = open(path && path[0] ? path : "runtime.trace", flags, 0644);
+        if (trace_fd < 0) {
+            fprintf(stderr,
+                    "defuse runtime: can't open trace file, using text\n");
+            trace_mode = TRACE_TEXT;
+        } else {
+            struct stat st;
+            trace_to_pipe = fstat(trace_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+            trace_init_limits();
+            pthread_key_create(&trace_thread_key, trace_release_thread);
+            atexit(trace_flush_all);
+        }
+    }
+    __atomic_store_n(&trace_initialized, 1, __ATOMIC_RELEASE);
+}
+
+static struct trace_thread *trace_current_thread(void) {
+    struct trace_thread *state = current_thread;
+    if (state)
+        return state;
+
+    state = (struct trace_thread *)trace_alloc(1, sizeof(*state));
+    if (trace_mode == TRACE_BINARY)
+        state->records = (struct DefuseTraceRecord *)trace_alloc(
+            TRACE_BUFFER_RECORDS, sizeof(*state->records));
+
+    pthread_mutex_lock(&trace_threads_lock);
+    // records of this thread must not precede the header in the file
+    if (trace_records_mode() && !trace_header_written)
+        trace_start_records();
+    // record thread ids are 16 bits: later threads share the last id
+    if (trace_thread_count == TRACE_MAX_THREAD_ID)
+        fprintf(stderr, "defuse runtime: more than %u threads, the rest are "
+                        "traced as thread %u\n",
+                TRACE_MAX_THREAD_ID, TRACE_MAX_THREAD_ID);
+    state->thread = (uint16_t)(trace_thread_count < TRACE_MAX_THREAD_ID
+                                   ? trace_thread_count
+                                   : TRACE_MAX_THREAD_ID);
+    trace_thread_count++;
+    state->next = trace_threads;
+    trace_threads = state;
+    pthread_mutex_unlock(&trace_threads_lock);
+
+    pthread_setspecific(trace_thread_key, state);
+    current_thread = state;
+    return state;
+}
+
+// takes one record from the shared budget, in chunks so threads rarely touch
+// the shared counter; a thread holds back at most one unused chunk
+static int trace_take_budget(struct trace_thread *state) {
+    uint64_t left, take;
+
+    if (state->budget_records > 0) {
+        state->budget_records--;
+        return 1;
+    }
+    left = __atomic_load_n(&trace_budget_left, __ATOMIC_RELAXED);
+    do {
+        if (left == 0)
+            return 0;
+        take = left < TRACE_BUDGET_CHUNK ? left : TRACE_BUDGET_CHUNK;
+    } while (!__atomic_compare_exchange_n(&trace_budget_left, &left,
+                                          left - take, 1, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    state->budget_records = take - 1;
+    return 1;
+}
+
+// first-N / 1-in-K / budget decision, counts what it leaves out
+static int trace_should_record(struct trace_thread *state, unsigned site) {
+    struct trace_site_hits *hits = trace_site_hits(state, site);
+    uint64_t hit = hits->hits++;
+
+    if (trace_first_n > 0 && hit >= trace_first_n) {
+        if (trace_sample <= 1 || (hit - trace_first_n) % trace_sample != 0) {
+            hits->dropped++;
+            return 0;
+        }
+    } else if (trace_first_n == 0 && trace_sample > 1 &&
+               hit % trace_sample != 0) {
+        hits->dropped++;
+        return 0;
+    }
+    if (trace_budgeted && !trace_take_budget(state)) {
+        hits->dropped++;
+        return 0;
+    }
+    return 1;
+}
+
+static void trace_append(unsigned site, uint32_t tag, uint64_t payload) {
+    struct trace_thread *state = trace_current_thread();
+    if (site >= header_site_count)
+        return;
+    if (trace_limited && !trace_should_record(state, site))
+        return;
+    trace_emit(state, site, tag, payload);
+}
+
+static void trace_aggregate(unsigned site, uint32_t tag, uint64_t payload) {
+    struct trace_thread *state = trace_current_thread();
+    if (trace_limited && !trace_should_record(state, site))
+        return;
+    aggregate_reserve(&state->aggregates, &state->aggregate_capacity, site);
+    aggregate_add(&state->aggregates[site], (uint16_t)tag, payload);
+}
+
+// Returns 0 in text mode, where the caller prints the value itself.
+static int trace_value(unsigned site, uint32_t tag, uint64_t payload) {
+    if (!__atomic_load_n(&trace_initialized, __ATOMIC_ACQUIRE))
+        pthread_once(&trace_once, trace_init);
+
+    switch (trace_mode) {
+    case TRACE_BINARY:
+    case TRACE_MMAP:
+        trace_append(site, tag, payload);
+        return 1;
+    case TRACE_AGGREGATE:
+        trace_aggregate(site, tag, payload);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+struct counter_table {
+    const uint64_t *counters;
+    const char *const *names;
+    unsigned count;
+    struct counter_table *next;
+};
+
+static pthread_mutex_t counter_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct counter_table *counter_tables;
+
+static void counters_dump(void) {
+    const char *path = getenv("DEFUSE_COUNTERS_FILE");
+    struct counter_table *table;
+    unsigned i;
+    FILE *out = fopen(path && path[0] ? path : "runtime.counts", "w");
+
+    if (!out) {
+        fprintf(stderr, "defuse runtime: can't open counters file\n");
+        return;
+    }
+    pthread_mutex_lock(&counter_tables_lock);
+    for (table = counter_tables; table; table = table->next) {
+        for (i = 0; i < table->count; i++)
+            fprintf(out, "%s:%llu\n", table->names[i],
+                    (unsigned long long)__atomic_load_n(&table->counters[i],
+                                                        __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&counter_tables_lock);
+    fclose(out);
+}
+
+// Called from the module constructor of modules instrumented with counters:
+// names[i] is "func:block" or "func:from->to" for counters[i].
+void defuse_register_counters(const uint64_t *counters,
+                              const char *const *names, unsigned count) {
+    struct counter_table *table =
+        (struct counter_table *)trace_alloc(1, sizeof(*table));
+
+    table->counters = counters;
+    table->names = names;
+    table->count = count;
+    pthread_mutex_lock(&counter_tables_lock);
+    if (!counter_tables)
+        atexit(counters_dump);
+    table->next = counter_tables;
+    counter_tables = table;
+    pthread_mutex_unlock(&counter_tables_lock);
+}
+
+// Called from the constructor of every instrumented module with the dense
+// site table built by the instrumenter: ids[site] is the node id the text
+// format would print. Returns the base the module adds to its own site
+// numbers. The header of a records trace is written with the first record
+// or at exit, so it has the tables of all modules linked into the program;
+// sites of modules loaded after that are not traced.
+unsigned defuse_register_sites(const char *const *ids,
+                               const unsigned char *tags, unsigned count) {
+    unsigned base;
+
+    if (!__atomic_load_n(&trace_initialized, __ATOMIC_ACQUIRE))
+        pthread_once(&trace_once, trace_init);
+
+    pthread_mutex_lock(&trace_threads_lock);
+    base = site_count;
+    if (site_count + count > site_capacity) {
+        unsigned capacity = site_capacity ? site_capacity * 2 : 256;
+        const char **grown_ids;
+        unsigned char *grown_tags;
+        while (capacity < site_count + count)
+            capacity *= 2;
+        grown_ids = (const char **)trace_alloc(capacity, sizeof(*grown_ids));
+        grown_tags = (unsigned char *)trace_alloc(capacity, 1);
+        if (site_count) {
+            memcpy(grown_ids, site_ids, site_count * sizeof(*grown_ids));
+            memcpy(grown_tags, site_tags, site_count);
+        }
+        site_capacity = capacity;
+        __atomic_store_n(&site_tags, grown_tags, __ATOMIC_RELEASE);
+        __atomic_store_n(&site_ids, grown_ids, __ATOMIC_RELEASE);
+    }
+    memcpy(site_ids + base, ids, count * sizeof(*site_ids));
+    if (tags)
+        memcpy(site_tags + base, tags, count);
+    else
+        memset(site_tags + base, DEFUSE_TAG_NONE, count);
+    __atomic_store_n(&site_count, base + count, __ATOMIC_RELEASE);
+    if (trace_records_mode() && trace_header_written)
+        fprintf(stderr, "defuse runtime: %u sites registered after the trace "
+                        "started are not traced\n", count);
+    pthread_mutex_unlock(&trace_threads_lock);
+    return base;
+}
+
+static void print_payload(unsigned site, uint32_t tag, uint64_t payload) {
+    const char *id = site < site_count ? site_ids[site] : "";
+    uint32_t bits = (uint32_t)payload;
+    float f;
+    double d;
+
+    switch (tag) {
+    case DEFUSE_TAG_I32:
+        printf("%s:%d\n", id, (int)(int64_t)payload);
+        break;
+    case DEFUSE_TAG_FLOAT:
+        memcpy(&f, &bits, sizeof(f));
+        printf("%s:%f\n", id, f);
+        break;
+    case DEFUSE_TAG_DOUBLE:
+        memcpy(&d, &payload, sizeof(d));
+        printf("%s:%lf\n", id, d);
+        break;
+    default:
+        printf("%s:%lld\n", id, (long long)payload);
+        break;
+    }
+}
+
+// Called before the terminator of blocks instrumented with -batched, once per
+// block execution: values[i] is the payload (as in a binary record) of site
+// first_site + i, the site table gives its type.
+void defuse_record_block(unsigned first_site, unsigned count,
+                         const uint64_t *values) {
+    unsigned i;
+
+    if (!__atomic_load_n(&trace_initialized, __ATOMIC_ACQUIRE))
+        pthread_once(&trace_once, trace_init);
+
+    for (i = 0; i < count; i++) {
+        unsigned site = first_site + i;
+        uint32_t tag = site < site_count ? site_tags[site] : DEFUSE_TAG_I64;
+
+        switch (trace_mode) {
+        case TRACE_BINARY:
+        case TRACE_MMAP:
+            trace_append(site, tag, values[i]);
+            break;
+        case TRACE_AGGREGATE:
+            trace_aggregate(site, tag, values[i]);
+            break;
+        default:
+            print_payload(site, tag, values[i]);
+            break;
+        }
+    }
+}
 
 // Basic print functions for instrumentation
-void print_i32_with_id(int value, const char* node_id, const char* name) {
+void print_i32_with_id(int value, const char* node_id, const char* name,
+                       unsigned site) {
+    if (trace_value(site, DEFUSE_TAG_I32, (uint64_t)(int64_t)value))
+        return;
     if (node_id && node_id[0]) {
         printf("%s:%d\n", node_id, value);
         return;
@@ -14,7 +904,10 @@ void print_i32_with_id(int value, const char* node_id, const char* name) {
     }
 }
 
-void print_i64_with_id(long long value, const char* node_id, const char* name) {
+void print_i64_with_id(long long value, const char* node_id, const char* name,
+                       unsigned site) {
+    if (trace_value(site, DEFUSE_TAG_I64, (uint64_t)value))
+        return;
     if (node_id && node_id[0]) {
         printf("%s:%lld\n", node_id, value);
         return;
@@ -24,7 +917,12 @@ void print_i64_with_id(long long value, const char* node_id, const char* name) {
     }
 }
 
-void print_float_with_id(float value, const char* node_id, const char* name) {
+void print_float_with_id(float value, const char* node_id, const char* name,
+                         unsigned site) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if (trace_value(site, DEFUSE_TAG_FLOAT, bits))
+        return;
     if (node_id && node_id[0]) {
         printf("%s:%f\n", node_id, value);
         return;
@@ -34,7 +932,12 @@ void print_float_with_id(float value, const char* node_id, const char* name) {
     }
 }
 
-void print_double_with_id(double value, const char* node_id, const char* name) {
+void print_double_with_id(double value, const char* node_id, const char* name,
+                          unsigned site) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if (trace_value(site, DEFUSE_TAG_DOUBLE, bits))
+        return;
     if (node_id && node_id[0]) {
         printf("%s:%lf\n", node_id, value);
         return;
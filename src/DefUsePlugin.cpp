@@ -0,0 +1,121 @@
+// Instrumentation as a new pass manager plugin, for instrumenting during a
+// normal compile instead of a .ll round trip:
+//
+//   opt -load-pass-plugin bin/DefUseInstrument.so
+//       -passes='defuse-instrument<minimal;types=i32+i64>' in.ll -o out.bc
+//   clang -O2 -c runtime/core_runtime.c
+//   clang -O2 -fpass-plugin=bin/DefUseInstrument.so main.c core_runtime.o
+//       -lpthread
+//
+// The runtime is compiled without the plugin. If it does go through it, the
+// pass leaves the module alone (see Instrumentation::instrumentModule).
+//
+// Options go in the angle brackets with opt. clang runs the pass last in its
+// pipeline (at any -O level) with the options of -defuse-options, given as
+// "-mllvm -defuse-options=..." together with "-Xclang -load -Xclang <plugin>"
+// so the option is known when the command line is parsed.
+//
+// Options, separated by ';':
+//   minimal, batched, counters  same as the -instrument flags
+//   types=T+T...                value types to record, of i32, i64, float
+//                               (all three by default)
+#include "../include/Instrumentation.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static cl::opt<std::string>
+    DefUseOptions("defuse-options",
+                  cl::desc("defuse-instrument options when run from clang"),
+                  cl::init(""));
+
+static bool parseOptions(StringRef params, InstrumentationOptions &options) {
+  SmallVector<StringRef, 4> parts;
+  params.split(parts, ';', -1, /*KeepEmpty=*/false);
+  for (StringRef part : parts) {
+    if (part == "minimal") {
+      options.minimal = true;
+    } else if (part == "batched") {
+      options.batched = true;
+    } else if (part == "counters") {
+      options.values = false;
+      options.counters = true;
+    } else if (part.consume_front("types=")) {
+      options.i32 = options.i64 = options.floats = false;
+      SmallVector<StringRef, 3> types;
+      part.split(types, '+');
+      for (StringRef type : types) {
+        if (type == "i32") {
+          options.i32 = true;
+        } else if (type == "i64") {
+          options.i64 = true;
+        } else if (type == "float") {
+          options.floats = true;
+        } else {
+          errs() << "defuse-instrument: unknown value type: " << type << "\n";
+          return false;
+        }
+      }
+    } else {
+      errs() << "defuse-instrument: unknown option: " << part << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace {
+
+struct DefUseInstrumentPass : PassInfoMixin<DefUseInstrumentPass> {
+  explicit DefUseInstrumentPass(const InstrumentationOptions &options)
+      : options(options) {}
+
+  PreservedAnalyses run(Module &module, ModuleAnalysisManager &) {
+    Instrumentation instrumentation(options);
+    instrumentation.instrumentModule(module);
+    return PreservedAnalyses::none();
+  }
+
+  // instrumented values must stay visible at -O0 too
+  static bool isRequired() { return true; }
+
+  InstrumentationOptions options;
+};
+
+} // namespace
+
+static void registerCallbacks(PassBuilder &builder) {
+  builder.registerPipelineParsingCallback(
+      [](StringRef name, ModulePassManager &passes,
+         ArrayRef<PassBuilder::PipelineElement>) {
+        if (!name.consume_front("defuse-instrument"))
+          return false;
+        InstrumentationOptions options;
+        if (!name.empty()) {
+          if (!name.consume_front("<") || !name.consume_back(">"))
+            return false;
+          if (!parseOptions(name, options))
+            return false;
+        }
+        passes.addPass(DefUseInstrumentPass(options));
+        return true;
+      });
+
+  builder.registerOptimizerLastEPCallback(
+      [](ModulePassManager &passes, OptimizationLevel) {
+        InstrumentationOptions options;
+        if (!parseOptions(DefUseOptions, options))
+          return;
+        passes.addPass(DefUseInstrumentPass(options));
+      });
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "DefUseInstrument", LLVM_VERSION_STRING,
+          registerCallbacks};
+}
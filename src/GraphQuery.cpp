@@ -0,0 +1,261 @@
+#include "../include/GraphQuery.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace llvm;
+
+GraphQuery::GraphQuery(const GraphVisualizer &graph)
+    : graph_(graph), indexes_(graph.functionNames_.size()) {
+  for (uint32_t node = 0; node < graph_.nodeCount(); node++)
+    nodes_[graph_.nodeId(node)] = node;
+}
+
+bool GraphQuery::run(const std::string &queryFile, std::ostream &out) {
+  std::ifstream in(queryFile);
+  if (!in.is_open()) {
+    std::cerr << "    can't open queries: " << queryFile << "\n";
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t start = line.find_first_not_of(" \t\r");
+    if (start == std::string::npos || line[start] == '#')
+      continue;
+    out << answer(line.substr(start)) << "\n";
+  }
+  return true;
+}
+
+std::string GraphQuery::answer(const std::string &query) {
+  answered_++;
+  std::istringstream words(query);
+  std::string command;
+  words >> command;
+  if (command != "reach" && command != "path" && command != "ancestors" &&
+      command != "descendants" && command != "degree" &&
+      command != "degrees")
+    return "error: unknown query " + command;
+
+  // node ids first, then the options in any order
+  std::vector<uint32_t> args;
+  bool followCalls = false;
+  std::string opcode;
+  std::string function;
+  std::string word;
+  while (words >> word) {
+    if (word == "calls") {
+      followCalls = true;
+    } else if (word.compare(0, 7, "opcode=") == 0) {
+      opcode = word.substr(7);
+    } else if (word.compare(0, 9, "function=") == 0) {
+      function = word.substr(9);
+    } else {
+      auto it = nodes_.find(word);
+      if (it == nodes_.end())
+        return "error: no node " + word;
+      args.push_back(it->second);
+    }
+  }
+
+  size_t needed = command == "reach" || command == "path" ? 2
+                  : command == "degrees"                  ? 0
+                                                          : 1;
+  if (args.size() != needed)
+    return "error: " + command + " takes " + std::to_string(needed) +
+           " node ids";
+
+  if (command == "reach")
+    return reaches(args[0], args[1], followCalls) ? "yes" : "no";
+  if (command == "path")
+    return path(args[0], args[1], followCalls);
+  if (command == "degrees")
+    return degrees(function);
+
+  uint32_t node = args[0];
+  if (command == "degree") {
+    return "in=" + std::to_string(graph_.defUseSources().of(node).size()) +
+           " out=" + std::to_string(graph_.defUseEdges_.of(node).size());
+  }
+
+  std::vector<bool> reached = graph_.walkSlice(
+      node,
+      command == "ancestors" ? SliceDirection::Backward
+                             : SliceDirection::Forward,
+      0, followCalls);
+  // without calls the walk stays in the node's function
+  uint32_t func = graph_.nodeFunctions_[node];
+  uint32_t begin = followCalls ? 0 : graph_.functionNodes_[func];
+  uint32_t end = followCalls ? graph_.nodeCount()
+                             : graph_.functionNodes_[func + 1];
+  std::string ids;
+  for (uint32_t other = begin; other < end; other++) {
+    if (!reached[other] || other == node)
+      continue;
+    if (!function.empty() &&
+        graph_.functionNames_[graph_.nodeFunctions_[other]] != function)
+      continue;
+    if (!opcode.empty() && opcodeOf(other) != opcode)
+      continue;
+    if (!ids.empty())
+      ids += ' ';
+    ids += graph_.nodeId(other);
+  }
+  return ids.empty() ? "none" : ids;
+}
+
+// Tarjan's algorithm without recursion. Components are finished successors
+// first, so each one's set is its own nodes and the sets of the components
+// its edges lead to.
+const GraphQuery::FunctionIndex &GraphQuery::indexOf(uint32_t func) {
+  std::unique_ptr<FunctionIndex> &slot = indexes_[func];
+  if (slot)
+    return *slot;
+  slot = std::make_unique<FunctionIndex>();
+  FunctionIndex &index = *slot;
+
+  const GraphVisualizer::EdgeList &edges = graph_.defUseEdges_;
+  uint32_t base = graph_.functionNodes_[func];
+  uint32_t size = graph_.functionNodes_[func + 1] - base;
+  index.components.assign(size, NoIndex);
+
+  std::vector<uint32_t> order(size, NoIndex);
+  std::vector<uint32_t> low(size);
+  std::vector<uint32_t> stack;
+  std::vector<bool> onStack(size, false);
+  std::vector<uint32_t> members;
+  // (node, next edge to look at)
+  std::vector<std::pair<uint32_t, uint32_t>> calls;
+  uint32_t counter = 0;
+
+  auto enter = [&](uint32_t node) {
+    order[node] = low[node] = counter++;
+    stack.push_back(node);
+    onStack[node] = true;
+    calls.push_back({node, edges.begin(base + node)});
+  };
+
+  for (uint32_t root = 0; root < size; root++) {
+    if (order[root] != NoIndex)
+      continue;
+    enter(root);
+    while (!calls.empty()) {
+      uint32_t node = calls.back().first;
+      uint32_t edge = calls.back().second;
+      if (edge < edges.end(base + node)) {
+        calls.back().second++;
+        uint32_t next = edges.targets[edge] - base;
+        if (order[next] == NoIndex)
+          enter(next);
+        else if (onStack[next])
+          low[node] = std::min(low[node], order[next]);
+        continue;
+      }
+
+      calls.pop_back();
+      if (!calls.empty()) {
+        uint32_t parent = calls.back().first;
+        low[parent] = std::min(low[parent], low[node]);
+      }
+      if (low[node] != order[node])
+        continue;
+
+      uint32_t component = index.reachable.size();
+      BitVector reachable(size);
+      members.clear();
+      uint32_t member;
+      do {
+        member = stack.back();
+        stack.pop_back();
+        onStack[member] = false;
+        index.components[member] = component;
+        reachable.set(member);
+        members.push_back(member);
+      } while (member != node);
+      for (uint32_t from : members) {
+        for (uint32_t to : edges.of(base + from)) {
+          uint32_t other = index.components[to - base];
+          if (other != component)
+            reachable |= index.reachable[other];
+        }
+      }
+      index.reachable.push_back(std::move(reachable));
+    }
+  }
+  return index;
+}
+
+bool GraphQuery::reaches(uint32_t from, uint32_t to, bool followCalls) {
+  uint32_t func = graph_.nodeFunctions_[from];
+  if (!followCalls && func != graph_.nodeFunctions_[to])
+    return false;
+  uint32_t base = graph_.functionNodes_[func];
+  if (!followCalls && graph_.functionNodes_[func + 1] - base <= IndexLimit) {
+    const FunctionIndex &index = indexOf(func);
+    return index.reachable[index.components[from - base]].test(to - base);
+  }
+  return graph_.walkSlice(from, SliceDirection::Forward, 0, followCalls)[to];
+}
+
+std::string GraphQuery::path(uint32_t from, uint32_t to, bool followCalls) {
+  if (!reaches(from, to, followCalls))
+    return "none";
+  std::vector<uint32_t> parents;
+  graph_.walkSlice(from, SliceDirection::Forward, 0, followCalls, &parents);
+  std::vector<uint32_t> nodes;
+  for (uint32_t node = to; node != NoIndex; node = parents[node])
+    nodes.push_back(node);
+  std::string text;
+  for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+    if (!text.empty())
+      text += " -> ";
+    text += graph_.nodeId(*it);
+  }
+  return text;
+}
+
+std::string GraphQuery::degrees(const std::string &function) const {
+  const GraphVisualizer::EdgeList &sources = graph_.defUseSources();
+  const GraphVisualizer::EdgeList &users = graph_.defUseEdges_;
+  size_t nodes = 0;
+  size_t edges = 0;
+  uint32_t maxIn = NoIndex;
+  uint32_t maxOut = NoIndex;
+  for (uint32_t node = 0; node < graph_.nodeCount(); node++) {
+    if (!function.empty() &&
+        graph_.functionNames_[graph_.nodeFunctions_[node]] != function)
+      continue;
+    nodes++;
+    edges += users.of(node).size();
+    if (maxIn == NoIndex ||
+        sources.of(node).size() > sources.of(maxIn).size())
+      maxIn = node;
+    if (maxOut == NoIndex || users.of(node).size() > users.of(maxOut).size())
+      maxOut = node;
+  }
+  if (nodes == 0)
+    return "error: no nodes in function " + function;
+
+  // every edge has both ends among the nodes, def-use edges stay in their
+  // function: mean fan-in and fan-out are the same
+  char mean[32];
+  snprintf(mean, sizeof(mean), "%.2f", double(edges) / double(nodes));
+  return "nodes=" + std::to_string(nodes) + " edges=" + std::to_string(edges) +
+         " mean=" + mean +
+         " max-in=" + std::to_string(sources.of(maxIn).size()) + " (" +
+         graph_.nodeId(maxIn) + ")" +
+         " max-out=" + std::to_string(users.of(maxOut).size()) + " (" +
+         graph_.nodeId(maxOut) + ")";
+}
+
+std::string GraphQuery::opcodeOf(uint32_t node) const {
+  using NodeKind = GraphVisualizer::NodeKind;
+  if (graph_.nodeKinds_[node] == NodeKind::Argument)
+    return "arg";
+  if (graph_.nodeKinds_[node] == NodeKind::Constant)
+    return "const";
+  return graph_.opcodeName(node).str();
+}
@@ -1,11 +1,26 @@
 #include "../include/GraphVisualizer.h" // TODO[Dkay]: avoid relative includes
+#include "../include/Reconstruction.h"
+#include "../include/RuntimeProfile.h"
+#include "../include/TraceFormat.h"
 #include <algorithm> //TODO[Dkay]: my LSP says that this header is unused. Pls, setup yours too
 #include <fstream>
 #include <iomanip> //TODO[Dkay]: my LSP says that this header is unused. Pls, setup yours too
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <map>
 #include <sstream>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "GraphVisualizer.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/AssemblyAnnotationWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
@@ -14,8 +29,15 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Value.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/raw_ostream.h"
 
 using namespace llvm;
@@ -25,18 +47,88 @@ GraphVisualizer::GraphVisualizer() : runtimeValuesLoaded_(false) {}
 // FIXME[Dkay] IN THE NAME OF GOD WHY THE FUCK
 GraphVisualizer::~GraphVisualizer() {}
 
-// FIXME[Dkay] Bro. I'm tilted as fuck. I have NOT taught you like that. Why
-// the fuck do you have a 300+ LOC function?
-bool GraphVisualizer::buildCombinedGraph(Module &module,
-                                         const std::string &runtimeLogFile) {
-  // FIXME[Dkay]: if you need to reset those fields, then why do you store them
-  // as fields and not locals?
-  nodes_.clear(); // TODO[flops]: Make reset method and use it there
-  basicBlocks_.clear();
+void GraphVisualizer::EdgeList::assign(size_t nodeCount,
+                                       const EdgePairs &edges) {
+  offsets.assign(nodeCount + 1, 0);
+  for (const auto &edge : edges)
+    offsets[edge.first + 1]++;
+  for (size_t i = 0; i < nodeCount; i++)
+    offsets[i + 1] += offsets[i];
+
+  std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+  targets.resize(edges.size());
+  for (const auto &edge : edges)
+    targets[next[edge.first]++] = edge.second;
+}
+
+GraphVisualizer::EdgeList GraphVisualizer::EdgeList::reversed() const {
+  EdgeList result;
+  size_t nodeCount = offsets.empty() ? 0 : offsets.size() - 1;
+  result.offsets.assign(nodeCount + 1, 0);
+  for (uint32_t target : targets)
+    result.offsets[target + 1]++;
+  for (size_t i = 0; i < nodeCount; i++)
+    result.offsets[i + 1] += result.offsets[i];
+
+  std::vector<uint32_t> next(result.offsets.begin(), result.offsets.end() - 1);
+  result.targets.resize(targets.size());
+  for (uint32_t source = 0; source < nodeCount; source++) {
+    for (uint32_t target : of(source))
+      result.targets[next[target]++] = source;
+  }
+  return result;
+}
+
+void GraphVisualizer::reset() {
+  nodeValues_.clear();
+  nodeKinds_.clear();
+  nodeFunctions_.clear();
+  nodeBlocks_.clear();
+  staticLabels_.clear();
+  runtimeTexts_.clear();
+  sampled_.clear();
+  nodeSites_.clear();
+  liveInSites_.clear();
+  valueNodes_.clear();
+  functions_.clear();
+  functionNames_.clear();
+  functionBlocks_.clear();
+  functionNodes_.clear();
+  instructionLabelsDone_ = false;
+  functionEntries_.clear();
+  blockPtrs_.clear();
+  blockBegin_.clear();
+  blockEnd_.clear();
+  blockExecCounts_.clear();
+  blockCounted_.clear();
+  cfgEdges_.clear();
+  defUseEdges_.clear();
+  callEdges_.clear();
+  callOrders_.clear();
+  callCount_ = 0;
+  cfgEdgeCounts_.clear();
+  cfgEdgeCounted_.clear();
+  maxExecCount_ = 0;
+  executionCountsLoaded_ = false;
   runtimeValues_.clear();
-  functionCalls_.clear();
-  functionToEntryNode_.clear();
   runtimeValuesLoaded_ = false;
+  plans_.clear();
+  reconstructedKeys_.clear();
+  graphFile_.reset();
+  savedNodes_ = ArrayRef<DefuseGraphNode>();
+  savedStrings_ = StringRef();
+  functionCaches_.clear();
+  changedFunctions_.clear();
+  slice_.clear();
+  sliceFunctions_.clear();
+  sliceOrigin_ = NoIndex;
+  defUseSources_.clear();
+  callSitesOf_.clear();
+}
+
+bool GraphVisualizer::buildCombinedGraph(Module &module,
+                                         const std::string &runtimeLogFile) {
+  reset();
 
   // FIXME[Dkay]: i dont want logging in production mode. make it turnable-off
   // with defines, or some logging lib
@@ -52,294 +144,862 @@ bool GraphVisualizer::buildCombinedGraph(Module &module,
     }
   }
 
-  // FIXME[Dkay]: Why this is not a method?
-  // create nodes for all functions, basic blocks, instructions, arguments
+  std::vector<Function *> defined;
   for (auto &function : module) {
-    if (function.isDeclaration())
+    if (!function.isDeclaration())
+      defined.push_back(&function);
+  }
+
+  // functions are built independently and appended in module order, so the
+  // indices don't depend on which thread finished first
+  EdgePairs cfg;
+  EdgePairs defUse;
+  std::vector<uint32_t> callSites;
+  if (jobs_ == 1 || defined.size() < 2) {
+    for (Function *function : defined) {
+      FunctionGraph graph = buildFunctionGraph(*function);
+      addFunctionGraph(*function, graph, cfg, defUse, callSites);
+    }
+  } else {
+    std::vector<FunctionGraph> graphs(defined.size());
+    ThreadPool pool(hardware_concurrency(jobs_));
+    for (size_t i = 0; i < defined.size(); i++)
+      pool.async([&, i] { graphs[i] = buildFunctionGraph(*defined[i]); });
+    pool.wait();
+    for (size_t i = 0; i < defined.size(); i++) {
+      addFunctionGraph(*defined[i], graphs[i], cfg, defUse, callSites);
+      graphs[i] = FunctionGraph();
+    }
+  }
+  functionBlocks_.push_back(blockPtrs_.size());
+  functionNodes_.push_back(nodeValues_.size());
+
+  cfgEdges_.assign(nodeValues_.size(), cfg);
+  defUseEdges_.assign(nodeValues_.size(), defUse);
+  addCallEdges(callSites);
+  attachFunctionCaches();
+  finishGraph();
+  return true;
+}
+
+void GraphVisualizer::attachFunctionCaches() {
+  functionCaches_.assign(functionNames_.size(), nullptr);
+  changedFunctions_.clear();
+
+  // entries of functions that are gone or changed are dropped, the kept ones
+  // move over with their addresses
+  StringMap<FunctionCache> kept;
+  for (uint32_t func = 0; func < functionNames_.size(); func++) {
+    const std::string &name = functionNames_[func];
+    auto hashIt = functionHashes_.find(name);
+    if (hashIt == functionHashes_.end()) {
+      changedFunctions_.push_back(name);
       continue;
-    std::string funcName = function.getName().str();
-
-    for (auto &arg : function.args()) {
-      std::string nodeId = getNodeId(&arg);
-      GraphNode node; // [flops]: Use = designated initializer GraphNode node =
-                      // {.id=nodeId, ...};
-
-      // FIXME[Dkay]: At the point of this comment you have a GraphNode instance
-      // with broken invariants, please, learn more about classes and
-      // constructors before using them
-      node.id = nodeId;
-      node.label = getValueLabel(&arg);
-      node.type = "argument";
-      node.isArgument = true;
-      node.isInstruction = false;
-      node.isConstant = false;
-      node.isBasicBlock = false;
-      node.isTerminator = false;
-      node.value = &arg;
-      node.functionName = funcName;
-
-      // FIXME[Dkay]: Why this is not a method? + What is happend here is
-      // unclear to me. Please, work on architecture of your solution
-      //
-      // runtime value for args
-      if (runtimeValuesLoaded_) {
-        std::string argName = arg.getName().str();
-        std::vector<std::string> possibleKeys = {
-            nodeId, funcName + "_%" + argName, "%" + argName, argName};
-
-        // TODO[Dkay]: As I said above its unclear to me, but you probably can
-        // use some regular expressions here
-        for (const auto &key : possibleKeys) {
-          auto it = runtimeValues_.find(key);
-          if (it != runtimeValues_.end() && !it->second.empty()) {
-            node.runtimeValue = it->second;
-            node.hasRuntimeValue = true;
-            node.label = node.label + "    VALUE=" + it->second;
-            break;
-          }
-        }
+    }
+    FunctionCache &cache = kept[name];
+    auto cacheIt = functionCache_.find(name);
+    if (cacheIt != functionCache_.end() &&
+        cacheIt->second.hash == hashIt->second) {
+      cache = std::move(cacheIt->second);
+    } else {
+      cache.hash = hashIt->second;
+      changedFunctions_.push_back(name);
+    }
+    functionCaches_[func] = &cache;
+  }
+  functionCache_ = std::move(kept);
+  // the hashes are of this module only
+  functionHashes_.clear();
+}
+
+void GraphVisualizer::finishGraph() {
+  cfgEdgeCounts_.assign(cfgEdges_.targets.size(), 0);
+  cfgEdgeCounted_.assign(cfgEdges_.targets.size(), false);
+  blockExecCounts_.assign(blockBegin_.size(), 0);
+  blockCounted_.assign(blockBegin_.size(), false);
+  runtimeTexts_.resize(nodeCount());
+  sampled_.resize(nodeCount());
+  resolveSites();
+
+  if (runtimeValuesLoaded_) {
+    applyRuntimeValues();
+    if (!reconstructedKeys_.empty()) {
+      std::cout << "  Reconstructed " << reconstructedKeys_.size()
+                << " values\n";
+    }
+  }
+
+  std::cout << "  Nodes: " << nodeCount() << "\n";
+  std::cout << "  Calls: " << callCount_ << "\n";
+}
+
+GraphVisualizer::FunctionGraph
+GraphVisualizer::buildFunctionGraph(Function &function) {
+  FunctionGraph graph;
+  DenseMap<const Value *, uint32_t> local;
+  auto addNode = [&](NodeKind kind, Value *value, uint32_t block) {
+    graph.values.push_back(value);
+    graph.kinds.push_back(kind);
+    graph.blocks.push_back(block);
+    return uint32_t(graph.values.size() - 1);
+  };
+
+  for (auto &arg : function.args())
+    local[&arg] = addNode(NodeKind::Argument, &arg, NoIndex);
+
+  for (auto &block : function) {
+    uint32_t blockIndex = graph.blockPtrs.size();
+    graph.blockPtrs.push_back(&block);
+    graph.blockBegin.push_back(graph.values.size());
+    for (auto &instr : block) {
+      uint32_t node = addNode(NodeKind::Instruction, &instr, blockIndex);
+      local[&instr] = node;
+      // call edges go to the first instruction that isn't a phi
+      if (blockIndex == 0 && !isa<PHINode>(&instr) && graph.entry == NoIndex)
+        graph.entry = node;
+      if (auto *callInst = dyn_cast<CallInst>(&instr)) {
+        Function *calledFunc = callInst->getCalledFunction();
+        if (calledFunc && !calledFunc->isDeclaration())
+          graph.callSites.push_back(node);
       }
+    }
+    graph.blockEnd.push_back(graph.values.size());
+  }
 
-      nodes_[nodeId] = node;
-    }
-
-    for (auto &block : function) {
-      std::string blockId = getNodeId(&block);
-
-      BasicBlockInfo bbInfo;
-      bbInfo.id = blockId;
-      bbInfo.label = getBasicBlockLabel(block);
-      bbInfo.blockPtr = &block;
-      bbInfo.functionName = funcName;
-
-      for (auto &instr : block) {
-        std::string instrId = getNodeId(&instr);
-        GraphNode node;
-        node.id = instrId;
-        node.label = getInstructionLabel(instr);
-        node.type = getInstructionType(&instr);
-        node.isInstruction = true;
-        node.isArgument = false;
-        node.isConstant = false;
-        node.isBasicBlock = false;
-        node.isTerminator = instr.isTerminator();
-        node.value = &instr;
-        node.parentBlock = &block;
-        node.functionName = funcName;
-
-        if (runtimeValuesLoaded_) {
-          std::string instrName = getInstructionName(instr);
-          std::vector<std::string> possibleKeys = {
-              instrId,
-              funcName + "_%" + instr.getName().str(),
-              funcName + "::" + instrName,
-              instrName,
-              "%" + instr.getName().str(),
-              getShortInstructionLabel(node)};
-
-          for (const auto &key : possibleKeys) {
-            auto it = runtimeValues_.find(key);
-            if (it != runtimeValues_.end() && !it->second.empty()) {
-              node.runtimeValue = it->second;
-              node.hasRuntimeValue = true;
-
-              std::string instrText = getInstructionLabel(instr);
-              while (!instrText.empty() &&
-                     (instrText.back() == '\n' || instrText.back() == ' ')) {
-                instrText.pop_back();
-              }
-              node.label = instrText + "    VALUE=" + it->second;
-              break;
-            }
-          }
+  // i wanna make constants inside function blocks
+  // it looks much prettier
+  //
+  // one node per constant id: integers of any width by value, floats by
+  // their Constant
+  std::unordered_map<int64_t, uint32_t> intConstants;
+  DenseMap<const Value *, uint32_t> otherConstants;
+  auto constantNode = [&](Value *operand) {
+    uint32_t *slot;
+    if (auto *ci = dyn_cast<ConstantInt>(operand))
+      slot = &intConstants.emplace(ci->getSExtValue(), NoIndex).first->second;
+    else
+      slot = &otherConstants.try_emplace(operand, NoIndex).first->second;
+    if (*slot == NoIndex)
+      *slot = addNode(NodeKind::Constant, operand, NoIndex);
+    return *slot;
+  };
+
+  for (uint32_t block = 0; block < graph.blockPtrs.size(); block++) {
+    uint32_t begin = graph.blockBegin[block];
+    uint32_t end = graph.blockEnd[block];
+    for (uint32_t user = begin; user < end; user++) {
+      auto *instr = cast<Instruction>(graph.values[user]);
+      for (Value *operand : instr->operands()) {
+        if (isa<ConstantInt>(operand) || isa<ConstantFP>(operand)) {
+          graph.defUse.push_back({constantNode(operand), user});
+          continue;
         }
+        // globals, functions and other values outside the graph have no node
+        auto it = local.find(operand);
+        if (it != local.end())
+          graph.defUse.push_back({it->second, user});
+      }
+    }
 
-        for (unsigned i = 0; i < instr.getNumOperands(); i++) {
-          Value *operand = instr.getOperand(i);
+    if (begin == end)
+      continue;
+    for (uint32_t node = begin; node + 1 < end; node++)
+      graph.cfg.push_back({node, node + 1});
+    auto *terminator = cast<Instruction>(graph.values[end - 1]);
+    if (!terminator->isTerminator())
+      continue;
+    size_t first = graph.cfg.size();
+    for (unsigned i = 0; i < terminator->getNumSuccessors(); i++) {
+      BasicBlock *succ = terminator->getSuccessor(i);
+      if (succ->empty())
+        continue;
+      // a switch may list the same block several times
+      std::pair<uint32_t, uint32_t> edge = {end - 1,
+                                            local.lookup(&succ->front())};
+      if (std::find(graph.cfg.begin() + first, graph.cfg.end(), edge) ==
+          graph.cfg.end())
+        graph.cfg.push_back(edge);
+    }
+  }
+  return graph;
+}
 
-          if (isa<BasicBlock>(operand) || isa<MetadataAsValue>(operand)) {
-            continue;
-          }
+void GraphVisualizer::addFunctionGraph(Function &function,
+                                       FunctionGraph &graph, EdgePairs &cfg,
+                                       EdgePairs &defUse,
+                                       std::vector<uint32_t> &callSites) {
+  uint32_t funcIndex = functions_.size();
+  uint32_t nodeBase = nodeValues_.size();
+  uint32_t blockBase = blockPtrs_.size();
+  functions_.push_back(&function);
+  functionNames_.push_back(function.getName().str());
+  functionBlocks_.push_back(blockBase);
+  functionNodes_.push_back(nodeBase);
+  functionEntries_.push_back(graph.entry == NoIndex ? NoIndex
+                                                    : nodeBase + graph.entry);
+
+  for (uint32_t node = 0; node < graph.values.size(); node++) {
+    nodeValues_.push_back(graph.values[node]);
+    nodeKinds_.push_back(graph.kinds[node]);
+    nodeFunctions_.push_back(funcIndex);
+    nodeBlocks_.push_back(graph.blocks[node] == NoIndex
+                              ? NoIndex
+                              : blockBase + graph.blocks[node]);
+    if (graph.kinds[node] != NodeKind::Constant)
+      valueNodes_[graph.values[node]] = nodeBase + node;
+  }
+  staticLabels_.resize(nodeValues_.size());
+  runtimeTexts_.resize(nodeValues_.size());
+  sampled_.resize(nodeValues_.size());
+
+  for (uint32_t block = 0; block < graph.blockPtrs.size(); block++) {
+    blockPtrs_.push_back(graph.blockPtrs[block]);
+    blockBegin_.push_back(nodeBase + graph.blockBegin[block]);
+    blockEnd_.push_back(nodeBase + graph.blockEnd[block]);
+  }
+  for (const auto &edge : graph.cfg)
+    cfg.push_back({nodeBase + edge.first, nodeBase + edge.second});
+  for (const auto &edge : graph.defUse)
+    defUse.push_back({nodeBase + edge.first, nodeBase + edge.second});
+  for (uint32_t site : graph.callSites)
+    callSites.push_back(nodeBase + site);
+}
 
-          bool isConst = isa<ConstantInt>(operand) || isa<ConstantFP>(operand);
-
-          std::string baseId = getNodeId(operand);
-          // i wanna make constants inside function blocks
-          // it looks much prettier
-          std::string operandId = isConst ? (funcName + "::" + baseId) : baseId;
-
-          if (isConst) {
-            if (nodes_.find(operandId) == nodes_.end()) {
-              GraphNode constNode;
-              constNode.id = operandId;
-              constNode.label = getValueLabel(operand);
-              constNode.type = "constant";
-              constNode.isConstant = true;
-              constNode.isInstruction = false;
-              constNode.isArgument = false;
-              constNode.isBasicBlock = false;
-              constNode.isTerminator = false;
-              constNode.value = operand;
-              constNode.functionName = funcName;
-
-              if (runtimeValuesLoaded_) {
-                std::vector<std::string> keys;
-                keys.push_back(operandId);
-                keys.push_back(baseId);
-                keys.push_back(getValueLabel(operand));
-                if (auto *ci = dyn_cast<ConstantInt>(operand)) {
-                  keys.push_back(std::to_string(ci->getSExtValue()));
-                }
-
-                for (const auto &k : keys) {
-                  auto it = runtimeValues_.find(k);
-                  if (it != runtimeValues_.end() && !it->second.empty()) {
-                    constNode.runtimeValue = it->second;
-                    constNode.hasRuntimeValue = true;
-                    constNode.label =
-                        constNode.label + "    VALUE=" + it->second;
-                    break;
-                  }
-                }
-              }
-
-              nodes_[operandId] = constNode;
-            }
-          }
+void GraphVisualizer::addCallEdges(const std::vector<uint32_t> &callSites) {
+  DenseMap<const Function *, uint32_t> functionIndex;
+  for (uint32_t i = 0; i < functions_.size(); i++)
+    functionIndex[functions_[i]] = i;
+
+  // call sites are in node order, so callOrders_ stays parallel to the call
+  // edge targets
+  EdgePairs calls;
+  for (uint32_t site : callSites) {
+    auto *callInst = cast<CallInst>(nodeValues_[site]);
+    unsigned order = callCount_++;
+    uint32_t entry =
+        functionEntries_[functionIndex.lookup(callInst->getCalledFunction())];
+    if (entry != NoIndex) {
+      calls.push_back({site, entry});
+      callOrders_.push_back(order);
+    }
+  }
+  callEdges_.assign(nodeValues_.size(), calls);
+}
 
-          node.operands.push_back(operandId);
-        }
+bool GraphVisualizer::isTerminatorNode(uint32_t node) const {
+  return nodeKinds_[node] == NodeKind::Instruction &&
+         shapeOf(node) == DEFUSE_SHAPE_TERMINATOR;
+}
 
-        nodes_[instrId] = node;
-        bbInfo.instructions.push_back(instrId);
-      }
+DefuseGraphShape GraphVisualizer::shapeOf(uint32_t node) const {
+  if (graphFile_)
+    return DefuseGraphShape(savedNodes_[node].shape);
+  auto *instr = cast<Instruction>(nodeValues_[node]);
+  if (instr->isTerminator())
+    return DEFUSE_SHAPE_TERMINATOR;
+  std::string type = getInstructionType(instr);
+  if (type == "phi")
+    return DEFUSE_SHAPE_PHI;
+  if (type == "icmp" || type == "fcmp")
+    return DEFUSE_SHAPE_COMPARE;
+  if (type == "call")
+    return DEFUSE_SHAPE_CALL;
+  return DEFUSE_SHAPE_PLAIN;
+}
 
-      basicBlocks_[blockId] = bbInfo;
-    }
+StringRef GraphVisualizer::opcodeName(uint32_t node) const {
+  if (nodeKinds_[node] != NodeKind::Instruction)
+    return "";
+  if (!graphFile_)
+    return cast<Instruction>(nodeValues_[node])->getOpcodeName();
+
+  // a saved graph has no IR, the opcode is the first word of the label after
+  // the result: "%x = add i32 ...", "store i32 ...", "%r = tail call ..."
+  StringRef label = staticLabel(node).ltrim();
+  if (label.startswith("%")) {
+    size_t equals = label.find(" = ");
+    if (equals != StringRef::npos)
+      label = label.substr(equals + 3);
+  }
+  for (StringRef marker : {"tail ", "musttail ", "notail "}) {
+    if (label.startswith(marker))
+      label = label.substr(marker.size());
   }
+  return label.take_until([](char c) { return c == ' '; });
+}
 
-  // build edges. i really fucked up here
-  int callOrderCounter = 0;
+bool GraphVisualizer::isRecordableNode(uint32_t node) const {
+  if (graphFile_)
+    return savedNodes_[node].flags & DEFUSE_NODE_RECORDABLE;
+  return isRecordableType(nodeValues_[node]->getType());
+}
 
-  // for avoiding duplicating
-  std::set<std::pair<std::string, std::string>> cfgSeen;
+StringRef GraphVisualizer::savedString(uint32_t offset) const {
+  uint32_t size;
+  memcpy(&size, savedStrings_.data() + offset, sizeof(size));
+  return savedStrings_.substr(offset + sizeof(size), size);
+}
 
-  for (auto &function : module) {
-    if (function.isDeclaration())
+std::string GraphVisualizer::nodeId(uint32_t node) const {
+  if (graphFile_)
+    return savedString(savedNodes_[node].id).str();
+  Value *value = nodeValues_[node];
+  const std::string &funcName = functionNames_[nodeFunctions_[node]];
+  if (nodeKinds_[node] == NodeKind::Constant)
+    return funcName + "::" + getNodeId(value);
+  // by position, the same in every build of the function and the same as
+  // the instrumenter's site id
+  if (!value->hasName())
+    return positionalId(node);
+  return funcName + "_%" + value->getName().str();
+}
+
+StringRef GraphVisualizer::staticLabel(uint32_t node) const {
+  if (graphFile_)
+    return savedString(savedNodes_[node].label);
+  std::string &label = staticLabels_[node];
+  if (label.empty()) {
+    if (nodeKinds_[node] == NodeKind::Instruction)
+      formatInstructionLabels();
+    else
+      label = getValueLabel(nodeValues_[node]);
+  }
+  return label;
+}
+
+namespace {
+
+// where each instruction's text starts and ends in a printed module
+class InstructionSpans : public AssemblyAnnotationWriter {
+public:
+  explicit InstructionSpans(const std::string &text) : text_(text) {}
+
+  void emitInstructionAnnot(const Instruction *,
+                            formatted_raw_ostream &out) override {
+    out.flush();
+    begin_ = text_.size();
+  }
+  void printInfoComment(const Value &value,
+                        formatted_raw_ostream &out) override {
+    out.flush();
+    if (isa<Instruction>(value))
+      spans[&value] = {begin_, text_.size()};
+  }
+
+  DenseMap<const Value *, std::pair<size_t, size_t>> spans;
+
+private:
+  const std::string &text_;
+  size_t begin_ = 0;
+};
+
+} // namespace
+
+// Every print through the public API (Instruction::print, Function::print)
+// sets up a writer and a slot tracker that walk all globals of the module, so
+// formatting function by function is quadratic in the number of functions.
+// All instruction labels are cut out of one print of the module instead. The
+// text is the same, both go through AssemblyWriter::printInstruction.
+//
+// Functions with cached labels are not formatted again. When some are
+// cached, the others are printed instruction by instruction through one slot
+// tracker, which numbers metadata for the whole module like the module print.
+void GraphVisualizer::formatInstructionLabels() const {
+  if (instructionLabelsDone_ || functions_.empty())
+    return;
+  instructionLabelsDone_ = true;
+
+  std::vector<uint32_t> missing;
+  for (uint32_t func = 0; func < functions_.size(); func++) {
+    FunctionCache *cache = functionCaches_[func];
+    if (!cache || cache->labels.empty()) {
+      missing.push_back(func);
       continue;
+    }
+    uint32_t begin = functionNodes_[func];
+    for (uint32_t node = begin; node < functionNodes_[func + 1]; node++) {
+      if (nodeKinds_[node] == NodeKind::Instruction)
+        staticLabels_[node] = cache->labels[node - begin];
+    }
+  }
 
-    std::string funcName = function.getName().str();
+  if (missing.size() == functions_.size()) {
+    std::string text;
+    raw_string_ostream out(text);
+    InstructionSpans spans(text);
+    functions_.front()->getParent()->print(out, &spans);
+    out.flush();
 
-    // find entry id for call edges (not PHI nodes)
-    BasicBlock &entryBlock = function.getEntryBlock();
-    for (auto &instr : entryBlock) {
-      if (!isa<PHINode>(&instr)) {
-        functionToEntryNode_[funcName] = getNodeId(&instr);
-        break;
+    for (uint32_t node = 0; node < nodeValues_.size(); node++) {
+      if (nodeKinds_[node] != NodeKind::Instruction)
+        continue;
+      auto it = spans.spans.find(nodeValues_[node]);
+      if (it != spans.spans.end()) {
+        staticLabels_[node] = text.substr(it->second.first,
+                                          it->second.second - it->second.first);
+      } else {
+        staticLabels_[node] =
+            getInstructionLabel(*cast<Instruction>(nodeValues_[node]));
       }
     }
+  } else if (!missing.empty()) {
+    ModuleSlotTracker slots(functions_.front()->getParent());
+    for (uint32_t func : missing) {
+      slots.incorporateFunction(*functions_[func]);
+      for (uint32_t node = functionNodes_[func];
+           node < functionNodes_[func + 1]; node++) {
+        if (nodeKinds_[node] != NodeKind::Instruction)
+          continue;
+        std::string &label = staticLabels_[node];
+        label.clear();
+        raw_string_ostream out(label);
+        nodeValues_[node]->print(out, slots);
+      }
+    }
+  }
 
-    for (auto &block : function) {
-      std::string blockId = getNodeId(&block);
-      auto bbIt = basicBlocks_.find(blockId);
+  for (uint32_t func : missing) {
+    if (FunctionCache *cache = functionCaches_[func]) {
+      cache->labels.assign(staticLabels_.begin() + functionNodes_[func],
+                           staticLabels_.begin() + functionNodes_[func + 1]);
+    }
+  }
+}
 
-      if (bbIt != basicBlocks_.end()) {
-        auto &insts = bbIt->second.instructions;
-        for (size_t i = 0; i + 1 < insts.size(); i++) {
-          const std::string &a = insts[i];
-          const std::string &b = insts[i + 1];
-          if (cfgSeen.insert({a, b}).second) {
-            nodes_[a].cfgSuccessors.push_back(b);
-          }
-        }
+std::string GraphVisualizer::nodeLabel(uint32_t node) const {
+  StringRef label = staticLabel(node);
+  if (runtimeTexts_[node].empty())
+    return label.str();
+  size_t end = label.size();
+  if (nodeKinds_[node] == NodeKind::Instruction) {
+    while (end > 0 && (label[end - 1] == '\n' || label[end - 1] == ' '))
+      end--;
+  }
+  return label.substr(0, end).str() + "    " + runtimeTexts_[node];
+}
+
+void GraphVisualizer::resolveSites() {
+  nodeSites_.clear();
+  liveInSites_.clear();
+  if (siteManifest_.empty())
+    return;
+
+  nodeSites_.assign(nodeCount(), NoIndex);
+  StringMap<uint32_t> functionsByName;
+  for (uint32_t func = 0; func < functionNames_.size(); func++)
+    functionsByName[functionNames_[func]] = func;
+
+  size_t unresolved = 0;
+  for (uint32_t site = 0; site < siteManifest_.ids.size(); site++) {
+    const SitePosition &at = siteManifest_.positions[site];
+    // constants have no position, they are joined by id
+    if (at.kind == SitePosition::Constant)
+      continue;
+
+    uint32_t node = NoIndex;
+    auto funcIt = functionsByName.find(at.function);
+    if (funcIt != functionsByName.end()) {
+      uint32_t func = funcIt->second;
+      uint32_t block = functionBlocks_[func] + at.block;
+      if (at.kind == SitePosition::Argument) {
+        // arguments come first
+        uint32_t arg = functionNodes_[func] + at.index;
+        if (arg < functionNodes_[func + 1] &&
+            nodeKinds_[arg] == NodeKind::Argument)
+          node = arg;
+      } else if (block < functionBlocks_[func + 1] &&
+                 at.index < blockEnd_[block] - blockBegin_[block]) {
+        node = blockBegin_[block] + at.index;
       }
+    }
+    // a manifest of another module
+    if (node == NoIndex || !isRecordableNode(node)) {
+      unresolved++;
+      continue;
+    }
 
-      if (auto *terminator = block.getTerminator()) {
-        std::string termId = getNodeId(terminator);
+    if (at.segment >= 0)
+      liveInSites_[{node, uint32_t(at.segment)}] = site;
+    else
+      nodeSites_[node] = site;
+  }
+  if (unresolved > 0) {
+    std::cerr << "warn: " << unresolved
+              << " sites of the manifest are not in the module\n";
+  }
+}
 
-        for (unsigned i = 0; i < terminator->getNumSuccessors(); i++) {
-          BasicBlock *succ = terminator->getSuccessor(i);
-          std::string succId = getNodeId(succ);
+std::string GraphVisualizer::positionalId(uint32_t node) const {
+  SitePosition at;
+  at.function = functionNames_[nodeFunctions_[node]];
+  if (nodeKinds_[node] == NodeKind::Argument) {
+    at.kind = SitePosition::Argument;
+    at.index = cast<Argument>(nodeValues_[node])->getArgNo();
+    return positionalSiteId(at, "arg");
+  }
+  uint32_t block = nodeBlocks_[node];
+  at.block = block - functionBlocks_[nodeFunctions_[node]];
+  at.index = node - blockBegin_[block];
+  return positionalSiteId(
+      at, cast<Instruction>(nodeValues_[node])->getOpcodeName());
+}
 
-          auto succIt = basicBlocks_.find(succId);
-          if (succIt != basicBlocks_.end() &&
-              !succIt->second.instructions.empty()) {
-            const std::string &first = succIt->second.instructions.front();
-            if (cfgSeen.insert({termId, first}).second) {
-              nodes_[termId].cfgSuccessors.push_back(first);
-            }
-          }
-        }
+std::string GraphVisualizer::liveInKeyFor(Value *value,
+                                          unsigned segment) const {
+  auto nodeIt = valueNodes_.find(value);
+  if (nodeIt == valueNodes_.end())
+    return ReconstructionPlan::liveInKey(getNodeId(value), segment);
+  uint32_t node = nodeIt->second;
+  if (!nodeSites_.empty()) {
+    auto it = liveInSites_.find({node, segment});
+    return it == liveInSites_.end() ? std::string()
+                                    : siteManifest_.ids[it->second];
+  }
+  return ReconstructionPlan::liveInKey(nodeId(node), segment);
+}
+
+// FIXME[Dkay]: What is happend here is unclear to me. Please, work on
+// architecture of your solution
+//
+// keys the runtime may have used for the node, most specific first. Only
+// used without a site manifest.
+std::vector<std::string> GraphVisualizer::runtimeKeysFor(uint32_t node) const {
+  Value *value = nodeValues_[node];
+  const std::string &funcName = functionNames_[nodeFunctions_[node]];
+  std::string id = nodeId(node);
+
+  if (nodeKinds_[node] == NodeKind::Argument) {
+    std::string argName = value->getName().str();
+    // the id of an unnamed argument is its positional id
+    if (!value->hasName())
+      return {id};
+    return {id, funcName + "_%" + argName, "%" + argName, argName};
+  }
+
+  if (nodeKinds_[node] == NodeKind::Constant) {
+    std::vector<std::string> keys = {id, getNodeId(value),
+                                     getValueLabel(value)};
+    if (auto *ci = dyn_cast<ConstantInt>(value))
+      keys.push_back(std::to_string(ci->getSExtValue()));
+    return keys;
+  }
+
+  auto &instr = *cast<Instruction>(value);
+  std::string instrName = getInstructionName(instr);
+  // traces from before positional ids have "f::add" for every unnamed add
+  if (!instr.hasName())
+    return {id, funcName + "::" + instrName, instrName};
+  return {id, funcName + "_%" + instr.getName().str(),
+          funcName + "::" + instrName, instrName,
+          "%" + instr.getName().str()};
+}
+
+bool GraphVisualizer::findRuntimeKey(
+    uint32_t node, function_ref<bool(const std::string &)> found) const {
+  if (!nodeSites_.empty()) {
+    uint32_t site = nodeSites_[node];
+    if (site != NoIndex)
+      return found(siteManifest_.ids[site]);
+    // constants are joined by id, reconstructValues adds the values it
+    // recomputes under the node id
+    if (nodeKinds_[node] == NodeKind::Argument)
+      return false;
+    if (nodeKinds_[node] == NodeKind::Instruction &&
+        (graphFile_ ||
+         !plans_.at(functions_[nodeFunctions_[node]])
+              .isReconstructible(cast<Instruction>(nodeValues_[node]))))
+      return false;
+    return found(nodeId(node));
+  }
+  // the instrumenter's id, saved with the node
+  if (graphFile_)
+    return found(savedString(savedNodes_[node].key).str());
+
+  for (const auto &key : runtimeKeysFor(node)) {
+    if (found(key))
+      return true;
+  }
+  // the printed instruction, last as it is the one that needs formatting
+  return nodeKinds_[node] == NodeKind::Instruction &&
+         found(staticLabel(node).str());
+}
+
+// constants the runtime would have recorded get their value from the IR,
+// minimal traces leave them out
+static std::string constantValueText(Value *value) {
+  if (!isRecordableType(value->getType()))
+    return "";
+  if (auto *ci = dyn_cast<ConstantInt>(value))
+    return std::to_string(ci->getSExtValue());
+  if (auto *cf = dyn_cast<ConstantFP>(value)) {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%f", cf->getValueAPF().convertToFloat());
+    return buf;
+  }
+  return "";
+}
+
+void GraphVisualizer::buildPlans() {
+  if (!plans_.empty() || functions_.empty())
+    return;
+  std::vector<std::optional<ReconstructionPlan>> plans(functions_.size());
+  if (jobs_ == 1 || functions_.size() < 2) {
+    for (size_t i = 0; i < functions_.size(); i++)
+      plans[i].emplace(*functions_[i]);
+  } else {
+    ThreadPool pool(hardware_concurrency(jobs_));
+    for (size_t i = 0; i < functions_.size(); i++)
+      pool.async([&, i] { plans[i].emplace(*functions_[i]); });
+    pool.wait();
+  }
+  for (size_t i = 0; i < functions_.size(); i++)
+    plans_.emplace(functions_[i], std::move(*plans[i]));
+}
+
+void GraphVisualizer::applyRuntimeValues() {
+  for (auto &text : runtimeTexts_)
+    text.clear();
+  sampled_.assign(nodeCount(), false);
+  buildPlans();
+  reconstructValues();
+
+  for (uint32_t node = 0; node < nodeCount(); node++) {
+    bool found = findRuntimeKey(node, [&](const std::string &key) {
+      auto it = runtimeValues_.find(key);
+      if (it == runtimeValues_.end() || it->second.empty())
+        return false;
+      sampled_[node] = it->second.dropped > 0;
+      runtimeTexts_[node] = describeRuntimeValue(it->second);
+      return true;
+    });
+
+    if (!found && nodeKinds_[node] == NodeKind::Constant) {
+      std::string text =
+          graphFile_ ? savedString(savedNodes_[node].constantValue).str()
+                     : constantValueText(nodeValues_[node]);
+      if (!text.empty())
+        runtimeTexts_[node] = "VALUE=" + text;
+    }
+  }
+}
+
+void GraphVisualizer::reconstructValues() {
+  for (const auto &key : reconstructedKeys_)
+    runtimeValues_.erase(key);
+  reconstructedKeys_.clear();
+  if (plans_.empty())
+    return;
+
+  // last value overall and, for sites hit by several threads, per thread
+  struct KnownValue {
+    Constant *value = nullptr;
+    std::map<unsigned, Constant *> perThread;
+    uint64_t dropped = 0;
+  };
+  std::unordered_map<const Value *, KnownValue> computed;
+
+  auto toConstant = [](Type *type, const std::string &text) -> Constant * {
+    if (!type->isIntegerTy() || text.empty())
+      return nullptr;
+    return ConstantInt::get(type, std::strtoll(text.c_str(), nullptr, 10),
+                            /*isSigned=*/true);
+  };
+
+  auto findKey = [&](Type *type, const std::string &key, KnownValue &out) {
+    auto it = runtimeValues_.find(key);
+    if (it == runtimeValues_.end() || it->second.value.empty())
+      return false;
+    out.value = toConstant(type, it->second.value);
+    for (const auto &thread : it->second.perThread)
+      out.perThread[thread.first] = toConstant(type, thread.second);
+    out.dropped = it->second.dropped;
+    return out.value != nullptr;
+  };
+  auto findRecorded = [&](Value *value, KnownValue &out) {
+    auto nodeIt = valueNodes_.find(value);
+    if (nodeIt == valueNodes_.end())
+      return false;
+    return findRuntimeKey(nodeIt->second, [&](const std::string &key) {
+      return findKey(value->getType(), key, out);
+    });
+  };
+
+  for (uint32_t block = 0; block < blockPtrs_.size(); block++) {
+    const ReconstructionPlan &plan = plans_.at(blockPtrs_[block]->getParent());
+    for (uint32_t node = blockBegin_[block]; node < blockEnd_[block]; node++) {
+      auto *instr = cast<Instruction>(nodeValues_[node]);
+      if (!plan.isReconstructible(instr))
+        continue;
+
+      // a full trace has it anyway
+      KnownValue result;
+      if (findRecorded(instr, result)) {
+        computed[instr] = result;
+        continue;
       }
-      // def-use + call edges
-      for (auto &instr : block) {
-        std::string instrId = getNodeId(&instr);
-        for (const auto &operandId : nodes_[instrId].operands) {
-          if (nodes_.find(operandId) != nodes_.end()) {
-            nodes_[operandId].defUseSuccessors.push_back(instrId);
+
+      std::vector<KnownValue> ops;
+      bool complete = true;
+      for (Value *operand : instr->operands()) {
+        KnownValue op;
+        if (auto *ci = dyn_cast<ConstantInt>(operand)) {
+          op.value = ci;
+        } else if (int segment = plan.liveInSegment(instr, operand);
+                   segment >= 0) {
+          // the operand's own value may be from a later run of its block,
+          // even if it was recomputed
+          std::string key = liveInKeyFor(operand, unsigned(segment));
+          if (!findKey(operand->getType(), key, op)) {
+            complete = false;
+            break;
           }
+        } else if (computed.count(operand)) {
+          op = computed[operand];
+        } else if (!findRecorded(operand, op)) {
+          complete = false;
+          break;
         }
+        ops.push_back(op);
+      }
+      if (!complete)
+        continue;
 
-        if (auto *callInst = dyn_cast<CallInst>(&instr)) {
-          if (Function *calledFunc = callInst->getCalledFunction()) {
-            if (!calledFunc->isDeclaration()) {
-              FunctionCallInfo callInfo;
-              callInfo.caller = funcName;
-              callInfo.callee = calledFunc->getName().str();
-              callInfo.callSiteId = instrId;
-              callInfo.callOrder = callOrderCounter++;
-              functionCalls_.push_back(callInfo);
-            }
-          }
+      std::vector<Constant *> values;
+      std::set<unsigned> threads;
+      for (const auto &op : ops) {
+        values.push_back(op.value);
+        result.dropped = std::max(result.dropped, op.dropped);
+        for (const auto &thread : op.perThread)
+          threads.insert(thread.first);
+      }
+      result.value = evaluateReconstructible(*instr, values);
+      if (!result.value)
+        continue;
+
+      // values of sites only one thread ran are that thread's values too
+      for (unsigned thread : threads) {
+        values.clear();
+        for (const auto &op : ops) {
+          auto it = op.perThread.find(thread);
+          values.push_back(it != op.perThread.end() ? it->second
+                           : op.perThread.empty()   ? op.value
+                                                    : nullptr);
         }
+        if (std::find(values.begin(), values.end(), nullptr) != values.end())
+          continue;
+        if (Constant *value = evaluateReconstructible(*instr, values))
+          result.perThread[thread] = value;
       }
+      computed[instr] = result;
+
+      if (!isRecordableType(instr->getType()))
+        continue;
+      std::string id = nodeId(node);
+      RuntimeValue &value = runtimeValues_[id];
+      value = RuntimeValue();
+      value.value =
+          std::to_string(cast<ConstantInt>(result.value)->getSExtValue());
+      for (const auto &thread : result.perThread)
+        value.perThread[thread.first] =
+            std::to_string(cast<ConstantInt>(thread.second)->getSExtValue());
+      value.dropped = result.dropped;
+      reconstructedKeys_.push_back(id);
     }
   }
+}
 
-  std::cout << "  Nodes: " << nodes_.size() << "\n";
-  std::cout << "  Calls: " << functionCalls_.size() << "\n";
-  return true;
+bool GraphVisualizer::feedRuntimeStream(const char *data, size_t size) {
+  return streamDecoder_.feed(data, size);
+}
+
+size_t GraphVisualizer::refreshRuntimeValues() {
+  size_t changed = streamDecoder_.publish(runtimeValues_);
+  if (changed > 0) {
+    runtimeValuesLoaded_ = true;
+    applyRuntimeValues();
+  }
+  return changed;
+}
+
+void GraphVisualizer::setRuntimeValues(RuntimeValueMap values) {
+  runtimeValues_ = std::move(values);
+  runtimeValuesLoaded_ = !runtimeValues_.empty();
+  applyRuntimeValues();
 }
 
 bool GraphVisualizer::loadRuntimeValues(const std::string &logFile) {
-  std::ifstream log(logFile);
-  if (!log.is_open()) {
-    std::cerr << "    can't open runtime log: " << logFile << "\n";
+  return readRuntimeLog(logFile, runtimeValues_);
+}
+
+bool GraphVisualizer::loadExecutionCounts(const std::string &countsFile) {
+  std::ifstream in(countsFile);
+  if (!in.is_open()) {
+    std::cerr << "    can't open execution counts: " << countsFile << "\n";
     return false;
   }
 
+  std::map<std::string, uint32_t> functionsByName;
+  for (uint32_t i = 0; i < functionNames_.size(); i++)
+    functionsByName[functionNames_[i]] = i;
+
+  // "func:3" -> block 3 of func
+  auto findBlock = [&](const std::string &name) -> uint32_t {
+    size_t colon = name.rfind(':');
+    if (colon == std::string::npos)
+      return NoIndex;
+    auto it = functionsByName.find(name.substr(0, colon));
+    if (it == functionsByName.end())
+      return NoIndex;
+    uint32_t block = functionBlocks_[it->second] +
+                     unsigned(std::atoi(name.c_str() + colon + 1));
+    return block < functionBlocks_[it->second + 1] ? block : NoIndex;
+  };
+
   std::string line;
   int cnt = 0;
-
-  // TODO [Dkay]: You can use Json and save yourself from weird parsing. LLVM
-  // also has json lib.
-  while (std::getline(log, line)) {
-    if (line.empty())
-      continue;
-
+  while (std::getline(in, line)) {
     size_t p = line.rfind(':');
     if (p == std::string::npos)
       continue;
-
     std::string key = line.substr(0, p);
-    std::string value = line.substr(p + 1);
-
-    // kill fucking whitespaces
-    key.erase(0, key.find_first_not_of(" \t\r\n"));
-    key.erase(key.find_last_not_of(" \t\r\n") + 1);
-    value.erase(0, value.find_first_not_of(" \t\r\n"));
-    value.erase(value.find_last_not_of(" \t\r\n") + 1);
+    uint64_t count = std::strtoull(line.c_str() + p + 1, nullptr, 10);
 
-    if (!key.empty() && !value.empty()) {
-      runtimeValues_[key] = value;
+    size_t arrow = key.find("->");
+    if (arrow == std::string::npos) {
+      uint32_t block = findBlock(key);
+      if (block == NoIndex)
+        continue;
+      blockExecCounts_[block] = count;
+      blockCounted_[block] = true;
+      maxExecCount_ = std::max(maxExecCount_, count);
       cnt++;
+      continue;
     }
+
+    std::string from = key.substr(0, arrow);
+    uint32_t pred = findBlock(from);
+    uint32_t succ = findBlock(from.substr(0, from.rfind(':') + 1) +
+                              key.substr(arrow + 2));
+    if (pred == NoIndex || succ == NoIndex ||
+        blockBegin_[pred] == blockEnd_[pred] ||
+        blockBegin_[succ] == blockEnd_[succ])
+      continue;
+    uint32_t term = blockEnd_[pred] - 1;
+    for (uint32_t edge = cfgEdges_.begin(term); edge < cfgEdges_.end(term);
+         edge++) {
+      if (cfgEdges_.targets[edge] == blockBegin_[succ]) {
+        cfgEdgeCounts_[edge] = count;
+        cfgEdgeCounted_[edge] = true;
+      }
+    }
+    maxExecCount_ = std::max(maxExecCount_, count);
+    cnt++;
   }
-  log.close();
-  if (cnt > 0) {
-    return true;
-  }
-  return false;
+
+  executionCountsLoaded_ = cnt > 0;
+  if (executionCountsLoaded_)
+    std::cout << "  Loaded " << cnt << " execution counts\n";
+  return executionCountsLoaded_;
 }
 
 std::string GraphVisualizer::getNodeId(Value *value) const {
@@ -499,6 +1159,252 @@ std::string GraphVisualizer::getBasicBlockLabel(BasicBlock &block) const {
   return rso.str();
 }
 
+// 0 for code that never ran, otherwise (0, 1] on a log scale, so a loop
+// running a million times doesn't flatten everything else to zero
+static double heatLevel(uint64_t count, uint64_t maxCount) {
+  if (count == 0 || maxCount == 0)
+    return 0;
+  return std::log1p(double(count)) / std::log1p(double(maxCount));
+}
+
+// light yellow for cold code, dark red for the hottest block, grey if never run
+static std::string heatColor(uint64_t count, uint64_t maxCount) {
+  if (count == 0)
+    return "#eeeeee";
+  double t = heatLevel(count, maxCount);
+  char buf[8];
+  snprintf(buf, sizeof(buf), "#%02x%02x%02x", int(255 - 66 * t),
+           int(255 - 255 * t), int(204 - 166 * t));
+  return buf;
+}
+
+// characters escapeForDot replaces with a backslash sequence
+static bool needsDotEscape(char c) {
+  switch (c) {
+  case '"':
+  case '\\':
+  case '\n':
+  case '\r':
+  case '\t':
+  case '<':
+  case '>':
+  case '{':
+  case '}':
+  case '|':
+    return true;
+  default:
+    return false;
+  }
+}
+
+// length of the start of text that needs no escaping, checked 16 bytes at a
+// time where SSE2 is available
+static size_t cleanPrefix(const char *text, size_t size) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i specials[] = {
+      _mm_set1_epi8('"'), _mm_set1_epi8('\\'), _mm_set1_epi8('\n'),
+      _mm_set1_epi8('\r'), _mm_set1_epi8('\t'), _mm_set1_epi8('<'),
+      _mm_set1_epi8('>'), _mm_set1_epi8('{'), _mm_set1_epi8('}'),
+      _mm_set1_epi8('|')};
+  for (; i + 16 <= size; i += 16) {
+    __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+    __m128i hits = _mm_setzero_si128();
+    for (const __m128i &special : specials)
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, special));
+    if (int mask = _mm_movemask_epi8(hits))
+      return i + __builtin_ctz(mask);
+  }
+#endif
+  while (i < size && !needsDotEscape(text[i]))
+    i++;
+  return i;
+}
+
+// appends text escaped for a DOT string. Labels over 140 escaped characters
+// are cut to 137 and "...", so escaping stops once that is certain.
+static void appendDotEscaped(std::string &out, StringRef text) {
+  const size_t limit = 140;
+  size_t start = out.size();
+  size_t pos = 0;
+  while (pos < text.size() && out.size() - start <= limit) {
+    size_t clean = cleanPrefix(text.data() + pos, text.size() - pos);
+    out.append(text.data() + pos, clean);
+    pos += clean;
+    if (pos == text.size())
+      break;
+    char c = text[pos++];
+    out += '\\';
+    out += c == '\n' ? 'n' : c == '\r' ? 'r' : c == '\t' ? 't' : c;
+  }
+  if (out.size() - start > limit) {
+    out.resize(start + limit - 3);
+    out += "...";
+  }
+}
+
+static std::string heatEdgeAttrs(uint64_t count, uint64_t maxCount,
+                                 bool labeled) {
+  if (count == 0) {
+    return std::string(" [color=\"#bbbbbb\", penwidth=1, style=dotted") +
+           (labeled ? ", label=\"0\"]" : "]");
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), " [penwidth=%.1f",
+           1 + 7 * heatLevel(count, maxCount));
+  std::string attrs = buf;
+  if (labeled)
+    attrs += ", label=\"" + std::to_string(count) + "\"";
+  return attrs + "]";
+}
+
+// attributes of the whole graph and the edge style of each section, the same
+// in exportToDot and in every shard of exportShards
+static const char *const dotGraphAttrs =
+    "  rankdir=TB;\n"
+    "  compound=true;\n"
+    "  nodesep=0.5;\n"
+    "  ranksep=0.8;\n"
+    "  node [fontname=\"Courier New\", fontsize=10];\n"
+    "  edge [fontname=\"Arial\", fontsize=9];\n\n";
+static const char *const cfgEdgeStyle =
+    "  edge [color=\"#0066cc\", penwidth=2.5, style=solid, "
+    "arrowhead=normal];\n";
+static const char *const defUseEdgeStyle =
+    "  edge [color=\"black\", penwidth=1.2, style=dashed, arrowhead=vee];\n";
+static const char *const callEdgeStyle =
+    "  edge [color=\"#cc3366\", penwidth=2.0, style=\"bold\", "
+    "arrowhead=\"vee\"];\n";
+
+const GraphVisualizer::EdgeList &GraphVisualizer::defUseSources() const {
+  if (defUseSources_.offsets.empty())
+    defUseSources_ = defUseEdges_.reversed();
+  return defUseSources_;
+}
+
+const GraphVisualizer::EdgeList &GraphVisualizer::callSitesOf() const {
+  if (callSitesOf_.offsets.empty())
+    callSitesOf_ = callEdges_.reversed();
+  return callSitesOf_;
+}
+
+uint32_t GraphVisualizer::findNode(const std::string &id) const {
+  for (uint32_t node = 0; node < nodeCount(); node++) {
+    if (nodeId(node) == id)
+      return node;
+  }
+  return NoIndex;
+}
+
+std::vector<bool> GraphVisualizer::walkSlice(uint32_t origin,
+                                             SliceDirection direction,
+                                             unsigned depth, bool followCalls,
+                                             std::vector<uint32_t> *parents)
+    const {
+  // a backward slice walks the edges against their direction
+  const EdgeList &defUse = direction == SliceDirection::Backward
+                               ? defUseSources()
+                               : defUseEdges_;
+  if (parents)
+    parents->assign(nodeCount(), NoIndex);
+
+  // breadth first, one level per edge of distance
+  std::vector<bool> reached(nodeCount(), false);
+  std::vector<uint32_t> level = {origin};
+  std::vector<uint32_t> nextLevel;
+  reached[origin] = true;
+  auto visit = [&](uint32_t node, uint32_t from) {
+    if (!reached[node]) {
+      reached[node] = true;
+      nextLevel.push_back(node);
+      if (parents)
+        (*parents)[node] = from;
+    }
+  };
+
+  // a call passes its operands to all arguments of the callee and gets back
+  // what any of its returns return. Arguments and returns of a function are
+  // taken once.
+  std::vector<bool> calleeTaken(functionNames_.size(), false);
+  auto isReturn = [&](uint32_t node) {
+    return nodeKinds_[node] == NodeKind::Instruction &&
+           shapeOf(node) == DEFUSE_SHAPE_TERMINATOR &&
+           cfgEdges_.begin(node) == cfgEdges_.end(node);
+  };
+  auto takeCallee = [&](uint32_t func, uint32_t from) {
+    if (calleeTaken[func])
+      return;
+    calleeTaken[func] = true;
+    for (uint32_t node = functionNodes_[func]; node < functionNodes_[func + 1];
+         node++) {
+      bool forward = direction == SliceDirection::Forward;
+      if (forward ? nodeKinds_[node] == NodeKind::Argument : isReturn(node))
+        visit(node, from);
+    }
+  };
+  auto takeCallers = [&](uint32_t func, uint32_t from) {
+    if (functionEntries_[func] != NoIndex) {
+      for (uint32_t site : callSitesOf().of(functionEntries_[func]))
+        visit(site, from);
+    }
+  };
+
+  for (unsigned distance = 0;
+       !level.empty() && (depth == 0 || distance < depth); distance++) {
+    nextLevel.clear();
+    for (uint32_t node : level) {
+      for (uint32_t other : defUse.of(node))
+        visit(other, node);
+      if (!followCalls)
+        continue;
+      // a forward slice of a call's result doesn't go into the callee, the
+      // slices of its operands do
+      bool intoCallee =
+          direction == SliceDirection::Backward || node != origin;
+      for (uint32_t entry : callEdges_.of(node)) {
+        if (intoCallee)
+          takeCallee(nodeFunctions_[entry], node);
+      }
+      bool leavesFunction = direction == SliceDirection::Forward
+                                ? isReturn(node)
+                                : nodeKinds_[node] == NodeKind::Argument;
+      if (leavesFunction)
+        takeCallers(nodeFunctions_[node], node);
+    }
+    std::swap(level, nextLevel);
+  }
+  return reached;
+}
+
+bool GraphVisualizer::selectSlice(const std::string &id,
+                                  SliceDirection direction, unsigned depth,
+                                  bool followCalls) {
+  slice_.clear();
+  sliceFunctions_.clear();
+  sliceOrigin_ = NoIndex;
+  uint32_t origin = findNode(id);
+  if (origin == NoIndex)
+    return false;
+  std::vector<bool> reached =
+      walkSlice(origin, direction, depth, followCalls);
+
+  size_t nodes = 0;
+  sliceFunctions_.assign(functionNames_.size(), false);
+  for (uint32_t node = 0; node < nodeCount(); node++) {
+    if (reached[node]) {
+      sliceFunctions_[nodeFunctions_[node]] = true;
+      nodes++;
+    }
+  }
+  slice_ = std::move(reached);
+  sliceOrigin_ = origin;
+  std::cout << "  Slice: " << nodes << " nodes in "
+            << std::count(sliceFunctions_.begin(), sliceFunctions_.end(), true)
+            << " functions\n";
+  return true;
+}
+
 bool GraphVisualizer::exportToDot(const std::string &filename) const {
   std::ofstream out(filename);
   if (!out.is_open()) {
@@ -514,179 +1420,69 @@ bool GraphVisualizer::exportToDot(const std::string &filename) const {
 
   // graph header
   out << "digraph CombinedCFGDefUse {\n";
-  out << "  rankdir=TB;\n";
-  out << "  compound=true;\n";
-  out << "  nodesep=0.5;\n";
-  out << "  ranksep=0.8;\n";
-  out << "  node [fontname=\"Courier New\", fontsize=10];\n";
-  out << "  edge [fontname=\"Arial\", fontsize=9];\n\n";
+  out << dotGraphAttrs;
   out << "  // ========== BASIC BLOCKS (Grouped by Function) ==========\n";
 
-  std::map<std::string, std::vector<std::string>> funcToNodes;
-  std::map<std::string, std::vector<std::string>> funcToArguments;
-  std::map<std::string, std::vector<std::string>> funcToConstants;
-
-  for (const auto &pair : nodes_) {
-    const GraphNode &node = pair.second;
-    if (node.functionName.empty()) {
-      continue;
-    }
-    if (node.isArgument) {
-      funcToArguments[node.functionName].push_back(pair.first);
-    } else if (node.isConstant) {
-      funcToConstants[node.functionName].push_back(pair.first);
-    } else if (node.isInstruction) {
-      funcToNodes[node.functionName].push_back(pair.first);
-    }
-  }
-
-  for (const auto &funcPair : funcToNodes) {
-    std::string funcName = funcPair.first;
-
-    out << "  subgraph \"cluster_" << funcName << "\" {\n";
-    out << "    label=\"" << escapeForDot(funcName) << "()\";\n";
-    out << "    style=filled;\n";
-    out << "    fillcolor=\"#f0f8ff\";\n";
-    out << "    color=\"#3366cc\";\n";
-    out << "    penwidth=2;\n";
-    out << "    fontsize=11;\n";
-    out << "    labelloc=\"t\";\n\n";
-
-    out << "    // Arguments\n";
-    out << "    node [shape=ellipse, style=filled, fillcolor=\"#d0e8ff\"];\n";
-    if (funcToArguments.find(funcName) != funcToArguments.end()) {
-      for (const auto &argId : funcToArguments[funcName]) {
-        const GraphNode &node = nodes_.at(argId);
-        out << "    \"" << argId << "\" [label=\"" << escapeForDot(node.label)
-            << "\"];\n";
+  // every instruction label is needed, format them before the workers read
+  // them
+  formatInstructionLabels();
+  std::optional<ThreadPool> pool;
+  if (jobs_ != 1)
+    pool.emplace(hardware_concurrency(jobs_));
+
+  bool cacheText = textCacheable();
+
+  // functions are rendered into their own buffers, a window at a time so
+  // the memory stays bounded, and written out in order
+  auto writeSection = [&](RenderFn render,
+                          std::string FunctionCache::*cached) {
+    const uint32_t window = 256;
+    std::vector<std::string> buffers(window);
+    std::vector<const std::string *> texts(window);
+    for (uint32_t first = 0; first < functionNames_.size(); first += window) {
+      uint32_t count =
+          std::min<uint32_t>(window, functionNames_.size() - first);
+      for (uint32_t i = 0; i < count; i++) {
+        auto renderOne = [&, i] {
+          texts[i] = &renderedText(first + i, render, cached, cacheText,
+                                   buffers[i]);
+        };
+        if (pool)
+          pool->async(renderOne);
+        else
+          renderOne();
       }
+      if (pool)
+        pool->wait();
+      for (uint32_t i = 0; i < count; i++)
+        out.write(texts[i]->data(), texts[i]->size());
     }
+  };
 
-    out << "\n    // Constants\n";
-    out << "    node [shape=oval, style=filled, fillcolor=\"#e0e0e0\", "
-           "fontsize=8, height=0.3, width=0.5];\n";
-    if (funcToConstants.find(funcName) != funcToConstants.end()) {
-      for (const auto &constId : funcToConstants[funcName]) {
-        const GraphNode &node = nodes_.at(constId);
-        out << "    \"" << constId << "\" [label=\"" << escapeForDot(node.label)
-            << "\"];\n";
-      }
-    }
-
-    std::map<std::string, std::vector<const GraphNode *>> instrsByBlock;
-    for (const auto &nodeId : funcPair.second) {
-      const GraphNode &node = nodes_.at(nodeId);
-      if (node.parentBlock) {
-        std::string blockName = getBasicBlockLabel(*node.parentBlock);
-        instrsByBlock[blockName].push_back(&node);
-      } else {
-        instrsByBlock["unknown"].push_back(&node);
-      }
-    }
-
-    for (const auto &bbPair : instrsByBlock) {
-      const auto &bbInstrs = bbPair.second;
-      for (const GraphNode *n : bbInstrs) {
-        std::string shape = "box";
-        std::string fill = "white";
-        std::string color = "black";
-        std::string style = "filled";
-
-        if (n->isTerminator) {
-          shape = "box";
-          fill = "#ffe0e0";
-          color = "#cc0000";
-          style = "filled";
-        } else if (n->type == "phi") {
-          shape = "hexagon";
-          fill = "#f0e0ff";
-          color = "#800080";
-          style = "filled";
-        } else if (n->type == "icmp" || n->type == "fcmp") {
-          shape = "diamond";
-          fill = "#fff2cc";
-          color = "#ff9900";
-          style = "filled";
-        } else if (n->type == "call") {
-          shape = "parallelogram";
-          fill = "#d9ffff";
-          color = "#1aa3a3";
-          style = "filled";
-        }
-
-        out << "      \"" << n->id << "\" [shape=" << shape
-            << ", style=" << style << ", fillcolor=\"" << fill << "\", color=\""
-            << color << "\", label=\"" << escapeForDot(n->label) << "\"];\n";
-      }
-    }
-
-    out << "  }\n\n";
-  }
-
-  std::set<std::pair<std::string, std::string>> allEdges;
+  writeSection(&GraphVisualizer::renderCluster, &FunctionCache::cluster);
 
   out << "\n  // ========== CFG EDGES (Control Flow) ==========\n";
-  out << "  edge [color=\"#0066cc\", penwidth=2.5, style=solid, "
-         "arrowhead=normal];\n";
-
-  for (const auto &pair : nodes_) {
-    const GraphNode &node = pair.second;
-    for (const auto &succId : node.cfgSuccessors) {
-      out << "  \"" << node.id << "\" -> \"" << succId << "\";\n";
-      allEdges.insert({node.id, succId});
-    }
-  }
+  out << cfgEdgeStyle;
+  writeSection(&GraphVisualizer::renderCfgEdges, &FunctionCache::cfgEdges);
 
   out << "\n  // ========== DEF-USE EDGES (Data Flow) ==========\n";
-  out << "  edge [color=\"black\", penwidth=1.2, style=dashed, "
-         "arrowhead=vee];\n";
-
-  for (const auto &pair : nodes_) {
-    const GraphNode &node = pair.second;
-    for (const auto &succId : node.defUseSuccessors) {
-      out << "  \"" << node.id << "\" -> \"" << succId << "\";\n";
-      allEdges.insert({node.id, succId});
-    }
-  }
+  out << defUseEdgeStyle;
+  writeSection(&GraphVisualizer::renderDefUseEdges,
+               &FunctionCache::defUseEdges);
 
-  if (!functionCalls_.empty()) {
+  // call edges point into other functions and are numbered across the
+  // module, they are rendered every time
+  if (callCount_ > 0) {
     out << "\n  // ========== FUNCTION CALL EDGES ==========\n";
-    out << "  edge [color=\"#cc3366\", penwidth=2.0, style=\"bold\", "
-           "arrowhead=\"vee\"];\n";
-
-    for (const auto &call : functionCalls_) {
-      auto it = functionToEntryNode_.find(call.callee);
-      if (it != functionToEntryNode_.end()) {
-        out << "  \"" << call.callSiteId << "\" -> \"" << it->second
-            << "\" [label=\"call #" << call.callOrder
-            << "\", fontsize=9, fontcolor=\"#cc3366\"];\n";
-      }
-    }
+    out << callEdgeStyle;
+    writeSection(&GraphVisualizer::renderCallEdges, nullptr);
   }
 
+  // every operand edge from a constant or an argument is a def-use edge
+  // already, the section stays for the edge style
   out << "\n  // ========== CONSTANT/ARGUMENT INPUT EDGES ==========\n";
   out << "  edge [color=\"gray\", penwidth=1, style=dotted, arrowhead=odot];\n";
 
-  for (const auto &pair : nodes_) {
-    const GraphNode &node = pair.second;
-    if (!node.isInstruction)
-      continue;
-
-    for (const auto &operandId : node.operands) {
-      auto it = nodes_.find(operandId);
-      if (it == nodes_.end())
-        continue;
-
-      if (it->second.isConstant || it->second.isArgument) {
-        // avoid duplicating edges
-        if (allEdges.find({operandId, node.id}) == allEdges.end()) {
-          out << "  \"" << operandId << "\" -> \"" << node.id << "\";\n";
-          allEdges.insert({operandId, node.id});
-        }
-      }
-    }
-  }
-
   out << "\n  // ========== LEGEND ==========\n";
   out << "  subgraph \"cluster_legend\" {\n";
   out << "    label=\"Legend\";\n";
@@ -715,6 +1511,17 @@ bool GraphVisualizer::exportToDot(const std::string &filename) const {
   out << "    \"leg_cfg_a\" -> \"leg_cfg_b\" [color=\"#0066cc\", penwidth=2.5, "
          "style=solid, arrowhead=normal, label=\"CFG edges\", "
          "fontcolor=\"#0066cc\", fontsize=9];\n";
+  if (executionCountsLoaded_) {
+    out << "    \"leg_heat_none\" [label=\"never run\", fillcolor=\""
+        << heatColor(0, maxExecCount_) << "\"];\n";
+    out << "    \"leg_heat_cold\" [label=\"ran once\", fillcolor=\""
+        << heatColor(1, maxExecCount_) << "\"];\n";
+    out << "    \"leg_heat_hot\" [label=\"ran " << maxExecCount_
+        << " times\", fillcolor=\"" << heatColor(maxExecCount_, maxExecCount_)
+        << "\", fontcolor=\"white\"];\n";
+    out << "    { rank=same; \"leg_heat_none\"; \"leg_heat_cold\"; "
+           "\"leg_heat_hot\"; }\n";
+  }
   out << "  }\n\n";
 
   out << "}\n";
@@ -723,49 +1530,996 @@ bool GraphVisualizer::exportToDot(const std::string &filename) const {
   return true;
 }
 
-std::string GraphVisualizer::escapeForDot(const std::string &text) const {
-  std::string result;
+bool GraphVisualizer::saveGraph(const std::string &file) const {
+  std::ofstream out(file, std::ios::binary);
+  if (!out.is_open()) {
+    std::cerr << "Error: Cannot open file: " << file << "\n";
+    return false;
+  }
+  // nothing to format again
+  if (graphFile_) {
+    out.write(graphFile_->getBufferStart(), graphFile_->getBufferSize());
+    return bool(out);
+  }
 
-  for (char c : text) {
-    switch (c) {
-    case '"':
-      result += "\\\"";
-      break;
-    case '\\':
-      result += "\\\\";
-      break;
-    case '\n':
-      result += "\\n";
-      break;
-    case '\r':
-      result += "\\r";
-      break;
-    case '\t':
-      result += "\\t";
-      break;
-    case '<':
-      result += "\\<";
+  std::cout << "Saving graph: " << file << "\n";
+  formatInstructionLabels();
+
+  // every string once, offset 0 is the empty one
+  std::string strings;
+  StringMap<uint32_t> stringOffsets;
+  auto intern = [&](StringRef text) -> uint32_t {
+    auto inserted = stringOffsets.try_emplace(text, strings.size());
+    if (inserted.second) {
+      uint32_t size = text.size();
+      strings.append(reinterpret_cast<const char *>(&size), sizeof(size));
+      strings.append(text.data(), text.size());
+      strings.resize(alignTo(strings.size(), sizeof(size)), '\0');
+    }
+    return inserted.first->second;
+  };
+  intern("");
+
+  std::vector<DefuseGraphNode> nodes(nodeCount());
+  for (uint32_t node = 0; node < nodeCount(); node++) {
+    DefuseGraphNode &record = nodes[node];
+    Value *value = nodeValues_[node];
+    record.function = nodeFunctions_[node];
+    record.block = nodeBlocks_[node];
+    record.id = intern(nodeId(node));
+    record.label = intern(staticLabel(node));
+    record.key = record.id;
+    record.kind = uint8_t(nodeKinds_[node]);
+    record.flags = isRecordableNode(node) ? DEFUSE_NODE_RECORDABLE : 0;
+    if (nodeKinds_[node] == NodeKind::Constant)
+      record.constantValue = intern(constantValueText(value));
+    else if (!value->hasName())
+      record.key = intern(positionalId(node));
+    if (nodeKinds_[node] == NodeKind::Instruction)
+      record.shape = shapeOf(node);
+  }
+  std::vector<uint32_t> names;
+  for (const auto &name : functionNames_)
+    names.push_back(intern(name));
+
+  DefuseGraphHeader header = DefuseGraphHeader();
+  memcpy(header.magic, DEFUSE_GRAPH_MAGIC, DEFUSE_GRAPH_MAGIC_SIZE);
+  header.version = DEFUSE_GRAPH_VERSION;
+  header.nodeCount = nodeCount();
+  header.functionCount = functionNames_.size();
+  header.blockCount = blockBegin_.size();
+  header.cfgEdgeCount = cfgEdges_.targets.size();
+  header.defUseEdgeCount = defUseEdges_.targets.size();
+  header.callEdgeCount = callEdges_.targets.size();
+  header.callCount = callCount_;
+
+  ArrayRef<char> sections[DEFUSE_GRAPH_SECTION_COUNT];
+  auto column = [](const auto &values) {
+    return makeArrayRef(reinterpret_cast<const char *>(values.data()),
+                        values.size() * sizeof(values[0]));
+  };
+  sections[DEFUSE_GRAPH_NODES] = column(nodes);
+  sections[DEFUSE_GRAPH_FUNCTION_NAMES] = column(names);
+  sections[DEFUSE_GRAPH_FUNCTION_NODES] = column(functionNodes_);
+  sections[DEFUSE_GRAPH_FUNCTION_BLOCKS] = column(functionBlocks_);
+  sections[DEFUSE_GRAPH_FUNCTION_ENTRIES] = column(functionEntries_);
+  sections[DEFUSE_GRAPH_BLOCK_BEGIN] = column(blockBegin_);
+  sections[DEFUSE_GRAPH_BLOCK_END] = column(blockEnd_);
+  sections[DEFUSE_GRAPH_CFG_OFFSETS] = column(cfgEdges_.offsets);
+  sections[DEFUSE_GRAPH_CFG_TARGETS] = column(cfgEdges_.targets);
+  sections[DEFUSE_GRAPH_DEFUSE_OFFSETS] = column(defUseEdges_.offsets);
+  sections[DEFUSE_GRAPH_DEFUSE_TARGETS] = column(defUseEdges_.targets);
+  sections[DEFUSE_GRAPH_CALL_OFFSETS] = column(callEdges_.offsets);
+  sections[DEFUSE_GRAPH_CALL_TARGETS] = column(callEdges_.targets);
+  sections[DEFUSE_GRAPH_CALL_ORDERS] = column(callOrders_);
+  sections[DEFUSE_GRAPH_STRINGS] = column(strings);
+
+  uint64_t offset = alignTo(sizeof(header), 8);
+  for (unsigned i = 0; i < DEFUSE_GRAPH_SECTION_COUNT; i++) {
+    header.sectionOffsets[i] = offset;
+    header.sectionSizes[i] = sections[i].size();
+    offset = alignTo(offset + sections[i].size(), 8);
+  }
+
+  const char padding[8] = {};
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(padding, alignTo(sizeof(header), 8) - sizeof(header));
+  for (const auto &section : sections) {
+    out.write(section.data(), section.size());
+    out.write(padding, alignTo(section.size(), 8) - section.size());
+  }
+  if (!out) {
+    std::cerr << "Error: Cannot write graph: " << file << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool GraphVisualizer::loadGraph(const std::string &file,
+                                const std::string &runtimeLogFile) {
+  reset();
+  std::cout << "Loading saved graph: " << file << "\n";
+
+  // mapped, or read into a buffer for small files; both are aligned enough
+  // for the node records
+  auto buffer = MemoryBuffer::getFile(file, /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    std::cerr << "    can't open saved graph: " << file << "\n";
+    return false;
+  }
+  StringRef data = (*buffer)->getBuffer();
+  DefuseGraphHeader header;
+  StringRef magic(DEFUSE_GRAPH_MAGIC, DEFUSE_GRAPH_MAGIC_SIZE);
+  if (data.size() < sizeof(header) || !data.startswith(magic)) {
+    std::cerr << "    not a saved graph: " << file << "\n";
+    return false;
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  if (reinterpret_cast<uintptr_t>(data.data()) % alignof(DefuseGraphNode)) {
+    std::cerr << "    saved graph is not aligned in memory: " << file << "\n";
+    return false;
+  }
+  if (header.version != DEFUSE_GRAPH_VERSION) {
+    std::cerr << "    saved graph has version " << header.version
+              << ", expected " << DEFUSE_GRAPH_VERSION << "\n";
+    return false;
+  }
+
+  // sizes the counts imply, the string table can have any
+  uint64_t nodes = header.nodeCount;
+  uint64_t functions = header.functionCount;
+  uint64_t blocks = header.blockCount;
+  const uint64_t anySize = UINT64_MAX;
+  const uint64_t expected[DEFUSE_GRAPH_SECTION_COUNT] = {
+      nodes * sizeof(DefuseGraphNode),
+      functions * 4,
+      (functions + 1) * 4,
+      (functions + 1) * 4,
+      functions * 4,
+      blocks * 4,
+      blocks * 4,
+      (nodes + 1) * 4,
+      uint64_t(header.cfgEdgeCount) * 4,
+      (nodes + 1) * 4,
+      uint64_t(header.defUseEdgeCount) * 4,
+      (nodes + 1) * 4,
+      uint64_t(header.callEdgeCount) * 4,
+      uint64_t(header.callEdgeCount) * 4,
+      anySize};
+  for (unsigned i = 0; i < DEFUSE_GRAPH_SECTION_COUNT; i++) {
+    uint64_t offset = header.sectionOffsets[i];
+    uint64_t size = header.sectionSizes[i];
+    if ((expected[i] != anySize && size != expected[i]) || offset % 8 != 0 ||
+        offset > data.size() || size > data.size() - offset) {
+      std::cerr << "    saved graph is truncated or damaged: " << file << "\n";
+      return false;
+    }
+  }
+  auto section = [&](DefuseGraphSection i) {
+    return data.data() + header.sectionOffsets[i];
+  };
+  auto column = [&](DefuseGraphSection i, std::vector<uint32_t> &out) {
+    const auto *values = reinterpret_cast<const uint32_t *>(section(i));
+    out.assign(values, values + header.sectionSizes[i] / sizeof(uint32_t));
+  };
+
+  graphFile_ = std::move(*buffer);
+  savedNodes_ = makeArrayRef(
+      reinterpret_cast<const DefuseGraphNode *>(section(DEFUSE_GRAPH_NODES)),
+      header.nodeCount);
+  savedStrings_ = StringRef(section(DEFUSE_GRAPH_STRINGS),
+                            header.sectionSizes[DEFUSE_GRAPH_STRINGS]);
+
+  auto validString = [&](uint32_t offset) {
+    uint32_t size;
+    if (uint64_t(offset) + sizeof(size) > savedStrings_.size())
+      return false;
+    memcpy(&size, savedStrings_.data() + offset, sizeof(size));
+    return uint64_t(offset) + sizeof(size) + size <= savedStrings_.size();
+  };
+  std::vector<uint32_t> names;
+  column(DEFUSE_GRAPH_FUNCTION_NAMES, names);
+  for (uint32_t name : names) {
+    if (!validString(name)) {
+      std::cerr << "    saved graph is damaged: " << file << "\n";
+      reset();
+      return false;
+    }
+    functionNames_.push_back(savedString(name).str());
+  }
+  column(DEFUSE_GRAPH_FUNCTION_NODES, functionNodes_);
+  column(DEFUSE_GRAPH_FUNCTION_BLOCKS, functionBlocks_);
+  column(DEFUSE_GRAPH_FUNCTION_ENTRIES, functionEntries_);
+  column(DEFUSE_GRAPH_BLOCK_BEGIN, blockBegin_);
+  column(DEFUSE_GRAPH_BLOCK_END, blockEnd_);
+  column(DEFUSE_GRAPH_CFG_OFFSETS, cfgEdges_.offsets);
+  column(DEFUSE_GRAPH_CFG_TARGETS, cfgEdges_.targets);
+  column(DEFUSE_GRAPH_DEFUSE_OFFSETS, defUseEdges_.offsets);
+  column(DEFUSE_GRAPH_DEFUSE_TARGETS, defUseEdges_.targets);
+  column(DEFUSE_GRAPH_CALL_OFFSETS, callEdges_.offsets);
+  column(DEFUSE_GRAPH_CALL_TARGETS, callEdges_.targets);
+  column(DEFUSE_GRAPH_CALL_ORDERS, callOrders_);
+  callCount_ = header.callCount;
+
+  nodeKinds_.resize(header.nodeCount);
+  nodeFunctions_.resize(header.nodeCount);
+  nodeBlocks_.resize(header.nodeCount);
+  bool valid = true;
+  for (uint32_t node = 0; node < header.nodeCount; node++) {
+    const DefuseGraphNode &record = savedNodes_[node];
+    nodeKinds_[node] = NodeKind(record.kind);
+    nodeFunctions_[node] = record.function;
+    nodeBlocks_[node] = record.block;
+    valid = valid && record.kind <= uint8_t(NodeKind::Constant) &&
+            record.function < header.functionCount &&
+            (record.block < header.blockCount || record.block == NoIndex) &&
+            validString(record.id) && validString(record.label) &&
+            validString(record.key) && validString(record.constantValue);
+  }
+  // every index the exporter follows
+  auto inRange = [](const std::vector<uint32_t> &values, uint64_t end) {
+    return std::all_of(values.begin(), values.end(),
+                       [&](uint32_t value) { return value <= end; });
+  };
+  valid = valid && inRange(functionNodes_, nodes) &&
+          inRange(functionBlocks_, blocks) && inRange(blockBegin_, nodes) &&
+          inRange(blockEnd_, nodes) &&
+          inRange(cfgEdges_.offsets, header.cfgEdgeCount) &&
+          inRange(defUseEdges_.offsets, header.defUseEdgeCount) &&
+          inRange(callEdges_.offsets, header.callEdgeCount) &&
+          inRange(cfgEdges_.targets, nodes - 1) &&
+          inRange(defUseEdges_.targets, nodes - 1) &&
+          inRange(callEdges_.targets, nodes - 1);
+  if (!valid) {
+    std::cerr << "    saved graph is damaged: " << file << "\n";
+    reset();
+    return false;
+  }
+
+  if (!runtimeLogFile.empty()) {
+    runtimeValuesLoaded_ = loadRuntimeValues(runtimeLogFile);
+    if (runtimeValuesLoaded_) {
+      std::cout << "  Loaded " << runtimeValues_.size() << " runtime values\n";
+    }
+  }
+  finishGraph();
+  return true;
+}
+
+void GraphVisualizer::appendLabel(std::string &out, uint32_t node) const {
+  if (runtimeTexts_[node].empty())
+    appendDotEscaped(out, staticLabel(node));
+  else
+    appendDotEscaped(out, nodeLabel(node));
+}
+
+static void appendQuoted(std::string &out, const std::string &id) {
+  out += '"';
+  out += id;
+  out += '"';
+}
+
+void GraphVisualizer::renderCluster(uint32_t func, std::string &out) const {
+  // nodes whose runtime value comes from a sampled or budgeted trace
+  const char *sampledNodeAttrs = ", style=\"filled,dashed\", color=\"#e67300\"";
+  const std::string &funcName = functionNames_[func];
+  uint32_t begin = functionNodes_[func];
+  uint32_t end = functionNodes_[func + 1];
+  if (!slice_.empty() && !sliceFunctions_[func])
+    return;
+
+  out += "  subgraph \"cluster_" + funcName + "\" {\n";
+  out += "    label=\"";
+  appendDotEscaped(out, funcName);
+  out += "()\";\n";
+  out += "    style=filled;\n";
+  out += "    fillcolor=\"#f0f8ff\";\n";
+  out += "    color=\"#3366cc\";\n";
+  out += "    penwidth=2;\n";
+  out += "    fontsize=11;\n";
+  out += "    labelloc=\"t\";\n\n";
+
+  out += "    // Arguments\n";
+  out += "    node [shape=ellipse, style=filled, fillcolor=\"#d0e8ff\"];\n";
+  for (uint32_t node = begin; node < end; node++) {
+    if (nodeKinds_[node] != NodeKind::Argument || !inSlice(node))
+      continue;
+    out += "    ";
+    appendQuoted(out, nodeId(node));
+    out += " [label=\"";
+    appendLabel(out, node);
+    out += "\"";
+    if (sampled_[node])
+      out += sampledNodeAttrs;
+    if (node == sliceOrigin_)
+      out += ", penwidth=3";
+    out += "];\n";
+  }
+
+  out += "\n    // Constants\n";
+  out += "    node [shape=oval, style=filled, fillcolor=\"#e0e0e0\", "
+         "fontsize=8, height=0.3, width=0.5];\n";
+  for (uint32_t node = begin; node < end; node++) {
+    if (nodeKinds_[node] != NodeKind::Constant || !inSlice(node))
+      continue;
+    out += "    ";
+    appendQuoted(out, nodeId(node));
+    out += " [label=\"";
+    appendLabel(out, node);
+    out += "\"";
+    if (sampled_[node])
+      out += sampledNodeAttrs;
+    if (node == sliceOrigin_)
+      out += ", penwidth=3";
+    out += "];\n";
+  }
+
+  for (uint32_t node = begin; node < end; node++) {
+    if (nodeKinds_[node] != NodeKind::Instruction || !inSlice(node))
+      continue;
+    const char *shape = "box";
+    std::string fill = "white";
+    const char *color = "black";
+    const char *style = "filled";
+
+    switch (shapeOf(node)) {
+    case DEFUSE_SHAPE_TERMINATOR:
+      shape = "box";
+      fill = "#ffe0e0";
+      color = "#cc0000";
+      style = "filled";
       break;
-    case '>':
-      result += "\\>";
+    case DEFUSE_SHAPE_PHI:
+      shape = "hexagon";
+      fill = "#f0e0ff";
+      color = "#800080";
+      style = "filled";
       break;
-    case '{':
-      result += "\\{";
+    case DEFUSE_SHAPE_COMPARE:
+      shape = "diamond";
+      fill = "#fff2cc";
+      color = "#ff9900";
+      style = "filled";
       break;
-    case '}':
-      result += "\\}";
+    case DEFUSE_SHAPE_CALL:
+      shape = "parallelogram";
+      fill = "#d9ffff";
+      color = "#1aa3a3";
+      style = "filled";
       break;
-    case '|':
-      result += "\\|";
+    case DEFUSE_SHAPE_PLAIN:
       break;
-    default:
-      result += c;
     }
+
+    uint32_t block = nodeBlocks_[node];
+    if (executionCountsLoaded_ && blockCounted_[block])
+      fill = heatColor(blockExecCounts_[block], maxExecCount_);
+
+    // the value shown is from a sampled trace, not the real last one
+    if (sampled_[node]) {
+      color = "#e67300";
+      style = "\"filled,dashed\"";
+    }
+
+    out += "      ";
+    appendQuoted(out, nodeId(node));
+    out += " [shape=";
+    out += shape;
+    out += ", style=";
+    out += style;
+    out += ", fillcolor=\"" + fill + "\", color=\"";
+    out += color;
+    out += "\", label=\"";
+    appendLabel(out, node);
+    out += "\"";
+    if (node == sliceOrigin_)
+      out += ", penwidth=3";
+    out += "];\n";
   }
-  if (result.length() > 140) {
-    result = result.substr(0, 137) + "...";
+
+  out += "  }\n\n";
+}
+
+void GraphVisualizer::renderCfgEdges(uint32_t func, std::string &out) const {
+  uint32_t begin = functionNodes_[func];
+  uint32_t end = functionNodes_[func + 1];
+  if (!slice_.empty() && !sliceFunctions_[func])
+    return;
+  // CFG edges stay inside the function
+  std::vector<std::string> ids(end - begin);
+  for (uint32_t node = begin; node < end; node++)
+    ids[node - begin] = nodeId(node);
+
+  for (uint32_t node = begin; node < end; node++) {
+    if (!inSlice(node))
+      continue;
+    for (uint32_t edge = cfgEdges_.begin(node); edge < cfgEdges_.end(node);
+         edge++) {
+      if (!inSlice(cfgEdges_.targets[edge]))
+        continue;
+      out += "  ";
+      appendQuoted(out, ids[node - begin]);
+      out += " -> ";
+      appendQuoted(out, ids[cfgEdges_.targets[edge] - begin]);
+      // edges between blocks have their own counter, the ones inside a block
+      // run as often as the block
+      if (executionCountsLoaded_ && isTerminatorNode(node)) {
+        if (cfgEdgeCounted_[edge])
+          out += heatEdgeAttrs(cfgEdgeCounts_[edge], maxExecCount_, true);
+      } else if (executionCountsLoaded_ && blockCounted_[nodeBlocks_[node]]) {
+        out += heatEdgeAttrs(blockExecCounts_[nodeBlocks_[node]],
+                             maxExecCount_, false);
+      }
+      out += ";\n";
+    }
   }
+}
+
+void GraphVisualizer::renderDefUseEdges(uint32_t func,
+                                        std::string &out) const {
+  uint32_t begin = functionNodes_[func];
+  uint32_t end = functionNodes_[func + 1];
+  if (!slice_.empty() && !sliceFunctions_[func])
+    return;
+  // so do def-use edges
+  std::vector<std::string> ids(end - begin);
+  for (uint32_t node = begin; node < end; node++)
+    ids[node - begin] = nodeId(node);
+
+  for (uint32_t node = begin; node < end; node++) {
+    if (!inSlice(node))
+      continue;
+    for (uint32_t user : defUseEdges_.of(node)) {
+      if (!inSlice(user))
+        continue;
+      out += "  ";
+      appendQuoted(out, ids[node - begin]);
+      out += " -> ";
+      appendQuoted(out, ids[user - begin]);
+      out += ";\n";
+    }
+  }
+}
 
+void GraphVisualizer::renderCallEdges(uint32_t func, std::string &out) const {
+  for (uint32_t node = functionNodes_[func]; node < functionNodes_[func + 1];
+       node++) {
+    if (!inSlice(node))
+      continue;
+    for (uint32_t edge = callEdges_.begin(node); edge < callEdges_.end(node);
+         edge++) {
+      if (!inSlice(callEdges_.targets[edge]))
+        continue;
+      out += "  ";
+      appendQuoted(out, nodeId(node));
+      out += " -> ";
+      appendQuoted(out, nodeId(callEdges_.targets[edge]));
+      out += " [label=\"call #" + std::to_string(callOrders_[edge]) +
+             "\", fontsize=9, fontcolor=\"#cc3366\"];\n";
+    }
+  }
+}
+
+// text of a static graph is cached with the function, runtime values and
+// counts make it different for every export
+bool GraphVisualizer::textCacheable() const {
+  return !runtimeValuesLoaded_ && !executionCountsLoaded_ &&
+         !functionCaches_.empty() && slice_.empty();
+}
+
+const std::string &
+GraphVisualizer::renderedText(uint32_t func, RenderFn render,
+                              std::string FunctionCache::*cached,
+                              bool useCache, std::string &buffer) const {
+  FunctionCache *cache = useCache && cached ? functionCaches_[func] : nullptr;
+  if (cache && !(cache->*cached).empty())
+    return cache->*cached;
+  buffer.clear();
+  (this->*render)(func, buffer);
+  if (cache)
+    cache->*cached = buffer;
+  return buffer;
+}
+
+void GraphVisualizer::renderShard(uint32_t func,
+                                  const std::vector<std::string> &shardNames,
+                                  bool useCache, std::string &out) const {
+  std::string buffer;
+  out += "digraph \"";
+  appendDotEscaped(out, functionNames_[func]);
+  out += "\" {\n";
+  out += dotGraphAttrs;
+  out += renderedText(func, &GraphVisualizer::renderCluster,
+                      &FunctionCache::cluster, useCache, buffer);
+  out += "\n  // ========== CFG EDGES (Control Flow) ==========\n";
+  out += cfgEdgeStyle;
+  out += renderedText(func, &GraphVisualizer::renderCfgEdges,
+                      &FunctionCache::cfgEdges, useCache, buffer);
+  out += "\n  // ========== DEF-USE EDGES (Data Flow) ==========\n";
+  out += defUseEdgeStyle;
+  out += renderedText(func, &GraphVisualizer::renderDefUseEdges,
+                      &FunctionCache::defUseEdges, useCache, buffer);
+
+  // the callee is in another shard, its calls go to a box linking to it
+  std::string calls;
+  std::vector<uint32_t> callees;
+  for (uint32_t node = functionNodes_[func]; node < functionNodes_[func + 1];
+       node++) {
+    if (!inSlice(node))
+      continue;
+    for (uint32_t edge = callEdges_.begin(node); edge < callEdges_.end(node);
+         edge++) {
+      uint32_t target = callEdges_.targets[edge];
+      if (!inSlice(target))
+        continue;
+      uint32_t callee = nodeFunctions_[target];
+      std::string calleeId = "callee_" + std::to_string(callee);
+      if (std::find(callees.begin(), callees.end(), callee) == callees.end()) {
+        callees.push_back(callee);
+        calls += "  ";
+        appendQuoted(calls, calleeId);
+        calls += " [label=\"";
+        appendDotEscaped(calls, functionNames_[callee]);
+        calls += "()\", URL=\"" + shardNames[callee] +
+                 ".svg\", shape=box, style=\"rounded,dashed\", "
+                 "color=\"#cc3366\", fontname=\"Arial\"];\n";
+      }
+      calls += "  ";
+      appendQuoted(calls, nodeId(node));
+      calls += " -> ";
+      appendQuoted(calls, calleeId);
+      calls += " [label=\"call #" + std::to_string(callOrders_[edge]) +
+               "\", fontsize=9, fontcolor=\"#cc3366\"];\n";
+    }
+  }
+  if (!calls.empty()) {
+    out += "\n  // ========== FUNCTION CALL EDGES ==========\n";
+    out += callEdgeStyle;
+    out += calls;
+  }
+  out += "}\n";
+}
+
+// leaves file as it is if it holds text already
+static bool writeIfChanged(const std::string &file, const std::string &text) {
+  auto old = MemoryBuffer::getFile(file);
+  if (old && (*old)->getBuffer() == text)
+    return true;
+  std::ofstream out(file, std::ios::binary);
+  out.write(text.data(), text.size());
+  return bool(out);
+}
+
+bool GraphVisualizer::exportShards(const std::string &dir,
+                                   std::vector<std::string> &files) const {
+  files.clear();
+  if (std::error_code error = sys::fs::create_directories(dir)) {
+    std::cerr << "Error: Cannot create directory: " << dir << " ("
+              << error.message() << ")\n";
+    return false;
+  }
+  std::cout << "Exporting shards to: " << dir << "\n";
+
+  // file names from function names, only characters safe in a path and
+  // unique after that
+  std::vector<std::string> shardNames(functionNames_.size());
+  StringSet<> used;
+  used.insert("index");
+  for (uint32_t func = 0; func < functionNames_.size(); func++) {
+    std::string name = functionNames_[func].substr(0, 100);
+    for (char &c : name) {
+      if (!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-' &&
+          c != '.')
+        c = '_';
+    }
+    if (name.empty() || !used.insert(name).second) {
+      name += "." + std::to_string(func);
+      used.insert(name);
+    }
+    shardNames[func] = name;
+  }
+
+  // index: a box per function, the number of calls on the edges between them
+  std::string index = "digraph \"index\" {\n";
+  index += "  rankdir=LR;\n";
+  index += "  node [fontname=\"Arial\", fontsize=10, shape=box, "
+           "style=\"rounded,filled\", fillcolor=\"#f0f8ff\", "
+           "color=\"#3366cc\"];\n";
+  index += callEdgeStyle;
+  std::map<std::pair<uint32_t, uint32_t>, uint32_t> callCounts;
+  for (uint32_t func = 0; func < functionNames_.size(); func++) {
+    if (!slice_.empty() && !sliceFunctions_[func])
+      continue;
+    uint32_t nodes = 0;
+    for (uint32_t node = functionNodes_[func]; node < functionNodes_[func + 1];
+         node++) {
+      if (!inSlice(node))
+        continue;
+      nodes++;
+      for (uint32_t target : callEdges_.of(node)) {
+        if (inSlice(target))
+          callCounts[{func, nodeFunctions_[target]}]++;
+      }
+    }
+    index += "  \"f" + std::to_string(func) + "\" [label=\"";
+    appendDotEscaped(index, functionNames_[func]);
+    index += "()\\n" + std::to_string(nodes) + " nodes\", URL=\"" +
+             shardNames[func] + ".svg\"];\n";
+  }
+  for (const auto &calls : callCounts) {
+    index += "  \"f" + std::to_string(calls.first.first) + "\" -> \"f" +
+             std::to_string(calls.first.second) + "\" [label=\"" +
+             std::to_string(calls.second) + "\"];\n";
+  }
+  index += "}\n";
+  files.push_back(dir + "/index.dot");
+  if (!writeIfChanged(files.back(), index)) {
+    std::cerr << "Error: Cannot write file: " << files.back() << "\n";
+    return false;
+  }
+
+  formatInstructionLabels();
+  std::optional<ThreadPool> pool;
+  if (jobs_ != 1)
+    pool.emplace(hardware_concurrency(jobs_));
+  bool cacheText = textCacheable();
+
+  // shards are rendered and written on the workers, a window at a time like
+  // the sections of exportToDot
+  const uint32_t window = 256;
+  std::vector<std::string> buffers(window);
+  std::vector<char> written(window);
+  for (uint32_t first = 0; first < functionNames_.size(); first += window) {
+    uint32_t count = std::min<uint32_t>(window, functionNames_.size() - first);
+    for (uint32_t i = 0; i < count; i++) {
+      if (!slice_.empty() && !sliceFunctions_[first + i])
+        continue;
+      auto writeOne = [&, i] {
+        buffers[i].clear();
+        renderShard(first + i, shardNames, cacheText, buffers[i]);
+        written[i] = writeIfChanged(
+            dir + "/" + shardNames[first + i] + ".dot", buffers[i]);
+      };
+      if (pool)
+        pool->async(writeOne);
+      else
+        writeOne();
+    }
+    if (pool)
+      pool->wait();
+    for (uint32_t i = 0; i < count; i++) {
+      if (!slice_.empty() && !sliceFunctions_[first + i])
+        continue;
+      files.push_back(dir + "/" + shardNames[first + i] + ".dot");
+      if (!written[i]) {
+        std::cerr << "Error: Cannot write file: " << files.back() << "\n";
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void GraphVisualizer::forEachExportedEdge(
+    function_ref<void(uint32_t, uint32_t, EdgeKind, uint32_t)> visit) const {
+  for (uint32_t node = 0; node < nodeCount(); node++) {
+    if (!inSlice(node))
+      continue;
+    for (uint32_t edge = cfgEdges_.begin(node); edge < cfgEdges_.end(node);
+         edge++) {
+      if (inSlice(cfgEdges_.targets[edge]))
+        visit(node, cfgEdges_.targets[edge], EdgeKind::Cfg, edge);
+    }
+  }
+  for (uint32_t node = 0; node < nodeCount(); node++) {
+    if (!inSlice(node))
+      continue;
+    EdgeKind kind = nodeKinds_[node] == NodeKind::Instruction
+                        ? EdgeKind::DefUse
+                        : EdgeKind::Input;
+    for (uint32_t edge = defUseEdges_.begin(node);
+         edge < defUseEdges_.end(node); edge++) {
+      if (inSlice(defUseEdges_.targets[edge]))
+        visit(node, defUseEdges_.targets[edge], kind, edge);
+    }
+  }
+  for (uint32_t node = 0; node < nodeCount(); node++) {
+    if (!inSlice(node))
+      continue;
+    for (uint32_t edge = callEdges_.begin(node); edge < callEdges_.end(node);
+         edge++) {
+      if (inSlice(callEdges_.targets[edge]))
+        visit(node, callEdges_.targets[edge], EdgeKind::Call, edge);
+    }
+  }
+}
+
+bool GraphVisualizer::blockCount(uint32_t node, uint64_t &count) const {
+  if (!executionCountsLoaded_ || nodeBlocks_[node] == NoIndex ||
+      !blockCounted_[nodeBlocks_[node]])
+    return false;
+  count = blockExecCounts_[nodeBlocks_[node]];
+  return true;
+}
+
+// like the heat map of renderCfgEdges: edges between blocks have their own
+// counter, the ones inside a block run as often as the block
+bool GraphVisualizer::cfgEdgeCount(uint32_t node, uint32_t edge,
+                                   uint64_t &count) const {
+  if (!executionCountsLoaded_)
+    return false;
+  if (isTerminatorNode(node)) {
+    if (!cfgEdgeCounted_[edge])
+      return false;
+    count = cfgEdgeCounts_[edge];
+    return true;
+  }
+  return blockCount(node, count);
+}
+
+std::vector<uint32_t> GraphVisualizer::exportPositions() const {
+  std::vector<uint32_t> positions(nodeCount(), NoIndex);
+  uint32_t position = 0;
+  for (uint32_t node = 0; node < nodeCount(); node++) {
+    if (inSlice(node))
+      positions[node] = position++;
+  }
+  return positions;
+}
+
+static const char *const nodeKindNames[] = {"argument", "instruction",
+                                            "constant"};
+static const char *const edgeKindNames[] = {"cfg", "def-use", "input", "call"};
+
+// the runtime value of a label without the "VALUE=" in front of it
+static StringRef valueText(StringRef runtimeText) {
+  runtimeText.consume_front("VALUE=");
+  return runtimeText;
+}
+
+// json::Value only takes UTF-8, IR text and recorded values are ASCII but a
+// string constant may be anything
+static json::Value jsonText(StringRef text) {
+  if (json::isUTF8(text))
+    return text;
+  return json::fixUTF8(text);
+}
+
+bool GraphVisualizer::exportToJson(const std::string &filename) const {
+  std::error_code error;
+  raw_fd_ostream file(filename, error);
+  if (error) {
+    std::cerr << "Error: Cannot open file: " << filename << "\n";
+    return false;
+  }
+  std::cout << "Exporting to JSON: " << filename << "\n";
+
+  // a column per attribute, what a reader turns into arrays or a table
+  // without an object per node
+  formatInstructionLabels();
+  std::vector<uint32_t> positions = exportPositions();
+  json::OStream json(file);
+  auto nodeColumn = [&](StringRef name, function_ref<void(uint32_t)> value) {
+    json.attributeArray(name, [&] {
+      for (uint32_t node = 0; node < nodeCount(); node++) {
+        if (inSlice(node))
+          value(node);
+      }
+    });
+  };
+  using EdgeVisitor = function_ref<void(uint32_t, uint32_t, EdgeKind, uint32_t)>;
+  auto edgeColumn = [&](StringRef name, EdgeVisitor value) {
+    json.attributeArray(name, [&] { forEachExportedEdge(value); });
+  };
+  // null in the column of an instruction attribute for the other nodes
+  auto instruction = [&](uint32_t node) {
+    if (nodeKinds_[node] == NodeKind::Instruction)
+      return true;
+    json.value(nullptr);
+    return false;
+  };
+
+  json.object([&] {
+    json.attribute("graph", "CombinedCFGDefUse");
+    json.attributeObject("nodes", [&] {
+      nodeColumn("id", [&](uint32_t node) { json.value(nodeId(node)); });
+      nodeColumn("kind", [&](uint32_t node) {
+        json.value(nodeKindNames[uint8_t(nodeKinds_[node])]);
+      });
+      nodeColumn("opcode", [&](uint32_t node) {
+        if (instruction(node))
+          json.value(opcodeName(node));
+      });
+      nodeColumn("function", [&](uint32_t node) {
+        json.value(jsonText(functionNames_[nodeFunctions_[node]]));
+      });
+      nodeColumn("block", [&](uint32_t node) {
+        if (instruction(node))
+          json.value(nodeBlocks_[node] -
+                     functionBlocks_[nodeFunctions_[node]]);
+      });
+      nodeColumn("label", [&](uint32_t node) {
+        json.value(jsonText(staticLabel(node).trim(" \n")));
+      });
+      if (runtimeValuesLoaded_) {
+        nodeColumn("value", [&](uint32_t node) {
+          if (runtimeTexts_[node].empty())
+            json.value(nullptr);
+          else
+            json.value(jsonText(valueText(runtimeTexts_[node])));
+        });
+        nodeColumn("sampled",
+                   [&](uint32_t node) { json.value(bool(sampled_[node])); });
+      }
+      if (executionCountsLoaded_) {
+        nodeColumn("count", [&](uint32_t node) {
+          uint64_t count;
+          if (blockCount(node, count))
+            json.value(int64_t(count));
+          else
+            json.value(nullptr);
+        });
+      }
+    });
+    json.attributeObject("edges", [&] {
+      edgeColumn("source", [&](uint32_t from, uint32_t, EdgeKind, uint32_t) {
+        json.value(positions[from]);
+      });
+      edgeColumn("target", [&](uint32_t, uint32_t to, EdgeKind, uint32_t) {
+        json.value(positions[to]);
+      });
+      edgeColumn("kind", [&](uint32_t, uint32_t, EdgeKind kind, uint32_t) {
+        json.value(edgeKindNames[uint8_t(kind)]);
+      });
+      edgeColumn("order",
+                 [&](uint32_t, uint32_t, EdgeKind kind, uint32_t edge) {
+                   if (kind == EdgeKind::Call)
+                     json.value(callOrders_[edge]);
+                   else
+                     json.value(nullptr);
+                 });
+      if (executionCountsLoaded_) {
+        edgeColumn("count",
+                   [&](uint32_t from, uint32_t, EdgeKind kind, uint32_t edge) {
+                     uint64_t count;
+                     if (kind == EdgeKind::Cfg &&
+                         cfgEdgeCount(from, edge, count))
+                       json.value(int64_t(count));
+                     else
+                       json.value(nullptr);
+                   });
+      }
+    });
+  });
+  file << "\n";
+  file.close();
+  if (file.has_error()) {
+    std::cerr << "Error: Cannot write file: " << filename << "\n";
+    file.clear_error();
+    return false;
+  }
+  return true;
+}
+
+// text escaped for XML. Control characters XML 1.0 can't hold become '?'.
+static void writeXmlEscaped(raw_ostream &out, StringRef text) {
+  size_t clean = 0;
+  for (size_t i = 0; i < text.size(); i++) {
+    char c = text[i];
+    const char *entity = c == '&'   ? "&amp;"
+                         : c == '<' ? "&lt;"
+                         : c == '>' ? "&gt;"
+                         : c == '"' ? "&quot;"
+                         : (unsigned char)c < 0x20 && c != '\t' &&
+                                 c != '\n' && c != '\r'
+                             ? "?"
+                             : nullptr;
+    if (!entity)
+      continue;
+    out << text.slice(clean, i) << entity;
+    clean = i + 1;
+  }
+  out << text.substr(clean);
+}
+
+bool GraphVisualizer::exportToGraphML(const std::string &filename) const {
+  std::error_code error;
+  raw_fd_ostream out(filename, error);
+  if (error) {
+    std::cerr << "Error: Cannot open file: " << filename << "\n";
+    return false;
+  }
+  std::cout << "Exporting to GraphML: " << filename << "\n";
+
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+  out << "<graphml xmlns=\"http://graphml.graphdrawing.org/xmlns\">\n";
+  const char *const keys[][4] = {
+      {"id", "node", "id", "string"},
+      {"kind", "node", "kind", "string"},
+      {"opcode", "node", "opcode", "string"},
+      {"function", "node", "function", "string"},
+      {"block", "node", "block", "int"},
+      {"label", "node", "label", "string"},
+      {"value", "node", "value", "string"},
+      {"sampled", "node", "sampled", "boolean"},
+      {"count", "node", "count", "long"},
+      {"edge_kind", "edge", "kind", "string"},
+      {"order", "edge", "order", "int"},
+      {"edge_count", "edge", "count", "long"}};
+  for (const auto &key : keys) {
+    out << "  <key id=\"" << key[0] << "\" for=\"" << key[1]
+        << "\" attr.name=\"" << key[2] << "\" attr.type=\"" << key[3]
+        << "\"/>\n";
+  }
+  out << "  <graph id=\"CombinedCFGDefUse\" edgedefault=\"directed\">\n";
+
+  formatInstructionLabels();
+  std::vector<uint32_t> positions = exportPositions();
+  // UTF-8 like JSON, a string constant may be anything
+  auto data = [&](const char *key, StringRef text) {
+    out << "<data key=\"" << key << "\">";
+    if (json::isUTF8(text))
+      writeXmlEscaped(out, text);
+    else
+      writeXmlEscaped(out, json::fixUTF8(text));
+    out << "</data>";
+  };
+  for (uint32_t node = 0; node < nodeCount(); node++) {
+    if (!inSlice(node))
+      continue;
+    uint32_t func = nodeFunctions_[node];
+    out << "    <node id=\"n" << positions[node] << "\">";
+    data("id", nodeId(node));
+    data("kind", nodeKindNames[uint8_t(nodeKinds_[node])]);
+    if (nodeKinds_[node] == NodeKind::Instruction) {
+      data("opcode", opcodeName(node));
+      out << "<data key=\"block\">"
+          << nodeBlocks_[node] - functionBlocks_[func] << "</data>";
+    }
+    data("function", functionNames_[func]);
+    data("label", staticLabel(node).trim(" \n"));
+    if (!runtimeTexts_[node].empty())
+      data("value", valueText(runtimeTexts_[node]));
+    if (sampled_[node])
+      out << "<data key=\"sampled\">true</data>";
+    uint64_t count;
+    if (blockCount(node, count))
+      out << "<data key=\"count\">" << count << "</data>";
+    out << "</node>\n";
+  }
+  forEachExportedEdge(
+      [&](uint32_t from, uint32_t to, EdgeKind kind, uint32_t edge) {
+        out << "    <edge source=\"n" << positions[from] << "\" target=\"n"
+            << positions[to] << "\"><data key=\"edge_kind\">"
+            << edgeKindNames[uint8_t(kind)] << "</data>";
+        uint64_t count;
+        if (kind == EdgeKind::Call)
+          out << "<data key=\"order\">" << callOrders_[edge] << "</data>";
+        else if (kind == EdgeKind::Cfg && cfgEdgeCount(from, edge, count))
+          out << "<data key=\"edge_count\">" << count << "</data>";
+        out << "</edge>\n";
+      });
+  out << "  </graph>\n";
+  out << "</graphml>\n";
+  out.close();
+  if (out.has_error()) {
+    std::cerr << "Error: Cannot write file: " << filename << "\n";
+    out.clear_error();
+    return false;
+  }
+  return true;
+}
+
+size_t GraphVisualizer::exportedNodeCount() const {
+  if (slice_.empty())
+    return nodeCount();
+  return std::count(slice_.begin(), slice_.end(), true);
+}
+
+std::string GraphVisualizer::escapeForDot(const std::string &text) const {
+  std::string result;
+  appendDotEscaped(result, text);
   return result;
 }
 
@@ -782,30 +2536,81 @@ std::string GraphVisualizer::getInstructionName(Instruction &instr) const {
   return rso.str();
 }
 
+// "VALUE=last" for single-threaded sites, "VALUE=last [T0=a T1=b ...]" for
+// sites hit by several threads, "n=.. last=.. min=.. max=.. distinct=.." for
+// aggregate traces; sampled sites get " (sampled, dropped=N)" appended
 std::string
-GraphVisualizer::getShortInstructionLabel(const GraphNode &node) const {
-  if (!node.value)
-    return "null"; // FIXME[Dkay]: Use std:optional / std::expected / enum
-
-  Instruction *instr = dyn_cast<Instruction>(node.value);
-  if (!instr)
-    return node.label;
+GraphVisualizer::describeRuntimeValue(const RuntimeValue &value) const {
+  std::string result = describeRecordedValue(value);
+  if (value.dropped > 0)
+    result += " (sampled, dropped=" + std::to_string(value.dropped) + ")";
+  return result;
+}
 
-  std::string str;
-  raw_string_ostream rso(str);
+std::string
+GraphVisualizer::describeRecordedValue(const RuntimeValue &value) const {
+  if (value.value.empty())
+    return "VALUE=?";
+
+  // runs over several inputs: which inputs gave which value
+  if (!value.byInput.empty()) {
+    const size_t maxValues = 6;
+    const size_t maxInputs = 3;
+    std::string result;
+    if (value.aggregated) {
+      result = "n=" + std::to_string(value.count) + " min=" + value.min +
+               " max=" + value.max + " ";
+    }
+    result += "BY INPUT {";
+    for (size_t i = 0; i < value.byInput.size() && i < maxValues; i++) {
+      const RuntimeValue::InputValues &seen = value.byInput[i];
+      if (i > 0)
+        result += " | ";
+      result += seen.value + ": ";
+      for (size_t j = 0; j < seen.inputs.size() && j < maxInputs; j++)
+        result += (j > 0 ? "," : "") + seen.inputs[j];
+      if (seen.inputs.size() > maxInputs)
+        result += ",+" + std::to_string(seen.inputs.size() - maxInputs);
+    }
+    if (value.byInput.size() > maxValues)
+      result += " | +" + std::to_string(value.byInput.size() - maxValues) +
+                " values";
+    return result + "}";
+  }
 
-  instr->print(rso);
+  if (value.aggregated) {
+    std::string result = "n=" + std::to_string(value.count) +
+                         " last=" + value.value + " min=" + value.min +
+                         " max=" + value.max + " distinct";
+    if (value.distinctOverflow)
+      return result + ">" + std::to_string(DEFUSE_DISTINCT_SLOTS);
+
+    result += "={";
+    for (size_t i = 0; i < value.distinct.size(); i++) {
+      if (i > 0)
+        result += ",";
+      result += value.distinct[i];
+    }
+    return result + "}";
+  }
 
-  if (!node.runtimeValue.empty()) {
+  if (value.perThread.empty())
+    return "VALUE=" + value.value;
 
-    std::string cleanLabel = rso.str();
-    if (!cleanLabel.empty() && cleanLabel.back() == '\n') {
-      cleanLabel.pop_back();
+  const size_t maxThreads = 4;
+  std::string result = "VALUE=" + value.value + " [";
+  size_t shown = 0;
+  for (const auto &pair : value.perThread) {
+    if (shown == maxThreads) {
+      result += " ...";
+      break;
     }
-    cleanLabel += "    VALUE=" + node.runtimeValue;
-    return cleanLabel;
+    if (shown > 0)
+      result += " ";
+    result += "T" + std::to_string(pair.first) + "=" + pair.second;
+    shown++;
   }
-  return rso.str();
+  return result + "]";
 }
 
 // FIXME[Dkay]: Why printStatistics function does somesing besindes printing
@@ -814,21 +2619,18 @@ void GraphVisualizer::printStatistics() const {
   int instrCount = 0;
   int constCount = 0;
   int argCount = 0;
-  int bbCount = basicBlocks_.size();
-  int cfgEdges = 0;
-  int duEdges = 0;
+  int bbCount = blockBegin_.size();
+  int cfgEdges = cfgEdges_.targets.size();
+  int duEdges = defUseEdges_.targets.size();
   int runtimeCount = runtimeValues_.size();
 
-  for (const auto &pair : nodes_) {
-    if (pair.second.isInstruction)
+  for (NodeKind kind : nodeKinds_) {
+    if (kind == NodeKind::Instruction)
       instrCount++;
-    if (pair.second.isConstant)
+    if (kind == NodeKind::Constant)
       constCount++;
-    if (pair.second.isArgument)
+    if (kind == NodeKind::Argument)
       argCount++;
-
-    cfgEdges += pair.second.cfgSuccessors.size();
-    duEdges += pair.second.defUseSuccessors.size();
   }
 
   // FIXME[Dkay]: Why to call std::cout 9 times, instead of one?
@@ -840,5 +2642,13 @@ void GraphVisualizer::printStatistics() const {
   std::cout << "CFG Edges:         " << cfgEdges << "\n";
   std::cout << "Def-Use Edges:     " << duEdges << "\n";
   std::cout << "Runtime Values:    " << runtimeCount << "\n";
+  if (executionCountsLoaded_) {
+    int executed = 0;
+    for (uint64_t count : blockExecCounts_) {
+      if (count > 0)
+        executed++;
+    }
+    std::cout << "Executed Blocks:   " << executed << " / " << bbCount << "\n";
+  }
   std::cout << "========================\n";
 }
@@ -1,4 +1,8 @@
 #include "../include/Instrumentation.h" // TODO[Dkay]: avoid relative includes
+#include "../include/Reconstruction.h"
+#include "../include/TraceFormat.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
@@ -9,16 +13,45 @@
 #include "llvm/Support/Format.h" // TODO[Dkay]: my LSP says that this header is unused. Pls, setup yours too
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <map>
+#include <set>
 
 using namespace llvm;
 
 // FIXME[Dkay]: I want a detailed explanation why do you need next two lines. I
 // don't see any overloading resolution problems and I don't see any cases you
 // want to explicitly mark ctor and dtor as default for.
-Instrumentation::Instrumentation() = default;
+Instrumentation::Instrumentation(const InstrumentationOptions &options)
+    : options_(options) {}
 Instrumentation::~Instrumentation() = default;
 
+bool InstrumentationOptions::recordsType(const Type *type) const {
+  return (type->isIntegerTy(32) && i32) || (type->isIntegerTy(64) && i64) ||
+         (type->isFloatTy() && floats);
+}
+
 // FIXME[Dkay]: Why does it not take Module?
+
+// the runtime's entry points and what the instrumenter adds: a record
+// inserted into them would call the runtime from inside itself
+static bool isRuntimeFunction(const Function &function) {
+  StringRef name = function.getName();
+  return name == "print_i32_with_id" || name == "print_i64_with_id" ||
+         name == "print_float_with_id" || name == "print_double_with_id" ||
+         name == "defuse_register_sites" ||
+         name == "defuse_register_counters" ||
+         name == "defuse_record_block" || name == "defuse.module_ctor";
+}
+
+// core_runtime.c defines the defuse_runtime marker, e.g. when it is compiled
+// with -fpass-plugin; its helpers would recurse like its entry points
+static bool isRuntimeModule(const Module &module) {
+  const GlobalVariable *marker = module.getNamedGlobal("defuse_runtime");
+  return marker && !marker->isDeclaration();
+}
 bool Instrumentation::instrumentModule(const std::string &inputFile,
                                        const std::string &outputFile) {
   LLVMContext context;
@@ -31,19 +64,7 @@ bool Instrumentation::instrumentModule(const std::string &inputFile,
     return false;
   }
 
-  // FIXME[Dkay]: Why do you want to store this as a field if you clear it?
-  instrumentedValues_.clear();
-
-  // FIXME[DKay]: Why these function exist? They are way too single-purposed.
-  getOrDeclarePrintI32WithId(*module);
-  getOrDeclarePrintI64WithId(*module);
-  getOrDeclarePrintFloatWithId(*module);
-
-  for (auto &function : *module) {
-    if (function.isDeclaration())
-      continue;
-    instrumentFunction(function, *module);
-  }
+  instrumentModule(*module);
 
   std::error_code ec;
   raw_fd_ostream out(outputFile, ec);
@@ -52,66 +73,151 @@ bool Instrumentation::instrumentModule(const std::string &inputFile,
     return false;
   }
 
-  module->print(out, nullptr);
+  if (StringRef(outputFile).endswith(".bc"))
+    WriteBitcodeToFile(*module, out);
+  else
+    module->print(out, nullptr);
+  if (!manifest_.empty() && !manifest_.write(manifestPathFor(outputFile)))
+    return false;
   return true;
 }
 
+void Instrumentation::instrumentModule(Module &module) {
+  // FIXME[Dkay]: Why do you want to store this as a field if you clear it?
+  instrumentedValues_.clear();
+  manifest_.clear();
+  siteTags_.clear();
+  siteBase_ = nullptr;
+  blockRecords_.clear();
+  counterNames_.clear();
+  counters_ = nullptr;
+  if (isRuntimeModule(module)) {
+    errs() << "warn: " << module.getModuleIdentifier()
+           << " is the defuse runtime, not instrumented\n";
+    return;
+  }
+
+  // before anything is inserted, constants are recorded in main
+  positions_.clear();
+  for (auto &function : module) {
+    uint32_t blockIndex = 0;
+    for (auto &block : function) {
+      uint32_t instrIndex = 0;
+      for (auto &instr : block)
+        positions_[&instr] = {blockIndex, instrIndex++};
+      blockIndex++;
+    }
+  }
+
+  if (options_.values) {
+    // FIXME[DKay]: Why these function exist? They are way too single-purposed.
+    getOrDeclarePrintI32WithId(module);
+    getOrDeclarePrintI64WithId(module);
+    getOrDeclarePrintFloatWithId(module);
+
+    for (auto &function : module) {
+      if (function.isDeclaration() || isRuntimeFunction(function))
+        continue;
+      instrumentFunction(function, module);
+    }
+  }
+
+  if (options_.counters)
+    instrumentCounters(module);
+
+  emitModuleCtor(module);
+}
+
 void Instrumentation::instrumentFunction(Function &function, Module &module) {
   std::string funcName = function.getName().str();
 
+  // snapshot first: print calls are inserted into the blocks we walk, and
+  // their site id operands must not be instrumented themselves
+  std::vector<Instruction *> instrs;
+  for (auto &block : function) {
+    for (auto &instr : block) {
+      instrs.push_back(&instr);
+    }
+  }
+
+  // planned before any print call goes in, the analyzer plans on the
+  // original IR
+  ReconstructionPlan plan(function);
+
   // instrument function arguments
   for (auto &arg : function.args()) {
-    instrumentValue(&arg, module, funcName,
-                    "arg"); // FIXME[Dkay] Why do you use string as ardtype?
-                            // Make it enum, please. Это же базовые навыки
-                            // которым я учил вас на курсе, ну Даня блин(
+    instrumentValue(&arg, module, funcName);
   }
 
   // instrument all instructions
-  for (auto &block : function) {
-    for (auto &instr : block) {
-      // skip phi nodes, because it's a pain in the ass
-      // FIXME[Dkay] Why not to insert yopur pass before phi nodes start to
-      // exist?
-      if (isa<PHINode>(&instr)) {
+  for (Instruction *instrPtr : instrs) {
+    Instruction &instr = *instrPtr;
+    // skip phi nodes, because it's a pain in the ass
+    // FIXME[Dkay] Why not to insert yopur pass before phi nodes start to
+    // exist?
+    if (auto *phi = dyn_cast<PHINode>(&instr)) {
+      if (!options_.minimal || !plan.needsRecord(phi))
         continue;
-      }
+    }
+    // the analyzer recomputes it from the values it depends on
+    if (options_.minimal && plan.isReconstructible(&instr)) {
+      continue;
+    }
 
-      // instrument the instruction itself
-      instrumentValue(&instr, module, funcName, "instr");
+    // instrument the instruction itself
+    instrumentValue(&instr, module, funcName);
 
-      // instrument all operands
-      for (unsigned i = 0; i < instr.getNumOperands(); i++) {
-        Value *operand = instr.getOperand(i);
+    // instrument all operands
+    for (unsigned i = 0; i < instr.getNumOperands(); i++) {
+      Value *operand = instr.getOperand(i);
 
-        // skip basic blocks and metadata
-        if (isa<BasicBlock>(operand) || isa<MetadataAsValue>(operand)) {
-          continue;
-        }
+      // skip basic blocks and metadata
+      if (isa<BasicBlock>(operand) || isa<MetadataAsValue>(operand)) {
+        continue;
+      }
 
-        if (isa<ConstantInt>(operand) || isa<ConstantFP>(operand)) {
-          instrumentValue(operand, module, funcName, "const");
-        }
+      // minimal mode: the analyzer reads constants from the IR
+      if ((isa<ConstantInt>(operand) || isa<ConstantFP>(operand)) &&
+          !options_.minimal) {
+        instrumentValue(operand, module, funcName);
       }
     }
   }
+
+  if (options_.minimal) {
+    for (const auto &liveIn : plan.liveIns())
+      instrumentLiveIn(liveIn, module, funcName);
+  }
+
+  if (options_.batched)
+    flushBlockRecords(function, module);
+}
+
+void Instrumentation::instrumentLiveIn(const ReconstructionPlan::LiveIn &liveIn,
+                                       Module &module,
+                                       const std::string &funcName) {
+  instrumentValue(liveIn.value, module, funcName, int(liveIn.segment),
+                  liveIn.insertBefore);
 }
 
-void Instrumentation::instrumentValue(
-    Value *value, Module &module, const std::string &funcName,
-    const std::string &valueType) { // FIXME[Dkay]: my LSP says that this param
-                                    // is unused. Pls, setup yours too
+void Instrumentation::instrumentValue(Value *value, Module &module,
+                                      const std::string &funcName,
+                                      int segment, Instruction *insertPoint) {
   if (!value) // FIXME[Dkay]: Why method can revieve an null pointer? Why it is
               // not privat and class invariants are not saving it from null
               // values?
     return;
 
   Type *type = value->getType();
-  if (!type->isIntegerTy(32) && !type->isIntegerTy(64) && !type->isFloatTy()) {
+  if (!isRecordableType(type) || !options_.recordsType(type)) {
     return;
   }
 
-  std::string valueId = getValueId(value, funcName);
+  SitePosition position = positionOf(value, funcName);
+  position.segment = segment;
+  std::string valueId = getValueId(value, position);
+  if (segment >= 0)
+    valueId = ReconstructionPlan::liveInKey(valueId, unsigned(segment));
 
   // check if already instrumented
   if (instrumentedValues_.count(valueId)) {
@@ -147,20 +253,117 @@ void Instrumentation::instrumentValue(
     valueName = "val";
   }
 
+  instrumentedValues_.insert(valueId);
+
+  PendingRecord record = {value, valueId, valueName, insertPoint, position};
+  if (!options_.batched || isa<Constant>(value)) {
+    emitPrintCall(module, record);
+    return;
+  }
+  // recorded together with the rest of its block, see flushBlockRecords
+  if (!record.insertPoint)
+    record.insertPoint = recordInsertPoint(module, value);
+  if (record.insertPoint)
+    blockRecords_[record.insertPoint->getParent()].push_back(record);
+}
+
+static unsigned char siteTagFor(const Type *type) {
+  if (type->isIntegerTy(32))
+    return DEFUSE_TAG_I32;
+  if (type->isFloatTy())
+    return DEFUSE_TAG_FLOAT;
+  return DEFUSE_TAG_I64;
+}
+
+void Instrumentation::emitPrintCall(Module &module,
+                                    const PendingRecord &record) {
+  const std::string &valueId = record.valueId;
   Constant *idStr = createGlobalString(module, valueId, "id_" + valueId);
-  Constant *nameStr = createGlobalString(module, valueName, "name_" + valueId);
-
-  if (type->isIntegerTy(32)) {
-    insertPrintCall(module, *getOrDeclarePrintI32WithId(module), value, idStr,
-                    nameStr, funcName);
-  } else if (type->isIntegerTy(64)) {
-    insertPrintCall(module, *getOrDeclarePrintI64WithId(module), value, idStr,
-                    nameStr, funcName);
-  } else if (type->isFloatTy()) {
-    insertPrintCall(module, *getOrDeclarePrintFloatWithId(module), value, idStr,
-                    nameStr, funcName);
+  Constant *nameStr =
+      createGlobalString(module, record.valueName, "name_" + valueId);
+
+  // dense id, used as index into the site table by the binary trace
+  unsigned siteId = manifest_.ids.size();
+  manifest_.ids.push_back(valueId);
+  manifest_.positions.push_back(record.position);
+
+  Type *type = record.value->getType();
+  siteTags_.push_back(siteTagFor(type));
+  Function *printFunc = type->isIntegerTy(32) ? getOrDeclarePrintI32WithId(module)
+                        : type->isFloatTy()   ? getOrDeclarePrintFloatWithId(module)
+                                              : getOrDeclarePrintI64WithId(module);
+  insertPrintCall(module, *printFunc, record.value, idStr, nameStr, siteId,
+                  record.insertPoint);
+}
+
+void Instrumentation::flushBlockRecords(Function &function, Module &module) {
+  // blocks that end the program or leave it through the terminator value
+  // (invoke) would never reach a call before the terminator
+  std::vector<BasicBlock *> batched;
+  size_t slots = 0;
+  for (auto &block : function) {
+    auto it = blockRecords_.find(&block);
+    if (it == blockRecords_.end())
+      continue;
+    const auto &records = it->second;
+    Instruction *terminator = block.getTerminator();
+    bool batchable = records.size() > 1 && !isa<UnreachableInst>(terminator);
+    for (const auto &record : records)
+      batchable = batchable && record.value != terminator;
+    if (!batchable) {
+      for (const auto &record : records)
+        emitPrintCall(module, record);
+      continue;
+    }
+    batched.push_back(&block);
+    slots = std::max(slots, records.size());
   }
-  instrumentedValues_.insert(valueId);
+
+  if (!batched.empty()) {
+    LLVMContext &ctx = module.getContext();
+    Type *i64Type = Type::getInt64Ty(ctx);
+    BasicBlock &entry = function.getEntryBlock();
+    // one buffer for all blocks of the frame, each block hands it over
+    // before leaving
+    ArrayType *bufferType = ArrayType::get(i64Type, slots);
+    IRBuilder<> entryBuilder(&entry, entry.begin());
+    AllocaInst *buffer =
+        entryBuilder.CreateAlloca(bufferType, nullptr, "defuse.block");
+    FunctionCallee recordBlock = module.getOrInsertFunction(
+        "defuse_record_block", Type::getVoidTy(ctx), Type::getInt32Ty(ctx),
+        Type::getInt32Ty(ctx), PointerType::getUnqual(i64Type));
+
+    for (BasicBlock *block : batched) {
+      const auto &records = blockRecords_[block];
+      // consecutive site ids, the runtime finds them by position
+      unsigned firstSite = manifest_.ids.size();
+      for (unsigned slot = 0; slot < records.size(); slot++) {
+        const PendingRecord &record = records[slot];
+        manifest_.ids.push_back(record.valueId);
+        manifest_.positions.push_back(record.position);
+        siteTags_.push_back(siteTagFor(record.value->getType()));
+
+        // same 64-bit payload as the binary trace
+        IRBuilder<> builder(record.insertPoint);
+        Value *payload = record.value;
+        if (payload->getType()->isFloatTy())
+          payload = builder.CreateZExt(
+              builder.CreateBitCast(payload, builder.getInt32Ty()), i64Type);
+        else if (payload->getType()->isIntegerTy(32))
+          payload = builder.CreateSExt(payload, i64Type);
+        builder.CreateStore(payload, builder.CreateConstInBoundsGEP2_32(
+                                         bufferType, buffer, 0, slot));
+      }
+
+      IRBuilder<> builder(block->getTerminator());
+      builder.CreateCall(
+          recordBlock,
+          {runtimeSite(module, builder, firstSite),
+           builder.getInt32(records.size()),
+           builder.CreateConstInBoundsGEP2_32(bufferType, buffer, 0, 0)});
+    }
+  }
+  blockRecords_.clear();
 }
 
 Constant *Instrumentation::createGlobalString(Module &module,
@@ -183,8 +386,27 @@ Constant *Instrumentation::createGlobalString(Module &module,
                                         indices);
 }
 
-std::string Instrumentation::getValueId(Value *value,
-                                        const std::string &funcName) {
+SitePosition Instrumentation::positionOf(Value *value,
+                                         const std::string &funcName) const {
+  SitePosition at;
+  at.function = funcName;
+  if (auto *arg = dyn_cast<Argument>(value)) {
+    at.kind = SitePosition::Argument;
+    at.index = arg->getArgNo();
+  } else if (auto *instr = dyn_cast<Instruction>(value)) {
+    auto it = positions_.find(instr);
+    if (it != positions_.end()) {
+      at.block = it->second.first;
+      at.index = it->second.second;
+    }
+  } else {
+    at.kind = SitePosition::Constant;
+  }
+  return at;
+}
+
+std::string Instrumentation::getValueId(Value *value, const SitePosition &at) {
+  const std::string &funcName = at.function;
 
   if (!value) // FIXME[DKay]: This should never be true since this is a method
               // protected by class' invariants
@@ -194,39 +416,66 @@ std::string Instrumentation::getValueId(Value *value,
     if (instr->hasName()) {
       return funcName + "_%" + instr->getName().str();
     }
-    // unnamed: use opcode as key
-    return funcName + "::" + std::string(instr->getOpcodeName());
+    // unnamed: opcode and position, two adds must not share a site
+    return positionalSiteId(at, instr->getOpcodeName());
   }
 
   if (Argument *arg = dyn_cast<Argument>(value)) {
     if (arg->hasName()) {
       return funcName + "_%" + arg->getName().str();
     }
-    return funcName + "::arg";
+    return positionalSiteId(at, "arg");
   }
 
   if (ConstantInt *ci = dyn_cast<ConstantInt>(value)) {
     return funcName + "::const_" + std::to_string(ci->getSExtValue());
   }
   if (ConstantFP *cf = dyn_cast<ConstantFP>(value)) {
-    std::string s;
-    raw_string_ostream rso(s);
-    cf->getValueAPF().print(rso);
-    return funcName + "::constfp_" + rso.str();
+    // print() would end the id with a newline
+    SmallString<16> str;
+    cf->getValueAPF().toString(str);
+    return funcName + "::constfp_" + str.str().str();
   }
 
   // not recognized, need to fuck yourself
   return funcName + "::val";
 }
 
-void Instrumentation::insertPrintCall(
-    Module &module, Function &printFunc, Value *value, Constant *idStr,
-    Constant *nameStr,
-    const std::string &funcName) { // FIXME[Dkay]: my LSP says that this param
-                                   // is unused. Pls, setup yours too
+void Instrumentation::insertPrintCall(Module &module, Function &printFunc,
+                                      Value *value, Constant *idStr,
+                                      Constant *nameStr, unsigned siteId,
+                                      Instruction *insertPoint) {
+  // the caller may have picked the place, e.g. the start of a block segment
+  if (!insertPoint)
+    insertPoint = recordInsertPoint(module, value);
+
+  if (insertPoint) {
+    IRBuilder<> builder(insertPoint);
+    builder.CreateCall(&printFunc, {value, idStr, nameStr,
+                                    runtimeSite(module, builder, siteId)});
+  }
+}
+
+Value *Instrumentation::runtimeSite(Module &module, IRBuilderBase &builder,
+                                    unsigned site) {
+  if (!siteBase_) {
+    siteBase_ = new GlobalVariable(module, builder.getInt32Ty(), false,
+                                   GlobalValue::InternalLinkage,
+                                   builder.getInt32(0), "defuse.site_base");
+  }
+  Value *base = builder.CreateLoad(builder.getInt32Ty(), siteBase_);
+  return builder.CreateAdd(base, builder.getInt32(site));
+}
+
+Instruction *Instrumentation::recordInsertPoint(Module &module, Value *value) {
   Instruction *insertPoint = nullptr;
 
-  if (Instruction *instr = dyn_cast<Instruction>(value)) {
+  if (auto *phi = dyn_cast<PHINode>(value)) {
+    // after all phis of the block
+    BasicBlock *block = phi->getParent();
+    if (block->getFirstInsertionPt() != block->end())
+      insertPoint = &*block->getFirstInsertionPt();
+  } else if (Instruction *instr = dyn_cast<Instruction>(value)) {
     // insert right after the instruction
     BasicBlock::iterator it(instr);
     ++it;
@@ -246,11 +495,203 @@ void Instrumentation::insertPrintCall(
       insertPoint = &*mainFunc->getEntryBlock().getFirstInsertionPt();
     }
   }
+  return insertPoint;
+}
 
-  if (insertPoint) {
+void Instrumentation::emitModuleCtor(Module &module) {
+  if (manifest_.empty() && counterNames_.empty())
+    return;
+
+  LLVMContext &ctx = module.getContext();
+  Function *ctor =
+      Function::Create(FunctionType::get(Type::getVoidTy(ctx), false),
+                       GlobalValue::InternalLinkage, "defuse.module_ctor",
+                       module);
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", ctor);
+  emitSiteTable(module, *entry);
+  emitCounterTable(module, *entry);
+  IRBuilder<>(entry).CreateRetVoid();
+
+  appendToGlobalCtors(module, ctor, 0);
+}
+
+void Instrumentation::emitSiteTable(Module &module, BasicBlock &ctorEntry) {
+  if (manifest_.empty())
+    return;
+
+  LLVMContext &ctx = module.getContext();
+  Type *i8PtrType = Type::getInt8PtrTy(ctx);
+
+  // createGlobalString reuses the id_ strings the print calls already use
+  std::vector<Constant *> ids;
+  for (const auto &valueId : manifest_.ids) {
+    ids.push_back(createGlobalString(module, valueId, "id_" + valueId));
+  }
+
+  ArrayType *idsType = ArrayType::get(i8PtrType, ids.size());
+  auto *idsTable = new GlobalVariable(module, idsType, true,
+                                      GlobalValue::PrivateLinkage,
+                                      ConstantArray::get(idsType, ids),
+                                      "defuse.site_ids");
+
+  Constant *tagsInit =
+      ConstantDataArray::get(ctx, ArrayRef<uint8_t>(siteTags_));
+  auto *tagsTable = new GlobalVariable(module, tagsInit->getType(), true,
+                                       GlobalValue::PrivateLinkage, tagsInit,
+                                       "defuse.site_tags");
+
+  // returns the base of the module's sites among those of all modules
+  FunctionCallee registerFunc = module.getOrInsertFunction(
+      "defuse_register_sites", Type::getInt32Ty(ctx),
+      PointerType::getUnqual(i8PtrType), i8PtrType, Type::getInt32Ty(ctx));
+
+  IRBuilder<> builder(&ctorEntry);
+  Value *base = builder.CreateCall(
+      registerFunc,
+      {builder.CreateConstInBoundsGEP2_32(idsType, idsTable, 0, 0),
+       builder.CreateConstInBoundsGEP2_32(tagsInit->getType(), tagsTable, 0,
+                                          0),
+       builder.getInt32(ids.size())});
+  if (siteBase_)
+    builder.CreateStore(base, siteBase_);
+}
+
+void Instrumentation::instrumentCounters(Module &module) {
+  // where the increment of one counter goes: the start of block or, for
+  // edges, the end of pred, the start of succ, or a block split into the
+  // edge, decided on the CFG before anything is split
+  struct CounterSite {
+    BasicBlock *block = nullptr;
+    BasicBlock *succ = nullptr;
+    enum { BlockStart, PredEnd, SuccStart, SplitEdge } where = BlockStart;
+  };
+  std::vector<CounterSite> sites;
+
+  for (auto &function : module) {
+    if (function.isDeclaration() || isRuntimeFunction(function))
+      continue;
+    std::string funcName = function.getName().str();
+
+    std::map<BasicBlock *, unsigned> blockIndex;
+    for (auto &block : function)
+      blockIndex.emplace(&block, blockIndex.size());
+
+    for (auto &block : function) {
+      std::string blockName = funcName + ":" +
+                              std::to_string(blockIndex[&block]);
+      // catchswitch blocks have no place for an increment
+      if (block.getFirstInsertionPt() != block.end()) {
+        counterNames_.push_back(blockName);
+        sites.push_back({&block, nullptr, CounterSite::BlockStart});
+      }
+
+      Instruction *terminator = block.getTerminator();
+      if (!terminator)
+        continue;
+      std::set<BasicBlock *> seen;
+      for (BasicBlock *succ : successors(&block)) {
+        if (!seen.insert(succ).second)
+          continue;
+
+        CounterSite site = {&block, succ, CounterSite::PredEnd};
+        if (terminator->getNumSuccessors() == 1) {
+          site.where = CounterSite::PredEnd;
+        } else if (succ->getUniquePredecessor() == &block &&
+                   succ->getFirstInsertionPt() != succ->end()) {
+          site.where = CounterSite::SuccStart;
+        } else if (!isa<IndirectBrInst>(terminator) &&
+                   !isa<CallBrInst>(terminator) && !succ->isEHPad()) {
+          site.where = CounterSite::SplitEdge;
+        } else {
+          continue; // edge can't be split, its count stays unknown
+        }
+        counterNames_.push_back(blockName + "->" +
+                                std::to_string(blockIndex[succ]));
+        sites.push_back(site);
+      }
+    }
+  }
+  if (sites.empty())
+    return;
+
+  LLVMContext &ctx = module.getContext();
+  ArrayType *countersType =
+      ArrayType::get(Type::getInt64Ty(ctx), counterNames_.size());
+  counters_ = new GlobalVariable(module, countersType, false,
+                                 GlobalValue::InternalLinkage,
+                                 ConstantAggregateZero::get(countersType),
+                                 "defuse.counters");
+
+  for (size_t i = 0; i < sites.size(); i++) {
+    const CounterSite &site = sites[i];
+    Instruction *insertPoint = nullptr;
+    switch (site.where) {
+    case CounterSite::BlockStart:
+      insertPoint = &*site.block->getFirstInsertionPt();
+      break;
+    case CounterSite::PredEnd:
+      insertPoint = site.block->getTerminator();
+      break;
+    case CounterSite::SuccStart:
+      insertPoint = &*site.succ->getFirstInsertionPt();
+      break;
+    case CounterSite::SplitEdge: {
+      Instruction *terminator = site.block->getTerminator();
+      unsigned succIndex = 0;
+      while (terminator->getSuccessor(succIndex) != site.succ)
+        succIndex++;
+      // duplicate edges (switch cases with one target) all go to the new
+      // block, the transfer is counted once
+      BasicBlock *edgeBlock = SplitCriticalEdge(
+          terminator, succIndex,
+          CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+      if (!edgeBlock)
+        continue;
+      insertPoint = edgeBlock->getTerminator();
+      break;
+    }
+    }
+
+    // counters are shared by all threads of the program
     IRBuilder<> builder(insertPoint);
-    builder.CreateCall(&printFunc, {value, idStr, nameStr});
+    builder.CreateAtomicRMW(
+        AtomicRMWInst::Add,
+        builder.CreateConstInBoundsGEP2_32(countersType, counters_, 0, i),
+        builder.getInt64(1), MaybeAlign(8), AtomicOrdering::Monotonic);
+  }
+}
+
+void Instrumentation::emitCounterTable(Module &module, BasicBlock &ctorEntry) {
+  if (!counters_)
+    return;
+
+  LLVMContext &ctx = module.getContext();
+  Type *i8PtrType = Type::getInt8PtrTy(ctx);
+
+  std::vector<Constant *> names;
+  for (size_t i = 0; i < counterNames_.size(); i++) {
+    names.push_back(createGlobalString(module, counterNames_[i],
+                                       "counter_" + std::to_string(i)));
   }
+
+  ArrayType *namesType = ArrayType::get(i8PtrType, names.size());
+  auto *namesTable = new GlobalVariable(module, namesType, true,
+                                        GlobalValue::PrivateLinkage,
+                                        ConstantArray::get(namesType, names),
+                                        "defuse.counter_names");
+
+  FunctionCallee registerFunc = module.getOrInsertFunction(
+      "defuse_register_counters", Type::getVoidTy(ctx),
+      Type::getInt64PtrTy(ctx), PointerType::getUnqual(i8PtrType),
+      Type::getInt32Ty(ctx));
+
+  IRBuilder<> builder(&ctorEntry);
+  builder.CreateCall(
+      registerFunc,
+      {builder.CreateConstInBoundsGEP2_32(counters_->getValueType(), counters_,
+                                          0, 0),
+       builder.CreateConstInBoundsGEP2_32(namesType, namesTable, 0, 0),
+       builder.getInt32(names.size())});
 }
 
 // FIXME[Dkay]: Function is a way too specialized.
@@ -288,6 +729,7 @@ Function *Instrumentation::getOrDeclarePrintFunction(Module &module,
   params.push_back(valueType);
   params.push_back(i8PtrType);
   params.push_back(i8PtrType);
+  params.push_back(Type::getInt32Ty(ctx)); // site id
 
   // FIXME[DKay]: Why not to use in-place creation of a vector
   // like this:
@@ -0,0 +1,235 @@
+#include "../include/JitRunner.h"
+#include "../include/TraceFormat.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+using namespace llvm;
+
+// host side of the runtime; one JIT run at a time
+static JitRunner *activeRunner;
+static std::mutex recordLock;
+static std::atomic<unsigned> nextThread;
+static thread_local int threadIndex = -1;
+
+static void hostRecord(unsigned site, uint16_t tag, uint64_t payload) {
+  // threads the program left running after main returned
+  if (JitRunner *runner = activeRunner)
+    runner->record(site, tag, payload);
+}
+
+static std::jmp_buf exitJump;
+static std::thread::id runThread;
+static int exitStatus;
+
+static void hostPrintI32(int value, const char *, const char *,
+                         unsigned site) {
+  hostRecord(site, DEFUSE_TAG_I32,
+             static_cast<uint64_t>(static_cast<int64_t>(value)));
+}
+
+static void hostPrintI64(long long value, const char *, const char *,
+                         unsigned site) {
+  hostRecord(site, DEFUSE_TAG_I64, static_cast<uint64_t>(value));
+}
+
+static void hostPrintFloat(float value, const char *, const char *,
+                           unsigned site) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  hostRecord(site, DEFUSE_TAG_FLOAT, bits);
+}
+
+static void hostPrintDouble(double value, const char *, const char *,
+                            unsigned site) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  hostRecord(site, DEFUSE_TAG_DOUBLE, bits);
+}
+
+// site tags come from the registered table, like in the runtime
+static std::vector<unsigned char> hostSiteTags;
+
+static void hostRecordBlock(unsigned firstSite, unsigned count,
+                            const uint64_t *values) {
+  for (unsigned i = 0; i < count; i++) {
+    unsigned site = firstSite + i;
+    uint16_t tag = DEFUSE_TAG_I64;
+    if (site < hostSiteTags.size())
+      tag = hostSiteTags[site];
+    hostRecord(site, tag, values[i]);
+  }
+}
+
+// the JIT runs one module, its sites start at 0
+static unsigned hostRegisterSites(const char *const *ids,
+                                  const unsigned char *tags, unsigned count) {
+  hostSiteTags.assign(tags, tags + count);
+  activeRunner->registerSites(ids, tags, count);
+  return 0;
+}
+
+static void hostRegisterCounters(const uint64_t *counters,
+                                 const char *const *names, unsigned count) {
+  activeRunner->registerCounters(counters, names, count);
+}
+
+// exit() of the program returns from run(); from other threads there is no
+// way back, the process ends as it would without the JIT
+[[noreturn]] static void hostExit(int status) {
+  if (std::this_thread::get_id() == runThread) {
+    exitStatus = status;
+    std::longjmp(exitJump, 1);
+  }
+  std::exit(status);
+}
+
+void JitRunner::registerSites(const char *const *ids,
+                              const unsigned char *tags, unsigned count) {
+  std::lock_guard<std::mutex> lock(recordLock);
+  decoder_.setSites(ids, tags, count);
+  sitesSeen_ = true;
+}
+
+void JitRunner::registerCounters(const uint64_t *counters,
+                                 const char *const *names, unsigned count) {
+  std::lock_guard<std::mutex> lock(recordLock);
+  counterTables_.push_back({counters, names, count});
+}
+
+void JitRunner::record(unsigned site, uint16_t tag, uint64_t payload) {
+  if (threadIndex < 0)
+    threadIndex = nextThread++;
+  DefuseTraceRecord record;
+  record.site = site;
+  record.tag = tag;
+  record.thread = static_cast<uint16_t>(threadIndex);
+  record.payload = payload;
+
+  std::lock_guard<std::mutex> lock(recordLock);
+  if (sitesSeen_)
+    decoder_.addRecord(record);
+}
+
+static bool report(Error err) {
+  if (!err)
+    return true;
+  std::cerr << "error: jit: " << toString(std::move(err)) << "\n";
+  return false;
+}
+
+bool JitRunner::run(orc::ThreadSafeModule module) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  auto jit = orc::LLJITBuilder().create();
+  if (!jit)
+    return report(jit.takeError());
+  orc::JITDylib &dylib = (*jit)->getMainJITDylib();
+
+  // runtime entry points first, everything else (libc, pthreads) from the
+  // analyzer process
+  orc::SymbolMap runtime;
+  auto bind = [&](const char *name, void *address) {
+    runtime[(*jit)->mangleAndIntern(name)] =
+        JITEvaluatedSymbol(pointerToJITTargetAddress(address),
+                           JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+  };
+  bind("print_i32_with_id", reinterpret_cast<void *>(&hostPrintI32));
+  bind("print_i64_with_id", reinterpret_cast<void *>(&hostPrintI64));
+  bind("print_float_with_id", reinterpret_cast<void *>(&hostPrintFloat));
+  bind("print_double_with_id", reinterpret_cast<void *>(&hostPrintDouble));
+  bind("defuse_record_block", reinterpret_cast<void *>(&hostRecordBlock));
+  bind("defuse_register_sites", reinterpret_cast<void *>(&hostRegisterSites));
+  bind("defuse_register_counters",
+       reinterpret_cast<void *>(&hostRegisterCounters));
+  bind("exit", reinterpret_cast<void *>(&hostExit));
+  if (!report(dylib.define(orc::absoluteSymbols(std::move(runtime)))))
+    return false;
+
+  auto host = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      (*jit)->getDataLayout().getGlobalPrefix());
+  if (!host)
+    return report(host.takeError());
+  dylib.addGenerator(std::move(*host));
+
+  if (!report((*jit)->addIRModule(std::move(module))))
+    return false;
+  auto mainSymbol = (*jit)->lookup("main");
+  if (!mainSymbol)
+    return report(mainSymbol.takeError());
+  auto *mainFunc = jitTargetAddressToFunction<int (*)(int, char **)>(
+      mainSymbol->getAddress());
+
+  activeRunner = this;
+  nextThread = 0;
+  threadIndex = -1;
+  counterTables_.clear();
+  counts_.clear();
+
+  // like -run, the program's own output doesn't mix with ours
+  std::cout.flush();
+  fflush(stdout);
+  int savedStdout = dup(STDOUT_FILENO);
+  int devNull = open("/dev/null", O_WRONLY);
+  if (devNull >= 0) {
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+  }
+
+  char programName[] = "program";
+  char *argv[] = {programName, nullptr};
+  runThread = std::this_thread::get_id();
+  bool ok = report((*jit)->initialize(dylib));
+  if (ok) {
+    if (setjmp(exitJump) == 0)
+      exitCode_ = mainFunc(1, argv);
+    else
+      exitCode_ = exitStatus;
+    ok = report((*jit)->deinitialize(dylib));
+  }
+
+  fflush(stdout);
+  if (savedStdout >= 0) {
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+  }
+
+  // counter arrays live in JIT memory
+  for (const auto &table : counterTables_) {
+    for (unsigned i = 0; i < table.count; i++)
+      counts_.emplace_back(table.names[i],
+                           __atomic_load_n(&table.counters[i],
+                                           __ATOMIC_RELAXED));
+  }
+  activeRunner = nullptr;
+  return ok;
+}
+
+bool JitRunner::writeCounts(const std::string &path) const {
+  if (counts_.empty())
+    return false;
+  std::ofstream out(path);
+  if (!out) {
+    std::cerr << "error: can't write counts: " << path << "\n";
+    return false;
+  }
+  for (const auto &count : counts_)
+    out << count.first << ":" << count.second << "\n";
+  return true;
+}
@@ -0,0 +1,207 @@
+#include "../include/Reconstruction.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include <set>
+
+using namespace llvm;
+
+bool isRecordableType(const Type *type) {
+  return type->isIntegerTy(32) || type->isIntegerTy(64) || type->isFloatTy();
+}
+
+static bool isPureIntegerOp(const Instruction &instr) {
+  if (!instr.getType()->isIntegerTy())
+    return false;
+  if (isa<BinaryOperator>(instr) || isa<ICmpInst>(instr) ||
+      isa<SelectInst>(instr))
+    return true;
+  if (auto *cast = dyn_cast<CastInst>(&instr))
+    return cast->getSrcTy()->isIntegerTy();
+  return false;
+}
+
+// recorded and usable as an input; unnamed values have positional site ids
+// (positionalSiteId) of their own like named ones
+static bool isRecordedInput(const Value &value) {
+  return isRecordableType(value.getType());
+}
+
+namespace {
+
+// instructions between two calls of a block; a call ends its segment, its
+// result is recorded at the start of the next one
+struct Segment {
+  BasicBlock *block;
+  Instruction *start; // where records of the segment start go
+  bool first;         // first segment of its block, the one with the phis
+  std::vector<Instruction *> instrs;
+};
+
+// where a reconstructible op takes an operand from
+enum class Source {
+  None,     // not available, the op is recorded
+  Constant, // folded in from the IR
+  Computed, // recomputed earlier in the segment
+  Recorded, // recorded in the segment anyway
+  Phi,      // phi of the block, recorded only if a segment needs it
+  LiveIn,   // recorded once more at the segment start
+};
+
+} // namespace
+
+static std::vector<Segment> splitSegments(Function &function,
+                                          std::unordered_map<const Value *,
+                                                             unsigned> &where) {
+  std::vector<Segment> segments;
+  for (auto &block : function) {
+    auto insertPt = block.getFirstInsertionPt();
+    if (insertPt == block.end())
+      continue;
+    segments.push_back({&block, &*insertPt, true, {}});
+    for (auto &phi : block.phis())
+      where[&phi] = segments.size() - 1;
+
+    for (auto &instr : block) {
+      if (isa<PHINode>(instr))
+        continue;
+      where[&instr] = segments.size() - 1;
+      segments.back().instrs.push_back(&instr);
+      // a call may run this block again (recursion) and overwrite the last
+      // values of everything before it
+      if (isa<CallBase>(instr) && !isa<DbgInfoIntrinsic>(instr) &&
+          instr.getNextNode())
+        segments.push_back({&block, instr.getNextNode(), false, {}});
+    }
+  }
+  return segments;
+}
+
+ReconstructionPlan::ReconstructionPlan(Function &function) {
+  std::unordered_map<const Value *, unsigned> where;
+  std::vector<Segment> segments = splitSegments(function, where);
+
+  for (unsigned index = 0; index < segments.size(); index++) {
+    const Segment &segment = segments[index];
+    std::unordered_set<const Instruction *> computed;
+
+    auto sourceOf = [&](const Value *operand) {
+      if (isa<ConstantInt>(operand))
+        return Source::Constant;
+      if (auto *instr = dyn_cast<Instruction>(operand)) {
+        if (computed.count(instr))
+          return Source::Computed;
+      }
+      if (!isRecordedInput(*operand))
+        return Source::None;
+      if (isa<Argument>(operand)) {
+        bool atEntry = segment.first &&
+                       segment.block == &function.getEntryBlock();
+        return atEntry ? Source::Recorded : Source::LiveIn;
+      }
+      if (!isa<Instruction>(operand))
+        return Source::None;
+      auto found = where.find(operand);
+      if (found == where.end() || found->second != index)
+        return Source::LiveIn;
+      return isa<PHINode>(operand) ? Source::Phi : Source::Recorded;
+    };
+
+    // ops recomputed when extra records are allowed or not, pruned to the
+    // ones shown in the graph and their inputs
+    auto plan = [&](bool extraRecords) {
+      computed.clear();
+      std::vector<Instruction *> candidates;
+      for (Instruction *instr : segment.instrs) {
+        if (!isPureIntegerOp(*instr))
+          continue;
+        bool fromSources = true;
+        for (const Value *operand : instr->operands()) {
+          Source source = sourceOf(operand);
+          if (source == Source::None ||
+              (!extraRecords &&
+               (source == Source::Phi || source == Source::LiveIn))) {
+            fromSources = false;
+            break;
+          }
+        }
+        if (fromSources) {
+          candidates.push_back(instr);
+          computed.insert(instr);
+        }
+      }
+
+      std::unordered_set<const Instruction *> needed;
+      std::vector<Instruction *> kept;
+      for (auto it = candidates.rbegin(); it != candidates.rend(); ++it) {
+        Instruction *instr = *it;
+        if (!isRecordableType(instr->getType()) && !needed.count(instr))
+          continue;
+        kept.push_back(instr);
+        for (const Value *operand : instr->operands()) {
+          if (auto *input = dyn_cast<Instruction>(operand))
+            needed.insert(input);
+        }
+      }
+      computed.clear();
+      computed.insert(kept.begin(), kept.end());
+      return kept;
+    };
+
+    std::vector<Instruction *> kept = plan(true);
+    std::set<Value *> extra;
+    size_t saved = 0;
+    for (Instruction *instr : kept) {
+      if (isRecordableType(instr->getType()))
+        saved++;
+      for (Value *operand : instr->operands()) {
+        Source source = sourceOf(operand);
+        if (source == Source::Phi || source == Source::LiveIn)
+          extra.insert(operand);
+      }
+    }
+    if (extra.size() > saved) {
+      kept = plan(false);
+      extra.clear();
+    }
+
+    for (Instruction *instr : kept) {
+      reconstructible_.insert(instr);
+      segmentOf_[instr] = index;
+    }
+    for (Value *operand : extra) {
+      if (sourceOf(operand) == Source::Phi) {
+        recordedPhis_.insert(cast<PHINode>(operand));
+      } else {
+        liveIns_.push_back({operand, segment.start, index});
+        liveInSet_.insert({index, operand});
+      }
+    }
+  }
+}
+
+int ReconstructionPlan::liveInSegment(const Instruction *instr,
+                                      const Value *operand) const {
+  auto found = segmentOf_.find(instr);
+  if (found == segmentOf_.end() || !liveInSet_.count({found->second, operand}))
+    return -1;
+  return found->second;
+}
+
+Constant *evaluateReconstructible(const Instruction &instr,
+                                  ArrayRef<Constant *> ops) {
+  Constant *result = nullptr;
+  if (auto *binary = dyn_cast<BinaryOperator>(&instr)) {
+    result = ConstantExpr::get(binary->getOpcode(), ops[0], ops[1]);
+  } else if (auto *cmp = dyn_cast<ICmpInst>(&instr)) {
+    result = ConstantExpr::getICmp(cmp->getPredicate(), ops[0], ops[1]);
+  } else if (auto *cast = dyn_cast<CastInst>(&instr)) {
+    result = ConstantExpr::getCast(cast->getOpcode(), ops[0], cast->getType());
+  } else if (isa<SelectInst>(instr)) {
+    result = ConstantExpr::getSelect(ops[0], ops[1], ops[2]);
+  }
+  return dyn_cast_or_null<ConstantInt>(result);
+}
@@ -0,0 +1,136 @@
+#include "../include/RuntimeProfile.h"
+
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+using namespace llvm;
+
+bool readRuntimeLog(const std::string &logFile, RuntimeValueMap &values) {
+  auto buffer = MemoryBuffer::getFile(logFile, /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+  if (buffer) {
+    StringRef data = (*buffer)->getBuffer();
+    if (data.startswith(
+            StringRef(DEFUSE_TRACE_MAGIC, DEFUSE_TRACE_MAGIC_SIZE))) {
+      TraceDecoder decoder;
+      if (!decoder.decode(data.data(), data.size()))
+        return false;
+      if (decoder.threadCount() > 1) {
+        std::cout << "  Trace has records from " << decoder.threadCount()
+                  << " threads\n";
+      }
+      return decoder.publish(values) > 0;
+    }
+  }
+
+  std::ifstream log(logFile);
+  if (!log.is_open()) {
+    std::cerr << "    can't open runtime log: " << logFile << "\n";
+    return false;
+  }
+
+  std::string line;
+  int cnt = 0;
+
+  // TODO [Dkay]: You can use Json and save yourself from weird parsing. LLVM
+  // also has json lib.
+  while (std::getline(log, line)) {
+    if (line.empty())
+      continue;
+
+    size_t p = line.rfind(':');
+    if (p == std::string::npos)
+      continue;
+
+    std::string key = line.substr(0, p);
+    std::string value = line.substr(p + 1);
+
+    // kill fucking whitespaces
+    key.erase(0, key.find_first_not_of(" \t\r\n"));
+    key.erase(key.find_last_not_of(" \t\r\n") + 1);
+    value.erase(0, value.find_first_not_of(" \t\r\n"));
+    value.erase(value.find_last_not_of(" \t\r\n") + 1);
+
+    if (!key.empty() && !value.empty()) {
+      values[key].value = value;
+      cnt++;
+    }
+  }
+  log.close();
+  if (cnt > 0) {
+    return true;
+  }
+  return false;
+}
+
+// a before b, as numbers if both are (the runtime prints integers, floats
+// and pointers), else as text
+static bool valueLess(const std::string &a, const std::string &b) {
+  char *endA = nullptr;
+  char *endB = nullptr;
+  double x = strtod(a.c_str(), &endA);
+  double y = strtod(b.c_str(), &endB);
+  if (!a.empty() && !b.empty() && *endA == '\0' && *endB == '\0')
+    return x < y;
+  return a < b;
+}
+
+static void addInputValue(RuntimeValue &merged, const std::string &value,
+                          const std::string &input) {
+  if (value.empty())
+    return;
+  for (RuntimeValue::InputValues &seen : merged.byInput) {
+    if (seen.value != value)
+      continue;
+    if (seen.inputs.back() != input)
+      seen.inputs.push_back(input);
+    return;
+  }
+  merged.byInput.push_back({value, {input}});
+}
+
+void mergeInputRun(RuntimeValueMap &merged, const std::string &input,
+                   const RuntimeValueMap &run) {
+  for (const auto &entry : run) {
+    const RuntimeValue &value = entry.second;
+    if (value.empty())
+      continue;
+    RuntimeValue &into = merged[entry.first];
+    bool first = into.empty();
+
+    if (value.aggregated && !value.distinctOverflow) {
+      for (const std::string &distinct : value.distinct)
+        addInputValue(into, distinct, input);
+    } else {
+      addInputValue(into, value.value, input);
+      for (const auto &thread : value.perThread)
+        addInputValue(into, thread.second, input);
+    }
+    if (!value.value.empty())
+      into.value = value.value;
+    into.dropped += value.dropped;
+    if (!value.aggregated)
+      continue;
+
+    into.aggregated = true;
+    into.count += value.count;
+    if (first || valueLess(value.min, into.min))
+      into.min = value.min;
+    if (first || valueLess(into.max, value.max))
+      into.max = value.max;
+    into.distinctOverflow = into.distinctOverflow || value.distinctOverflow;
+    for (const std::string &distinct : value.distinct) {
+      if (std::find(into.distinct.begin(), into.distinct.end(), distinct) !=
+          into.distinct.end())
+        continue;
+      if (into.distinct.size() < DEFUSE_DISTINCT_SLOTS)
+        into.distinct.push_back(distinct);
+      else
+        into.distinctOverflow = true;
+    }
+  }
+}
@@ -0,0 +1,82 @@
+#include "../include/SiteManifest.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+static const char *const kindNames[] = {"arg", "instr", "const"};
+
+bool SiteManifest::write(const std::string &file) const {
+  std::ofstream out(file);
+  if (!out.is_open()) {
+    std::cerr << "    can't write site manifest: " << file << "\n";
+    return false;
+  }
+  for (size_t site = 0; site < ids.size(); site++) {
+    const SitePosition &at = positions[site];
+    out << kindNames[at.kind] << ' ' << at.block << ' ' << at.index << ' '
+        << at.segment << ' ' << at.function << '\t' << ids[site] << '\n';
+  }
+  return bool(out);
+}
+
+bool SiteManifest::read(const std::string &file) {
+  clear();
+  std::ifstream in(file);
+  if (!in.is_open()) {
+    std::cerr << "    can't open site manifest: " << file << "\n";
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t tab = line.find('\t');
+    if (tab == std::string::npos)
+      continue;
+
+    char kind[8];
+    unsigned long block, index;
+    long segment;
+    int functionStart = 0;
+    if (sscanf(line.c_str(), "%7s %lu %lu %ld %n", kind, &block, &index,
+               &segment, &functionStart) != 4 ||
+        size_t(functionStart) > tab) {
+      std::cerr << "    bad site manifest line: " << line << "\n";
+      clear();
+      return false;
+    }
+
+    SitePosition at;
+    std::string kindName = kind;
+    if (kindName == "arg")
+      at.kind = SitePosition::Argument;
+    else if (kindName == "const")
+      at.kind = SitePosition::Constant;
+    else
+      at.kind = SitePosition::Instruction;
+    at.function = line.substr(functionStart, tab - functionStart);
+    at.block = uint32_t(block);
+    at.index = uint32_t(index);
+    at.segment = int32_t(segment);
+    positions.push_back(at);
+    ids.push_back(line.substr(tab + 1));
+  }
+  return !ids.empty();
+}
+
+std::string manifestPathFor(const std::string &modulePath) {
+  size_t slash = modulePath.find_last_of('/');
+  size_t dot = modulePath.find_last_of('.');
+  if (dot == std::string::npos ||
+      (slash != std::string::npos && dot < slash))
+    return modulePath + ".sites";
+  return modulePath.substr(0, dot) + ".sites";
+}
+
+std::string positionalSiteId(const SitePosition &at, const std::string &what) {
+  std::string id = at.function + "::" + what;
+  if (at.kind == SitePosition::Instruction)
+    id += "." + std::to_string(at.block);
+  return id + "." + std::to_string(at.index);
+}
@@ -0,0 +1,269 @@
+#include "../include/TraceDecoder.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+// same formatting as the text runtime, so labels don't depend on trace mode
+static std::string formatTracePayload(uint32_t tag, uint64_t payload) {
+  char buf[512];
+  switch (tag) {
+  case DEFUSE_TAG_I32:
+    snprintf(buf, sizeof(buf), "%d", static_cast<int32_t>(payload));
+    break;
+  case DEFUSE_TAG_FLOAT: {
+    uint32_t bits = static_cast<uint32_t>(payload);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    snprintf(buf, sizeof(buf), "%f", value);
+    break;
+  }
+  case DEFUSE_TAG_DOUBLE: {
+    double value;
+    memcpy(&value, &payload, sizeof(value));
+    snprintf(buf, sizeof(buf), "%lf", value);
+    break;
+  }
+  default:
+    snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(payload));
+    break;
+  }
+  return buf;
+}
+
+bool TraceDecoder::decode(const char *data, size_t size) {
+  // memory-mapped traces are preallocated: only reserved slots count
+  DefuseTraceHeader header;
+  if (size >= sizeof(header)) {
+    memcpy(&header, data, sizeof(header));
+    size_t entrySize = header.kind == DEFUSE_KIND_AGGREGATE
+                           ? sizeof(DefuseTraceAggregate)
+                           : sizeof(DefuseTraceRecord);
+    if (header.recordCursor != 0 && header.recordsOffset <= size &&
+        header.recordCursor < (size - header.recordsOffset) / entrySize)
+      size = header.recordsOffset + header.recordCursor * entrySize;
+  }
+
+  if (!feed(data, size))
+    return false;
+  if (!headerSeen_) {
+    std::cerr << "    truncated trace header\n";
+    return false;
+  }
+  return true;
+}
+
+bool TraceDecoder::feed(const char *data, size_t size) {
+  if (broken_)
+    return false;
+
+  if (!headerSeen_) {
+    auto take = [&](size_t need) {
+      size_t count = std::min(size, need - pending_.size());
+      pending_.insert(pending_.end(), data, data + count);
+      data += count;
+      size -= count;
+      return pending_.size() == need;
+    };
+
+    // the fixed part first, it tells how long the rest of the header is
+    if (pending_.size() < sizeof(DefuseTraceHeader)) {
+      if (!take(sizeof(DefuseTraceHeader)))
+        return true;
+      memcpy(&header_, pending_.data(), sizeof(header_));
+      if (memcmp(header_.magic, DEFUSE_TRACE_MAGIC,
+                 DEFUSE_TRACE_MAGIC_SIZE) != 0) {
+        std::cerr << "    not a binary trace\n";
+        broken_ = true;
+        return false;
+      }
+      if (header_.version != DEFUSE_TRACE_VERSION) {
+        std::cerr << "    unsupported trace version: " << header_.version
+                  << "\n";
+        broken_ = true;
+        return false;
+      }
+      size_t sitesEnd = sizeof(header_) +
+                        size_t(header_.siteCount) * sizeof(DefuseTraceSite);
+      if (sitesEnd + header_.stringBytes > header_.recordsOffset) {
+        std::cerr << "    malformed trace header\n";
+        broken_ = true;
+        return false;
+      }
+    }
+    if (!take(header_.recordsOffset))
+      return true;
+    parseHeader();
+  }
+
+  consume(data, size);
+  return true;
+}
+
+void TraceDecoder::parseHeader() {
+  const char *sites = pending_.data() + sizeof(header_);
+  sites_.resize(header_.siteCount);
+  memcpy(sites_.data(), sites, sites_.size() * sizeof(DefuseTraceSite));
+  const char *strings = sites + sites_.size() * sizeof(DefuseTraceSite);
+  strings_.assign(strings, strings + header_.stringBytes);
+  pending_.clear();
+  resetTables();
+}
+
+void TraceDecoder::setSites(const char *const *ids,
+                            const unsigned char *tags, unsigned count) {
+  header_ = DefuseTraceHeader();
+  header_.kind = DEFUSE_KIND_RECORDS;
+  header_.siteCount = count;
+  sites_.resize(count);
+  strings_.clear();
+  for (unsigned site = 0; site < count; site++) {
+    sites_[site].nameOffset = strings_.size();
+    sites_[site].tag = tags[site];
+    strings_.insert(strings_.end(), ids[site], ids[site] + strlen(ids[site]));
+    strings_.push_back('\0');
+  }
+  resetTables();
+}
+
+void TraceDecoder::resetTables() {
+  if (header_.kind == DEFUSE_KIND_AGGREGATE) {
+    entrySize_ = sizeof(DefuseTraceAggregate);
+    aggregates_.assign(header_.siteCount, DefuseTraceAggregate());
+  } else {
+    entrySize_ = sizeof(DefuseTraceRecord);
+    last_.assign(header_.siteCount, DefuseTraceRecord());
+    threadsPerSite_.assign(header_.siteCount, 0);
+    dropped_.assign(header_.siteCount, 0);
+  }
+  dirty_.assign(header_.siteCount, false);
+  dirtySites_.clear();
+  lastByThread_.clear();
+  headerSeen_ = true;
+}
+
+void TraceDecoder::consume(const char *data, size_t size) {
+  auto addEntry = [&](const char *entry) {
+    if (header_.kind == DEFUSE_KIND_AGGREGATE) {
+      DefuseTraceAggregate aggregate;
+      memcpy(&aggregate, entry, sizeof(aggregate));
+      addAggregate(aggregate);
+    } else {
+      DefuseTraceRecord record;
+      memcpy(&record, entry, sizeof(record));
+      addRecord(record);
+    }
+  };
+
+  // finish the entry the previous chunk ended in the middle of
+  if (!pending_.empty()) {
+    size_t take = std::min(size, entrySize_ - pending_.size());
+    pending_.insert(pending_.end(), data, data + take);
+    data += take;
+    size -= take;
+    if (pending_.size() < entrySize_)
+      return;
+    addEntry(pending_.data());
+    pending_.clear();
+  }
+
+  for (; size >= entrySize_; data += entrySize_, size -= entrySize_)
+    addEntry(data);
+  pending_.assign(data, data + size);
+}
+
+void TraceDecoder::markDirty(uint32_t site) {
+  if (dirty_[site])
+    return;
+  dirty_[site] = true;
+  dirtySites_.push_back(site);
+}
+
+void TraceDecoder::addRecord(const DefuseTraceRecord &record) {
+  if (record.site >= header_.siteCount || record.tag == DEFUSE_TAG_NONE)
+    return;
+  recordCount_++;
+  markDirty(record.site);
+  if (record.tag == DEFUSE_TAG_DROPPED) {
+    dropped_[record.site] += record.payload;
+    return;
+  }
+  last_[record.site] = record;
+
+  if (record.thread >= lastByThread_.size())
+    lastByThread_.resize(record.thread + 1);
+  auto &threadLast = lastByThread_[record.thread];
+  if (threadLast.empty())
+    threadLast.resize(header_.siteCount, DefuseTraceRecord());
+  if (threadLast[record.site].tag == DEFUSE_TAG_NONE)
+    threadsPerSite_[record.site]++;
+  threadLast[record.site] = record;
+}
+
+void TraceDecoder::addAggregate(const DefuseTraceAggregate &aggregate) {
+  if (aggregate.site >= header_.siteCount ||
+      (aggregate.count == 0 && aggregate.dropped == 0))
+    return;
+  recordCount_++;
+  aggregates_[aggregate.site] = aggregate;
+  markDirty(aggregate.site);
+}
+
+std::string TraceDecoder::siteName(uint32_t site) const {
+  uint32_t offset = sites_[site].nameOffset;
+  if (offset >= strings_.size())
+    return "";
+  const char *name = strings_.data() + offset;
+  return std::string(name, strnlen(name, strings_.size() - offset));
+}
+
+size_t TraceDecoder::publish(RuntimeValueMap &values) {
+  size_t published = 0;
+  for (uint32_t site : dirtySites_) {
+    dirty_[site] = false;
+    std::string key = siteName(site);
+    if (key.empty())
+      continue;
+
+    RuntimeValue value;
+    if (header_.kind == DEFUSE_KIND_AGGREGATE) {
+      const DefuseTraceAggregate &aggregate = aggregates_[site];
+      value.dropped = aggregate.dropped;
+      if (aggregate.count != 0) {
+        value.aggregated = true;
+        value.count = aggregate.count;
+        value.value = formatTracePayload(aggregate.tag, aggregate.last);
+        value.min = formatTracePayload(aggregate.tag, aggregate.min);
+        value.max = formatTracePayload(aggregate.tag, aggregate.max);
+        value.distinctOverflow =
+            aggregate.distinct == DEFUSE_DISTINCT_OVERFLOW;
+        if (!value.distinctOverflow) {
+          for (unsigned d = 0;
+               d < aggregate.distinct && d < DEFUSE_DISTINCT_SLOTS; d++)
+            value.distinct.push_back(
+                formatTracePayload(aggregate.tag, aggregate.values[d]));
+        }
+      }
+    } else {
+      value.dropped = dropped_[site];
+      const DefuseTraceRecord &last = last_[site];
+      if (last.tag != DEFUSE_TAG_NONE)
+        value.value = formatTracePayload(last.tag, last.payload);
+      if (threadsPerSite_[site] > 1) {
+        for (size_t thread = 0; thread < lastByThread_.size(); thread++) {
+          if (lastByThread_[thread].empty())
+            continue;
+          const DefuseTraceRecord &record = lastByThread_[thread][site];
+          if (record.tag != DEFUSE_TAG_NONE)
+            value.perThread[thread] =
+                formatTracePayload(record.tag, record.payload);
+        }
+      }
+    }
+    values[key] = std::move(value);
+    published++;
+  }
+  dirtySites_.clear();
+  return published;
+}
@@ -7,18 +7,46 @@
 // FIXME [Dkay]: Probably its unsafe to call std::system like you do, but I won't prove it
 // think about the case when user enters `sudo rm -rf /` as program's input
 
+#include "../include/GraphQuery.h"
 #include "../include/GraphVisualizer.h" 
 #include "../include/Instrumentation.h"
+#include "../include/JitRunner.h"
+#include "../include/RuntimeProfile.h"
 
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/IRReader/IRReader.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
 
 // [flops]: Just note that c++20 provides ends_with method: http://en.cppreference.com/w/cpp/string/basic_string/ends_with
 
@@ -41,19 +69,158 @@ static void printHelp() { // TODO[flops]: Use argv[0] there instead of ./bin/def
             << "  ./bin/defuse-analyzer -analyze <input.c|input.ll> [out_dir]\n"
             << "\n"
             << "One-step full pipeline:\n"
-            << "  -analyze <file.c|file.ll> [out_dir]\n"
+            << "  -analyze <file.c|file.ll|file.bc> [out_dir]\n"
+            << "           [-aggregate|-mmap|-stream|-counters|-minimal|"
+               "-batched|-bc|-jit]\n"
+            << "           [-inputs <dir|file>]\n"
             << "    C->LL -> mem2reg -> instrument -> run "
                "-> graph\n"
+            << "    -aggregate: keep count/min/max/last/distinct per site "
+               "instead of every value\n"
+            << "    -mmap: crash-safe memory-mapped trace, graph is built "
+               "even if the program crashes\n"
+            << "    -stream: read the trace through a FIFO while the program "
+               "runs,\n"
+            << "             the graph is rewritten every second\n"
+            << "    -counters: count block and CFG edge executions instead "
+               "of values,\n"
+            << "               the graph becomes a heat map of hot paths\n"
+            << "    -minimal: skip integer arithmetic the analyzer can "
+               "recompute offline\n"
+            << "              from the recorded loads, calls and arguments\n"
+            << "    -batched: one runtime call per executed basic block "
+               "instead of one\n"
+            << "              per value\n"
+            << "    -bc: keep the intermediate IR as bitcode (default for .bc "
+               "input)\n"
+            << "    -jit: run the instrumented module in process (ORC JIT), "
+               "values go\n"
+            << "          straight into the graph without building the "
+               "program or a trace\n"
+            << "    -inputs: run the program once per file of a directory "
+               "(on stdin) or\n"
+            << "             per line of a file (as arguments), -j N at a "
+               "time; nodes show\n"
+            << "             which inputs gave which values\n"
             << "\n"
             << "Separate steps:\n"
             << "  -emit-llvm   <file.c>  <out.ll>\n"
             << "  -mem2reg     <in.ll>   <out.ll>\n"
-            << "  -instrument  <in.ll>   <out.ll>\n"
+            << "  -instrument  <in.ll>   <out.ll> "
+               "[-counters|-minimal|-batched]\n"
             << "  -run         <instrumented.ll> <out_runtime.log> [out_exe]\n"
-            << "  -graph       <in.ll>   [runtime.log] [out_dot]\n"
+            << "  -graph       <in.ll|in.dgraph> [runtime.log] [out_dot] "
+               "[runtime.counts]\n"
+            << "  -save-graph  <in.ll>   <out.dgraph>\n"
+            << "    the graph without runtime values, memory-mapped by "
+               "-graph to export it\n"
+            << "    again (other logs, counts) without parsing the IR\n"
+            << "  -query       <in.ll|in.dgraph> <queries.txt> "
+               "[answers.txt]\n"
+            << "    one answer line per query line: reach <a> <b>, path <a> "
+               "<b>,\n"
+            << "    ancestors <n>, descendants <n> [calls] [opcode=op] "
+               "[function=f],\n"
+            << "    degree <n>, degrees [function=f]\n"
+            << "  -watch       <in.c|in.ll> [out_dot]\n"
+            << "    rebuilds the graph whenever the file is saved, only "
+               "the changed\n"
+            << "    functions are formatted and rendered again\n"
+            << "  -stream      <in.ll>   <trace_fifo> [out_dot] "
+               "[interval_ms]\n"
+            << "    live graph from a binary trace written to a pipe, e.g.\n"
+            << "      mkfifo t.fifo\n"
+            << "      DEFUSE_TRACE=binary DEFUSE_TRACE_FILE=t.fifo ./program "
+               "&\n"
+            << "      ./bin/defuse-analyzer -stream in.ll t.fifo live.dot\n"
+            << "\n"
+            << "Runtime log format is picked by extension: *.trace is the "
+               "binary trace,\n"
+            << "*.mtrace the crash-safe memory-mapped trace, *.agg per-site "
+               "aggregates,\n"
+            << "*.fifo the binary trace written to a named pipe,\n"
+            << "anything else is the text format (node_id:value lines).\n"
+            << "IR paths ending in .bc are read and written as bitcode, "
+               "others as text.\n"
+            << "\n"
+            << "Any command building a graph takes -j N to build the "
+               "functions on N threads\n"
+            << "(0: one per core), the graph is the same.\n"
+            << "-graph and -stream take -sites <file.sites>, the manifest "
+               "-instrument writes\n"
+            << "next to the instrumented IR, to match values with "
+               "instructions by position.\n"
+            << "Any command writing a graph takes -slice-backward <node id> "
+               "or\n"
+            << "-slice-forward <node id> to write only the values feeding "
+               "the node or fed\n"
+            << "by it, -slice-depth N to stop N def-use edges away and "
+               "-slice-calls to\n"
+            << "follow call edges too.\n"
+            << "Any command writing a graph renders it with graphviz if "
+               "installed, laid out\n"
+            << "once for all of -formats png,svg (the default; none: no "
+               "pictures). From\n"
+            << "-shard-above N nodes (2000, 0: never) or with -shards it "
+               "writes a DOT file per\n"
+            << "function and an index into <out>.shards/ and renders those "
+               "in parallel\n"
+            << "instead, again only the ones whose text changed.\n"
+            << "An out_dot ending in .json or .graphml writes the nodes and "
+               "edges with their\n"
+            << "kind, opcode, function, block and runtime value in that "
+               "format instead.\n"
             << "\n";
 }
 
+// -j N, for every command that builds a graph
+static unsigned graphJobs = 1;
+// -sites FILE, for -graph and -stream
+static std::string siteManifestFile;
+// -slice-backward NODE / -slice-forward NODE, -slice-depth N, -slice-calls
+static std::string sliceNode;
+static GraphVisualizer::SliceDirection sliceDirection =
+    GraphVisualizer::SliceDirection::Backward;
+static unsigned sliceDepth = 0;
+static bool sliceCalls = false;
+// -formats LIST, the pictures renderDot makes of a graph ("none": none)
+static std::vector<std::string> renderFormats = {"png", "svg"};
+// -shards, -shard-above N: when renderDot renders per function (0: never)
+static bool alwaysShard = false;
+static size_t shardAbove = 2000;
+// child processes at once (dot renders, -inputs runs), -j N or one per core
+static unsigned processJobs = 0;
+// shards of the last renderDot, empty if it rendered the whole graph
+static std::string renderedShardDir;
+
+// sites of the instrumented module: the given ones or those of -sites
+static bool useSiteManifest(GraphVisualizer &vis, const SiteManifest *sites) {
+  if (sites) {
+    vis.setSiteManifest(*sites);
+    return true;
+  }
+  if (siteManifestFile.empty())
+    return true;
+  SiteManifest manifest;
+  if (!manifest.read(siteManifestFile)) {
+    std::cerr << "error: no sites in manifest: " << siteManifestFile << "\n";
+    return false;
+  }
+  vis.setSiteManifest(std::move(manifest));
+  return true;
+}
+
+// the slice of the command line, if any, for the next exports of vis
+static bool useSlice(GraphVisualizer &vis) {
+  if (sliceNode.empty())
+    return true;
+  if (!vis.selectSlice(sliceNode, sliceDirection, sliceDepth, sliceCalls)) {
+    std::cerr << "error: no node " << sliceNode << " in the graph\n";
+    return false;
+  }
+  return true;
+}
+
 static bool runCmd(const std::string &cmd) {
   int rc = std::system(cmd.c_str());
   return rc == 0;
@@ -64,47 +231,123 @@ static void ensureDir(const std::string &path) { // TODO[flops]: Rename it into
   (void)std::system(cmd.c_str());
 }
 
-static std::string getOptMem2RegCmd() {
-  // FIXME[dkay]: Why not to use runCmd there
-  if (std::system("which opt > /dev/null 2>&1") != 0) // [flops]: Check build.sh
-    return "";
-
-  // [flops]: You can pre-check format of opt commands on build stage too
-  // TODO[Dkay]: You can use llvm-config version to pre-check 
-  if (std::system("opt -S -passes=mem2reg --help > /dev/null 2>&1") == 0)
-    return "opt -S -passes=mem2reg";
-
-  // if new format not supported, fallback to old one
-  return "opt -S -mem2reg";
+// IR files ending in .bc are bitcode, everything else textual IR. Bitcode is
+// much faster to write and read back for large modules.
+static bool isBitcodePath(const std::string &path) {
+  return endsWith(path, ".bc");
 }
 
 static bool emitllFromC(const std::string &cFile, const std::string &outLl) {
-  std::string cmd = "clang -S -emit-llvm -O0 -Xclang -disable-O0-optnone "
+  std::string cmd = std::string("clang ") +
+                    (isBitcodePath(outLl) ? "-c" : "-S") +
+                    " -emit-llvm -O0 -Xclang -disable-O0-optnone "
                     "-fno-discard-value-names "
                     "\"" +
                     cFile + "\" -o \"" + outLl + "\"";
   return runCmd(cmd);
 }
 
+static bool loadModule(const std::string &llFile,
+                       std::unique_ptr<llvm::Module> &outModule,
+                       llvm::LLVMContext &ctx) {
+  llvm::SMDiagnostic err;
+  outModule = llvm::parseIRFile(llFile, err, ctx);
+  if (!outModule) { // TODO[Dkay]: Use some logging + return macro, since I dont want to have debug output in production mode
+                    // return std::optional / std::expected in such cases
+    std::cerr << "error: can't read IR: " << llFile << "\n";
+    err.print(llFile.c_str(), llvm::errs());
+    return false;
+  }
+  return true;
+}
+
+static bool writeModule(llvm::Module &module, const std::string &path) {
+  std::error_code ec;
+  llvm::raw_fd_ostream out(path, ec);
+  if (ec) {
+    std::cerr << "error: can't write IR: " << path << "\n";
+    return false;
+  }
+  if (isBitcodePath(path))
+    llvm::WriteBitcodeToFile(module, out);
+  else
+    module.print(out, nullptr);
+  return true;
+}
+
+// mem2reg through the new pass manager, in place
+static void promoteAllocas(llvm::Module &module) {
+  llvm::PassBuilder builder;
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+  builder.registerModuleAnalyses(mam);
+  builder.registerCGSCCAnalyses(cgam);
+  builder.registerFunctionAnalyses(fam);
+  builder.registerLoopAnalyses(lam);
+  builder.crossRegisterProxies(lam, fam, cgam, mam);
+
+  llvm::ModulePassManager passes;
+  passes.addPass(
+      llvm::createModuleToFunctionPassAdaptor(llvm::PromotePass()));
+  passes.run(module, mam);
+}
+
 // FIXME[Dkay]: Why all of these function are in main.cpp???
 static bool mem2reg(const std::string &inLl, const std::string &outLl) {
-  std::string optCmd = getOptMem2RegCmd(); // FIXME[Dkay] use std::optional for such cases
-  
-  if (optCmd.empty()) {
-    std::cerr << "error: opt not found (install llvm)\n";
+  llvm::LLVMContext ctx;
+  std::unique_ptr<llvm::Module> mod;
+  if (!loadModule(inLl, mod, ctx))
     return false;
-  }
-  std::string cmd = optCmd + " \"" + inLl + "\" -o \"" + outLl + "\""; // FIXME[Dkay]: use std::filesystem::path
-  return runCmd(cmd);
+  promoteAllocas(*mod);
+  return writeModule(*mod, outLl);
 }
 
 // FIXME[Dkay]: different functions naming style
 // why the fuck this exists??
-static bool instrumentll(const std::string &inLl, const std::string &outLl) {
-  Instrumentation inst;
+static bool instrumentll(const std::string &inLl, const std::string &outLl,
+                         const InstrumentationOptions &options =
+                             InstrumentationOptions()) {
+  Instrumentation inst(options);
   return inst.instrumentModule(inLl, outLl);
 }
 
+// block/edge counts of a -counters run sit next to the runtime log:
+// runtime.trace -> runtime.counts
+static std::string countsPathFor(const std::string &logFile) {
+  size_t slash = logFile.find_last_of('/');
+  size_t dot = logFile.find_last_of('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return logFile + ".counts";
+  return logFile.substr(0, dot) + ".counts";
+}
+
+// runtime trace mode from the log name: *.trace are binary records, *.mtrace
+// crash-safe memory-mapped records, *.agg per-site aggregates, anything else
+// (empty mode) text lines on stdout. *.fifo are binary records for -stream
+static std::string traceModeFor(const std::string &logFile) {
+  if (endsWith(logFile, ".mtrace"))
+    return "mmap";
+  if (endsWith(logFile, ".trace") || endsWith(logFile, ".fifo"))
+    return "binary";
+  if (endsWith(logFile, ".agg"))
+    return "aggregate";
+  return "";
+}
+
+static bool compileInstrumented(const std::string &instrumentedLl,
+                                const std::string &exePath) {
+  // FIXME[flops]: fail on launch from different directories, because of hardcoded `runtime/core_runtime.c`
+  std::string buildCmd = "clang -O0 -pthread runtime/core_runtime.c \"" +
+                         instrumentedLl + "\" -o \"" + exePath + "\"";
+  if (!runCmd(buildCmd)) {
+    std::cerr << "error: failed to compile instrumented program\n";
+    return false;
+  }
+  return true;
+}
+
 static bool buildAndRun(const std::string &instrumentedLl,
                         const std::string &outRuntimeLog,
                         const std::string &outExe) {
@@ -113,79 +356,715 @@ static bool buildAndRun(const std::string &instrumentedLl,
   // the default value if outExe param should be set in argument parser function
   std::string exePath = outExe.empty() ? "program" : outExe; // FIXME[flops]: Unsafe fallback to the `program`, give loud error and return false there
 
-  // FIXME[flops]: fail on launch from different directories, because of hardcoded `runtime/core_runtime.c`
-  std::string buildCmd = "clang -O0 runtime/core_runtime.c \"" +
-                         instrumentedLl + "\" -o \"" + exePath + "\"";
-  if (!runCmd(buildCmd)) {
-    std::cerr << "error: failed to compile instrumented program\n";
+  if (!compileInstrumented(instrumentedLl, exePath))
     return false;
-  }
 
   std::string runCmdLine =
-      "./" + outExe + " > " + outRuntimeLog + " 2>/dev/null";
+      "DEFUSE_COUNTERS_FILE=\"" + countsPathFor(outRuntimeLog) + "\" ";
+  std::string traceMode = traceModeFor(outRuntimeLog);
+  if (!traceMode.empty()) {
+    runCmdLine += "DEFUSE_TRACE=" + traceMode + " DEFUSE_TRACE_FILE=\"" +
+                  outRuntimeLog + "\" ./" + outExe + " > /dev/null 2>&1";
+  } else {
+    runCmdLine += "./" + outExe + " > " + outRuntimeLog + " 2>/dev/null";
+  }
   // DO NOT RETURN A NON-ZERO VALUE FROM MAIN, YOU WILL BE RAPED BY TOUCAN
   if (!runCmd(runCmdLine)) {
+    // everything the program recorded before dying is in a mapped trace
+    if (traceMode == "mmap") {
+      std::cerr << "warn: instrumented program failed, using the records "
+                   "written before that\n";
+      return true;
+    }
     std::cerr << "error: running instrumented program failed\n";
     return false;
   }
   return true;
 }
 
-static bool loadModule(const std::string &llFile,
-                       std::unique_ptr<llvm::Module> &outModule,
-                       llvm::LLVMContext &ctx) {
-  llvm::SMDiagnostic err;
-  outModule = llvm::parseIRFile(llFile, err, ctx);
-  if (!outModule) { // TODO[Dkay]: Use some logging + return macro, since I dont want to have debug output in production mode
-                    // return std::optional / std::expected in such cases
-    std::cerr << "error: can't read IR: " << llFile << "\n";
-    err.print(llFile.c_str(), llvm::errs());
+// "g.png" for "g.dot", "g.gv.png" for "g.gv"
+static std::string picturePath(const std::string &dotFile,
+                               const std::string &format) {
+  if (endsWith(dotFile, ".dot"))
+    return dotFile.substr(0, dotFile.size() - 4) + "." + format;
+  return dotFile + "." + format;
+}
+
+// true if picture is missing or older than the dot file it is made from
+static bool isStale(const std::string &picture, const std::string &dotFile) {
+  llvm::sys::fs::file_status pictureStatus, dotStatus;
+  if (llvm::sys::fs::status(picture, pictureStatus) ||
+      llvm::sys::fs::status(dotFile, dotStatus))
+    return true;
+  return pictureStatus.getLastModificationTime() <
+         dotStatus.getLastModificationTime();
+}
+
+// the renderFormats pictures of each dot file with a stale one. One dot run
+// per file with a -T and -o for every format: graphviz lays the graph out
+// once and writes all of them from that layout. Files are rendered in
+// parallel, one dot process per core (or -j). Returns the number rendered.
+static size_t renderFiles(const std::string &dotProgram,
+                          const std::vector<std::string> &files) {
+  std::atomic<size_t> rendered{0};
+  auto renderOne = [&](const std::string &file) {
+    std::vector<std::string> args = {dotProgram};
+    bool stale = false;
+    for (const std::string &format : renderFormats) {
+      std::string picture = picturePath(file, format);
+      stale = stale || isStale(picture, file);
+      args.push_back("-T" + format);
+      args.push_back("-o");
+      args.push_back(picture);
+    }
+    if (!stale)
+      return;
+    args.push_back(file);
+    std::vector<llvm::StringRef> argv(args.begin(), args.end());
+    // graphviz warnings about the layout are dropped
+    llvm::Optional<llvm::StringRef> redirects[] = {llvm::None, llvm::None,
+                                                   llvm::StringRef("")};
+    if (llvm::sys::ExecuteAndWait(dotProgram, argv, llvm::None, redirects) ==
+        0)
+      rendered++;
+  };
+  if (files.size() == 1) {
+    renderOne(files[0]);
+    return rendered;
+  }
+  llvm::ThreadPool pool(llvm::hardware_concurrency(processJobs));
+  for (const std::string &file : files)
+    pool.async([&renderOne, &file] { renderOne(file); });
+  pool.wait();
+  return rendered;
+}
+
+// one run of the instrumented program for -inputs: a file of a directory is
+// its stdin, a line of a file its arguments
+struct ProgramInput {
+  std::string name;
+  std::string stdinFile; // empty: /dev/null
+  std::vector<std::string> args;
+};
+
+static bool listInputs(const std::string &path,
+                       std::vector<ProgramInput> &inputs) {
+  if (llvm::sys::fs::is_directory(path)) {
+    std::error_code error;
+    for (llvm::sys::fs::directory_iterator it(path, error), end;
+         it != end && !error; it.increment(error)) {
+      if (llvm::sys::fs::is_regular_file(it->path())) {
+        inputs.push_back(
+            {llvm::sys::path::filename(it->path()).str(), it->path(), {}});
+      }
+    }
+    // the directory lists them in any order, runs go by name
+    std::sort(inputs.begin(), inputs.end(),
+              [](const ProgramInput &a, const ProgramInput &b) {
+                return a.name < b.name;
+              });
+  } else {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+      std::cerr << "error: can't open inputs: " << path << "\n";
+      return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+      llvm::StringRef text = llvm::StringRef(line).trim();
+      if (text.empty() || text.startswith("#"))
+        continue;
+      ProgramInput input;
+      input.name = text.str();
+      llvm::SmallVector<llvm::StringRef, 8> words;
+      text.split(words, ' ', -1, false);
+      for (llvm::StringRef word : words)
+        input.args.push_back(word.trim().str());
+      inputs.push_back(std::move(input));
+    }
+  }
+  if (inputs.empty()) {
+    std::cerr << "error: no inputs in " << path << "\n";
+    return false;
+  }
+  return true;
+}
+
+// adds up the "key:N" lines of the counts files of several runs
+static bool mergeCountFiles(const std::vector<std::string> &files,
+                            const std::string &outFile) {
+  std::vector<std::string> keys; // in the order first seen
+  llvm::StringMap<uint64_t> totals;
+  for (const std::string &file : files) {
+    std::ifstream in(file);
+    std::string line;
+    while (std::getline(in, line)) {
+      size_t colon = line.rfind(':');
+      if (colon == std::string::npos)
+        continue;
+      std::string key = line.substr(0, colon);
+      auto inserted = totals.insert({key, 0});
+      if (inserted.second)
+        keys.push_back(key);
+      inserted.first->second +=
+          std::strtoull(line.c_str() + colon + 1, nullptr, 10);
+    }
+  }
+  std::ofstream out(outFile);
+  for (const std::string &key : keys)
+    out << key << ':' << totals[key] << '\n';
+  return bool(out);
+}
+
+// -analyze -inputs: builds the instrumented program once and runs it on
+// every input, -j N (or one per core) at a time. Each run writes its own log
+// and counts into runs/ next to runtimeLog; values gets the values of all of
+// them merged (see RuntimeProfile.h), the counts are added up into the
+// counts file of runtimeLog.
+static bool runInputs(const std::string &instrumentedLl,
+                      const std::string &runtimeLog, const std::string &outExe,
+                      const std::string &inputsPath, bool readValues,
+                      RuntimeValueMap &values) {
+  std::vector<ProgramInput> inputs;
+  if (!listInputs(inputsPath, inputs) ||
+      !compileInstrumented(instrumentedLl, outExe))
+    return false;
+
+  std::string runsDir = llvm::sys::path::parent_path(runtimeLog).str();
+  runsDir += runsDir.empty() ? "runs" : "/runs";
+  ensureDir(runsDir);
+  std::string traceMode = traceModeFor(runtimeLog);
+  std::string logExt = llvm::sys::path::extension(runtimeLog).str();
+
+  // the runtime's settings of this process are replaced by each run's own
+  std::vector<std::string> baseEnv;
+  for (char **var = environ; *var; var++) {
+    if (!llvm::StringRef(*var).startswith("DEFUSE_"))
+      baseEnv.push_back(*var);
+  }
+
+  std::vector<std::string> logs(inputs.size());
+  std::vector<std::string> counts(inputs.size());
+  std::vector<int> exitCodes(inputs.size());
+  auto runOne = [&](size_t k) {
+    // "3_input.txt.trace", the number keeps them apart and in order
+    std::string stem = std::to_string(k) + "_" + inputs[k].name.substr(0, 40);
+    for (char &c : stem) {
+      if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-')
+        c = '_';
+    }
+    logs[k] = runsDir + "/" + stem + logExt;
+    counts[k] = countsPathFor(logs[k]);
+
+    std::vector<std::string> env = baseEnv;
+    env.push_back("DEFUSE_COUNTERS_FILE=" + counts[k]);
+    if (!traceMode.empty()) {
+      env.push_back("DEFUSE_TRACE=" + traceMode);
+      env.push_back("DEFUSE_TRACE_FILE=" + logs[k]);
+    }
+    std::vector<std::string> args = {outExe};
+    args.insert(args.end(), inputs[k].args.begin(), inputs[k].args.end());
+
+    std::vector<llvm::StringRef> argv(args.begin(), args.end());
+    std::vector<llvm::StringRef> envp(env.begin(), env.end());
+    // the text format is what the program prints
+    llvm::Optional<llvm::StringRef> redirects[] = {
+        llvm::StringRef(inputs[k].stdinFile),
+        traceMode.empty() ? llvm::StringRef(logs[k]) : llvm::StringRef(""),
+        llvm::StringRef("")};
+    exitCodes[k] = llvm::sys::ExecuteAndWait(
+        outExe, argv, llvm::ArrayRef<llvm::StringRef>(envp), redirects);
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  {
+    llvm::ThreadPool pool(llvm::hardware_concurrency(processJobs));
+    for (size_t k = 0; k < inputs.size(); k++)
+      pool.async([&runOne, k] { runOne(k); });
+    pool.wait();
+  }
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::cout << "  ran " << inputs.size() << " inputs in " << ms.count()
+            << " ms, logs in " << runsDir << "\n";
+
+  // merged in input order, so the graph is the same for any -j
+  for (size_t k = 0; k < inputs.size(); k++) {
+    if (exitCodes[k] != 0) {
+      std::cerr << "warn: input " << inputs[k].name << ": program exited with "
+                << exitCodes[k] << ", using what it recorded\n";
+    }
+    RuntimeValueMap run;
+    if (readValues && !readRuntimeLog(logs[k], run)) {
+      std::cerr << "warn: input " << inputs[k].name << " recorded no values\n";
+      continue;
+    }
+    mergeInputRun(values, inputs[k].name, run);
+  }
+  return mergeCountFiles(counts, countsPathFor(runtimeLog));
+}
+
+// graph outputs ending in .json or .graphml are written for other tools
+// instead of as DOT, and not rendered
+static bool isDotOutput(const std::string &outFile) {
+  return !endsWith(outFile, ".json") && !endsWith(outFile, ".graphml");
+}
+
+// vis to file in the format outFile names. file is outFile, or a temporary
+// renamed over it afterwards.
+static bool writeGraphFile(const GraphVisualizer &vis, const std::string &file,
+                           const std::string &outFile) {
+  if (endsWith(outFile, ".json"))
+    return vis.exportToJson(file);
+  if (endsWith(outFile, ".graphml"))
+    return vis.exportToGraphML(file);
+  return vis.exportToDot(file);
+}
+
+// pictures of outDot when graphviz is installed. A graph of -shard-above
+// nodes or more (or any with -shards) takes dot minutes to lay out as a
+// whole, it is split into a shard per function in <out>.shards/ instead and
+// those are rendered, only the ones whose text changed since the last time.
+static void renderDot(const GraphVisualizer &vis, const std::string &outDot) {
+  renderedShardDir.clear();
+  if (!isDotOutput(outDot))
+    return;
+  auto dotProgram = llvm::sys::findProgramByName("dot");
+  bool render = dotProgram && !renderFormats.empty();
+  size_t nodes = vis.exportedNodeCount();
+  if (!alwaysShard && (shardAbove == 0 || nodes < shardAbove)) {
+    if (render)
+      renderFiles(*dotProgram, {outDot});
+    return;
+  }
+
+  std::string dir = picturePath(outDot, "shards");
+  std::vector<std::string> shards;
+  if (!vis.exportShards(dir, shards)) {
+    std::cerr << "warn: no shards written, the graph is not rendered\n";
+    return;
+  }
+  renderedShardDir = dir;
+  if (!render) {
+    std::cout << "  " << nodes << " nodes in " << shards.size()
+              << " shards, not rendered without graphviz\n";
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  size_t rendered = renderFiles(*dotProgram, shards);
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::cout << "  " << nodes << " nodes in " << shards.size()
+            << " shards, rendered " << rendered << " in " << ms.count()
+            << " ms, start at " << picturePath(shards[0], renderFormats.back())
+            << "\n";
+}
+
+// counts, DOT and pictures of a built or loaded graph
+static bool exportGraph(GraphVisualizer &vis, const std::string &outDot,
+                        const std::string &countsFile) {
+  if (!countsFile.empty() && !vis.loadExecutionCounts(countsFile))
+    std::cerr << "warn: no execution counts, graph has no heat map\n";
+
+  vis.printStatistics(); // TODO[Dkay]: why to print stats even in production mode?
+  if (!useSlice(vis))
+    return false;
+
+  if (!writeGraphFile(vis, outDot, outDot)) {
+    std::cerr << "error: exporting the graph failed\n";
+    return false;
+  }
+
+  renderDot(vis, outDot);
+
+  // FIXME[Dkay] Is dot does not exists on PC, you still return true?
+  // why build graph function does something besides building graph like checking if dot binary exists...
+  return true;
+}
+
+// captured: values of a -jit run, used instead of runtimeLog
+static bool buildGraph(llvm::Module &mod, const std::string &runtimeLog,
+                       const std::string &outDot,
+                       const std::string &countsFile = "",
+                       RuntimeValueMap *captured = nullptr,
+                       const SiteManifest *sites = nullptr) {
+  GraphVisualizer vis;
+  vis.setJobs(graphJobs);
+  if (!useSiteManifest(vis, sites))
+    return false;
+  if (!vis.buildCombinedGraph(mod, runtimeLog)) {
+    std::cerr << "error: buildCombinedGraph failed\n";
+    return false;
+  }
+  if (captured)
+    vis.setRuntimeValues(std::move(*captured));
+  return exportGraph(vis, outDot, countsFile);
+}
+
+// vis from a graph saved by -save-graph, or built from IR which mod then
+// holds
+static bool openGraph(GraphVisualizer &vis, const std::string &path,
+                      const std::string &runtimeLog, llvm::LLVMContext &ctx,
+                      std::unique_ptr<llvm::Module> &mod) {
+  vis.setJobs(graphJobs);
+  if (!useSiteManifest(vis, nullptr))
+    return false;
+  // exported without the IR
+  if (endsWith(path, ".dgraph")) {
+    if (!vis.loadGraph(path, runtimeLog)) {
+      std::cerr << "error: loadGraph failed\n";
+      return false;
+    }
+    return true;
+  }
+  if (!loadModule(path, mod, ctx))
+    return false;
+  if (!vis.buildCombinedGraph(*mod, runtimeLog)) {
+    std::cerr << "error: buildCombinedGraph failed\n";
     return false;
   }
   return true;
 }
 
 static bool buildGraph(const std::string &llFile, const std::string &runtimeLog,
-                       const std::string &outDot) {
+                       const std::string &outDot,
+                       const std::string &countsFile = "") {
+  GraphVisualizer vis;
   llvm::LLVMContext ctx;
   std::unique_ptr<llvm::Module> mod;
-  if (!loadModule(llFile, mod, ctx))
+  if (!openGraph(vis, llFile, runtimeLog, ctx, mod))
     return false;
+  return exportGraph(vis, outDot, countsFile);
+}
 
+// -query: answers of the queries in queryFile to outFile, stdout without one
+static bool queryGraph(const std::string &graphFile,
+                       const std::string &queryFile,
+                       const std::string &outFile) {
   GraphVisualizer vis;
-  if (!vis.buildCombinedGraph(*mod, runtimeLog)) {
+  llvm::LLVMContext ctx;
+  std::unique_ptr<llvm::Module> mod;
+  if (!openGraph(vis, graphFile, "", ctx, mod))
+    return false;
+
+  auto start = std::chrono::steady_clock::now();
+  GraphQuery query(vis);
+  bool ok;
+  if (outFile.empty()) {
+    ok = query.run(queryFile, std::cout);
+  } else {
+    std::ofstream out(outFile);
+    if (!out.is_open()) {
+      std::cerr << "error: can't write answers: " << outFile << "\n";
+      return false;
+    }
+    ok = query.run(queryFile, out);
+  }
+  if (!ok)
+    return false;
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::cerr << "  answered " << query.answered() << " queries in "
+            << ms.count() << " ms\n";
+  return true;
+}
+
+// the graph of llFile without runtime values, for -graph <out.dgraph>
+static bool saveGraph(const std::string &llFile, const std::string &outGraph) {
+  llvm::LLVMContext ctx;
+  std::unique_ptr<llvm::Module> mod;
+  if (!loadModule(llFile, mod, ctx))
+    return false;
+  GraphVisualizer vis;
+  vis.setJobs(graphJobs);
+  if (!vis.buildCombinedGraph(*mod)) {
     std::cerr << "error: buildCombinedGraph failed\n";
     return false;
   }
+  return vis.saveGraph(outGraph);
+}
 
-  vis.printStatistics(); // TODO[Dkay]: why to print stats even in production mode?
+// rewrites outDot from the values streamed so far. The file is replaced with
+// a rename, so viewers never see half of a graph.
+static bool writeSnapshot(GraphVisualizer &vis, const std::string &outDot,
+                          bool force) {
+  size_t changed = vis.refreshRuntimeValues();
+  if (changed == 0 && !force)
+    return true;
 
-  if (!vis.exportToDot(outDot)) {
-    std::cerr << "error: exportToDot failed\n";
+  std::string tmp = outDot + ".tmp";
+  if (!writeGraphFile(vis, tmp, outDot) ||
+      std::rename(tmp.c_str(), outDot.c_str()) != 0) {
+    std::cerr << "error: can't write snapshot " << outDot << "\n";
     return false;
   }
+  std::cout << "  snapshot: " << vis.streamRecordCount() << " records, "
+            << changed << " sites changed\n";
+  return true;
+}
 
-  if (std::system("which dot > /dev/null 2>&1") == 0) { // FIXME [Dkay]: Why to use std::system if you have run cmd?
-    std::string png = outDot; 
-    std::string svg = outDot;
+// live mode: the graph is built once from the IR, then node values follow the
+// binary trace read from tracePath (normally a FIFO) until its writer closes
+// it. Snapshots are written at most every intervalMs and only when something
+// changed; reading never waits for them longer than that.
+static bool streamGraph(llvm::Module &mod, const std::string &tracePath,
+                        const std::string &outDot, unsigned intervalMs,
+                        const SiteManifest *sites = nullptr) {
+  GraphVisualizer vis;
+  vis.setJobs(graphJobs);
+  if (!useSiteManifest(vis, sites))
+    return false;
+  if (!vis.buildCombinedGraph(mod)) {
+    std::cerr << "error: buildCombinedGraph failed\n";
+    return false;
+  }
+  if (!useSlice(vis))
+    return false;
+  if (!writeSnapshot(vis, outDot, true))
+    return false;
 
-    if (endsWith(png, ".dot")) {
-      png = png.substr(0, png.size() - 4) + ".png"; // FIXME[flops]: Magic constants
-      svg = svg.substr(0, svg.size() - 4) + ".svg";
-    } else {
-      png += ".png";
-      svg += ".svg";
+  std::cout << "  waiting for the trace writer on " << tracePath << "\n";
+  int fd = open(tracePath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "error: can't open trace stream: " << tracePath << "\n";
+    return false;
+  }
+
+  using Clock = std::chrono::steady_clock;
+  const auto interval = std::chrono::milliseconds(intervalMs);
+  auto nextSnapshot = Clock::now() + interval;
+  std::vector<char> buffer(1 << 20);
+  bool ok = true;
+
+  for (;;) {
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+        nextSnapshot - Clock::now());
+    pollfd pfd = {fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, wait.count() > 0 ? int(wait.count()) : 0);
+    if (ready < 0 && errno != EINTR) {
+      ok = false;
+      break;
+    }
+    if (ready > 0) {
+      ssize_t got = read(fd, buffer.data(), buffer.size());
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0) // writer closed the pipe
+        break;
+      if (!vis.feedRuntimeStream(buffer.data(), size_t(got))) {
+        std::cerr << "error: malformed trace stream\n";
+        ok = false;
+        break;
+      }
+    }
+    if (Clock::now() >= nextSnapshot) {
+      if (!writeSnapshot(vis, outDot, false)) {
+        ok = false;
+        break;
+      }
+      nextSnapshot = Clock::now() + interval;
     }
-    // FIXME[flops]: Two copies is not the best approach here, jus append extension to outDot
-    runCmd("dot -Tpng \"" + outDot + "\" -o \"" + png + "\" 2>/dev/null");
-    runCmd("dot -Tsvg \"" + outDot + "\" -o \"" + svg + "\" 2>/dev/null");
   }
+  close(fd);
 
-  // FIXME[Dkay] Is dot does not exists on PC, you still return true?
-  // why build graph function does something besides building graph like checking if dot binary exists...
+  if (ok && !vis.streamStarted())
+    std::cerr << "warn: no trace was written to " << tracePath << "\n";
+  if (!writeSnapshot(vis, outDot, false))
+    return false;
+  vis.printStatistics();
+  renderDot(vis, outDot);
+  return ok;
+}
+
+static bool streamGraph(const std::string &llFile, const std::string &tracePath,
+                        const std::string &outDot, unsigned intervalMs) {
+  llvm::LLVMContext ctx;
+  std::unique_ptr<llvm::Module> mod;
+  if (!loadModule(llFile, mod, ctx))
+    return false;
+  return streamGraph(*mod, tracePath, outDot, intervalMs);
+}
+
+// content hash of every function defined in IR text by name: the text from
+// its "define" line to the closing brace. clang prints an unchanged function
+// the same way again, and mem2reg makes the same IR of it.
+static llvm::StringMap<uint64_t> functionHashes(llvm::StringRef text) {
+  llvm::StringMap<uint64_t> hashes;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t eol = std::min(text.find('\n', pos), text.size());
+    llvm::StringRef line = text.slice(pos, eol);
+    size_t at = line.find('@');
+    if (!line.startswith("define ") || at == llvm::StringRef::npos) {
+      pos = eol + 1;
+      continue;
+    }
+    llvm::StringRef name = line.substr(at + 1);
+    if (name.startswith("\""))
+      name = name.substr(1).take_until([](char c) { return c == '"'; });
+    else
+      name = name.take_until([](char c) { return c == '('; });
+    size_t end = std::min(text.find("\n}", eol), text.size());
+    end = std::min(end + 2, text.size());
+    hashes[name] = llvm::xxHash64(text.slice(pos, end));
+    pos = end;
+  }
+  return hashes;
+}
+
+// one rebuild of -watch: parses irFile into a new module and rebuilds vis
+// from it, reusing what it has for unchanged functions. The previous module
+// is kept until then, vis points into it.
+static bool rebuildWatched(GraphVisualizer &vis, const std::string &irFile,
+                           const std::string &outDot,
+                           std::unique_ptr<llvm::LLVMContext> &ctx,
+                           std::unique_ptr<llvm::Module> &mod) {
+  auto start = std::chrono::steady_clock::now();
+  auto buffer = llvm::MemoryBuffer::getFile(irFile);
+  if (!buffer) {
+    std::cerr << "error: can't read IR: " << irFile << "\n";
+    return false;
+  }
+  auto newCtx = std::make_unique<llvm::LLVMContext>();
+  llvm::SMDiagnostic err;
+  std::unique_ptr<llvm::Module> newMod =
+      llvm::parseIR((*buffer)->getMemBufferRef(), err, *newCtx);
+  if (!newMod) {
+    std::cerr << "error: can't read IR: " << irFile << "\n";
+    err.print(irFile.c_str(), llvm::errs());
+    return false;
+  }
+  promoteAllocas(*newMod);
+
+  vis.setFunctionHashes(functionHashes((*buffer)->getBuffer()));
+  if (!vis.buildCombinedGraph(*newMod)) {
+    std::cerr << "error: buildCombinedGraph failed\n";
+    return false;
+  }
+  mod = std::move(newMod);
+  ctx = std::move(newCtx);
+  if (!useSlice(vis))
+    return false;
+
+  // replaced with a rename like the snapshots of -stream
+  std::string tmp = outDot + ".tmp";
+  if (!writeGraphFile(vis, tmp, outDot) ||
+      std::rename(tmp.c_str(), outDot.c_str()) != 0) {
+    std::cerr << "error: can't write " << outDot << "\n";
+    return false;
+  }
+  renderDot(vis, outDot);
+
+  const std::vector<std::string> &changed = vis.changedFunctions();
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::cout << "  rebuilt " << changed.size() << " changed functions in "
+            << ms.count() << " ms";
+  const size_t listed = 8;
+  for (size_t i = 0; i < changed.size() && i < listed; i++)
+    std::cout << (i == 0 ? ": " : ", ") << changed[i];
+  if (changed.size() > listed)
+    std::cout << ", ...";
+  // the output of a long-running watch usually goes to a pipe or a file
+  std::cout << std::endl;
   return true;
 }
 
+// watch mode: builds the graph of input (.ll, or .c through clang), then
+// rebuilds it and rewrites outDot every time the file is saved, until
+// interrupted. Only the functions whose text changed are formatted and
+// rendered again. The directory is watched rather than the file, editors
+// often save by renaming a new file over the old one.
+static bool watchGraph(const std::string &input, const std::string &outDot) {
+  bool fromC = endsWith(input, ".c");
+  if (!fromC && !endsWith(input, ".ll")) {
+    std::cerr << "error: -watch needs textual IR or C source\n";
+    return false;
+  }
+  std::string irFile = input;
+  if (fromC) {
+    irFile = (endsWith(outDot, ".dot") ? outDot.substr(0, outDot.size() - 4)
+                                       : outDot) +
+             ".ll";
+  }
+  size_t slash = input.find_last_of('/');
+  std::string dir = slash == std::string::npos ? "." : input.substr(0, slash);
+  std::string file =
+      slash == std::string::npos ? input : input.substr(slash + 1);
+
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, dir.c_str(),
+                                  IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    std::cerr << "error: can't watch " << dir << "\n";
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+
+  GraphVisualizer vis;
+  vis.setJobs(graphJobs);
+  std::unique_ptr<llvm::LLVMContext> ctx;
+  std::unique_ptr<llvm::Module> mod;
+  auto rebuild = [&] {
+    if (fromC && !emitllFromC(input, irFile)) {
+      std::cerr << "error: clang failed\n";
+      return false;
+    }
+    return rebuildWatched(vis, irFile, outDot, ctx, mod);
+  };
+  // a broken first version is reported like later ones
+  rebuild();
+  std::cout << "  watching " << input << " (Ctrl-C to stop)" << std::endl;
+
+  alignas(inotify_event) char events[4096];
+  for (;;) {
+    ssize_t got = read(fd, events, sizeof(events));
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      break;
+    bool saved = false;
+    for (char *at = events; at < events + got;) {
+      auto *event = reinterpret_cast<inotify_event *>(at);
+      if (event->len > 0 && file == event->name)
+        saved = true;
+      at += sizeof(inotify_event) + event->len;
+    }
+    if (!saved)
+      continue;
+    // an editor saving in several steps gives a burst of events, one
+    // rebuild is enough once it is quiet
+    pollfd pfd = {fd, POLLIN, 0};
+    while (poll(&pfd, 1, 100) > 0 && read(fd, events, sizeof(events)) > 0) {
+    }
+    rebuild();
+  }
+  close(fd);
+  std::cerr << "error: watching " << dir << " failed\n";
+  return false;
+}
+
+// starts the instrumented program in the background, writing its trace into a
+// fresh FIFO. Opening the FIFO read-write after the program is gone makes sure
+// the reader's open() returns even if the program never opened it.
+static bool startStreamingRun(const std::string &instrumentedLl,
+                              const std::string &fifo,
+                              const std::string &exePath) {
+  if (!compileInstrumented(instrumentedLl, exePath))
+    return false;
+
+  unlink(fifo.c_str());
+  if (mkfifo(fifo.c_str(), 0644) != 0) {
+    std::cerr << "error: can't create FIFO: " << fifo << "\n";
+    return false;
+  }
+
+  std::string runCmdLine = "( DEFUSE_TRACE=binary DEFUSE_TRACE_FILE=\"" +
+                           fifo + "\" ./" + exePath +
+                           " > /dev/null 2>&1; : 1<>\"" + fifo + "\" ) &";
+  return runCmd(runCmdLine);
+}
+
 static std::string baseNameNoExt(const std::string &path) { // FIXME [Dkay]: this is std::filesystem function
   std::string s = path;
   size_t slash = s.find_last_of("/\\");
@@ -199,7 +1078,10 @@ static std::string baseNameNoExt(const std::string &path) { // FIXME [Dkay]: thi
 
 // FIXME [Dkay]: bad naming: what is analyzing, which analyses?
 //
-static int doAnalyze(const std::string &inputFile, const std::string &outDir) { 
+static int doAnalyze(const std::string &inputFile, const std::string &outDir,
+                     const std::string &logName,
+                     const InstrumentationOptions &options, bool bitcode,
+                     bool jit, const std::string &inputs) {
   std::string name = baseNameNoExt(inputFile);
   std::string root = outDir.empty() ? ("outputs/" + name) : outDir;
 
@@ -208,10 +1090,11 @@ static int doAnalyze(const std::string &inputFile, const std::string &outDir) {
   ensureDir(llvmDir);
   
   // TODO [Dkay]: worsdt naming ever.
-  std::string ll0 = llvmDir + "/" + name + ".ll";
-  std::string ll1 = llvmDir + "/" + name + "_m2r.ll";
-  std::string instLl = llvmDir + "/" + name + "_instrumented.ll";
-  std::string rtLog = root + "/runtime.log";
+  std::string ext = bitcode ? ".bc" : ".ll";
+  std::string ll0 = llvmDir + "/" + name + ext;
+  std::string ll1 = llvmDir + "/" + name + "_m2r" + ext;
+  std::string instLl = llvmDir + "/" + name + "_instrumented" + ext;
+  std::string rtLog = root + "/" + logName;
   std::string dot = root + "/enhanced_graph.dot";
   std::string exe = root + "/program";
 
@@ -224,44 +1107,121 @@ static int doAnalyze(const std::string &inputFile, const std::string &outDir) {
       return 2; // FIXME [Dkay]: magic consts
     }
     irForGraph = ll0;
-  } else if (endsWith(inputFile, ".ll")) {
+  } else if (endsWith(inputFile, ".ll") || isBitcodePath(inputFile)) {
     irForGraph = inputFile;
   } else {
-    std::cerr << "error: input must be .c or .ll\n";
+    std::cerr << "error: input must be .c, .ll or .bc\n";
     return 2;
   }
 
+  // parsed once: the graph is built from this module, the instrumented
+  // program from a clone of it. The context is shareable with the JIT.
+  llvm::orc::ThreadSafeContext tsc(std::make_unique<llvm::LLVMContext>());
+  llvm::LLVMContext &ctx = *tsc.getContext();
+  std::unique_ptr<llvm::Module> mod;
+  if (!loadModule(irForGraph, mod, ctx))
+    return 2;
+
   std::cout << "[2/5] mem2reg\n";
-  if (mem2reg(irForGraph, ll1)) {
+  promoteAllocas(*mod);
+  // kept on disk for -graph and for reading
+  if (writeModule(*mod, ll1))
     irForGraph = ll1;
-  } else {
-    std::cerr << "warn: mem2reg failed, continue with original IR\n";
-  }
 
   std::cout << "[3/5] instrument\n";
-  if (!instrumentll(irForGraph, instLl)) {
+  std::unique_ptr<llvm::Module> instrumented = llvm::CloneModule(*mod);
+  SiteManifest sites;
+  {
+    Instrumentation inst(options);
+    inst.instrumentModule(*instrumented);
+    sites = inst.siteManifest();
+  }
+  // nothing to build with -jit
+  if (!jit && (!writeModule(*instrumented, instLl) ||
+               (!sites.empty() && !sites.write(manifestPathFor(instLl))))) {
     std::cerr << "error: instrumentation failed\n";
     return 3;
   }
 
-  std::cout << "[4/5] run instrumented program (collect runtime.log)\n";
-  if (!buildAndRun(instLl, rtLog, exe)) {
-    return 4;
-  }
+  if (jit) {
+    std::cout << "[4/5] run instrumented module in process (jit)\n";
+    JitRunner runner;
+    if (!runner.run(
+            llvm::orc::ThreadSafeModule(std::move(instrumented), tsc))) {
+      std::cerr << "error: running instrumented module failed\n";
+      return 4;
+    }
+    std::cout << "  program exited with " << runner.exitCode() << ", "
+              << runner.recordCount() << " values recorded\n";
+    if (options.counters)
+      runner.writeCounts(countsPathFor(rtLog));
+    RuntimeValueMap values;
+    runner.publish(values);
+
+    std::cout << "[5/5] build graph (dot/png/svg)\n";
+    if (!buildGraph(*mod, "", dot,
+                    options.counters ? countsPathFor(rtLog) : "",
+                    options.values ? &values : nullptr, &sites)) {
+      return 5;
+    }
+  } else if (endsWith(rtLog, ".fifo")) {
+    std::cout << "[4/5] start instrumented program (stream " << rtLog
+              << ")\n";
+    if (!startStreamingRun(instLl, rtLog, exe)) {
+      return 4;
+    }
+
+    std::cout << "[5/5] live graph (dot, png/svg at the end)\n";
+    if (!streamGraph(*mod, rtLog, dot, 1000, &sites)) {
+      return 5;
+    }
+  } else if (!inputs.empty()) {
+    std::cout << "[4/5] run instrumented program on each of " << inputs
+              << "\n";
+    RuntimeValueMap values;
+    if (!runInputs(instLl, rtLog, exe, inputs, options.values, values)) {
+      return 4;
+    }
 
-  std::cout << "[5/5] build graph (dot/png/svg)\n";
-  if (!buildGraph(irForGraph, rtLog, dot)) {
-    return 5;
+    std::cout << "[5/5] build graph (dot/png/svg)\n";
+    if (!buildGraph(*mod, "", dot,
+                    options.counters ? countsPathFor(rtLog) : "",
+                    options.values ? &values : nullptr, &sites)) {
+      return 5;
+    }
+  } else {
+    std::cout << "[4/5] run instrumented program (collect " << rtLog
+              << ")\n";
+    if (!buildAndRun(instLl, rtLog, exe)) {
+      return 4;
+    }
+
+    std::cout << "[5/5] build graph (dot/png/svg)\n";
+    // a counters-only program writes no runtime values
+    if (!buildGraph(*mod, options.values ? rtLog : "", dot,
+                    options.counters ? countsPathFor(rtLog) : "", nullptr,
+                    &sites)) {
+      return 5;
+    }
   }
 
   std::cout << "\nDone.\n";
   std::cout << "Output folder: " << root << "\n";
   std::cout << "  IR:   " << irForGraph << "\n";
-  std::cout << "  log:  " << rtLog << "\n";
+  if (!inputs.empty())
+    std::cout << "  runs: " << root << "/runs\n";
+  else if (options.values && !jit)
+    std::cout << "  log:  " << rtLog << "\n";
+  if (!sites.empty() && !jit)
+    std::cout << "  sites: " << manifestPathFor(instLl) << "\n";
+  if (options.counters)
+    std::cout << "  counts: " << countsPathFor(rtLog) << "\n";
   std::cout << "  dot:  " << dot << "\n";
-  if (endsWith(dot, ".dot")) {
-    std::cout << "  png:  " << dot.substr(0, dot.size() - 4) << ".png\n"; // TODO[flops]: This is part of buildGraph too, separate it and reuse 
-    std::cout << "  svg:  " << dot.substr(0, dot.size() - 4) << ".svg\n";
+  if (!renderedShardDir.empty()) {
+    std::cout << "  shards: " << renderedShardDir << "/index.dot\n";
+  } else {
+    for (const std::string &format : renderFormats)
+      std::cout << "  " << format << ":  " << picturePath(dot, format) << "\n";
   }
   return 0;
 }
@@ -274,6 +1234,65 @@ int main(int argc, char **argv) {
 
   // TODO[flops]: There are a lot of path / string utils there, transfer it to separate file / use funcs from LLVM / C++ stdlib 
 
+  // taken out here, so the commands see only their own arguments
+  int kept = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-slice-calls") {
+      sliceCalls = true;
+      continue;
+    }
+    if (arg == "-shards") {
+      alwaysShard = true;
+      continue;
+    }
+    if (arg != "-j" && arg != "-sites" && arg != "-slice-backward" &&
+        arg != "-slice-forward" && arg != "-slice-depth" &&
+        arg != "-shard-above" && arg != "-formats") {
+      argv[kept++] = argv[i];
+      continue;
+    }
+    if (i + 1 == argc) {
+      std::cerr << "error: " << arg
+                << (arg == "-j"       ? " needs a number of threads\n"
+                    : arg == "-sites" ? " needs a manifest file\n"
+                    : arg == "-slice-depth" ? " needs a number of edges\n"
+                    : arg == "-shard-above" ? " needs a number of nodes\n"
+                    : arg == "-formats"     ? " needs a list like png,svg\n"
+                                            : " needs a node id\n");
+      return 1;
+    }
+    std::string value = argv[++i];
+    if (arg == "-j") {
+      graphJobs = unsigned(std::atoi(value.c_str()));
+      processJobs = graphJobs;
+    } else if (arg == "-shard-above") {
+      shardAbove = size_t(std::atol(value.c_str()));
+    } else if (arg == "-formats") {
+      renderFormats.clear();
+      llvm::SmallVector<llvm::StringRef, 4> formats;
+      llvm::StringRef(value).split(formats, ',', -1, false);
+      for (llvm::StringRef format : formats) {
+        if (format != "none")
+          renderFormats.push_back(format.str());
+      }
+    } else if (arg == "-sites") {
+      siteManifestFile = value;
+    } else if (arg == "-slice-depth") {
+      sliceDepth = unsigned(std::atoi(value.c_str()));
+    } else {
+      sliceNode = value;
+      sliceDirection = arg == "-slice-forward"
+                           ? GraphVisualizer::SliceDirection::Forward
+                           : GraphVisualizer::SliceDirection::Backward;
+    }
+  }
+  argc = kept;
+  if (argc < 2) {
+    printHelp();
+    return 1;
+  }
+
   std::string cmd = argv[1];
 
   if (cmd == "--help" || cmd == "-h" || cmd == "help") {
@@ -288,8 +1307,60 @@ int main(int argc, char **argv) {
         return 1;
       }
       std::string input = argv[2];
-      std::string outDir = (argc >= 4) ? argv[3] : "";
-      return doAnalyze(input, outDir);
+      std::string outDir;
+      std::string logName = "runtime.trace";
+      InstrumentationOptions options;
+      bool bitcode = isBitcodePath(input);
+      bool jit = false;
+      std::string inputs;
+      for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-inputs") {
+          if (i + 1 == argc) {
+            std::cerr << "error: -inputs needs a directory or a file\n";
+            return 1;
+          }
+          inputs = argv[++i];
+        } else if (arg == "-bc") {
+          bitcode = true;
+        } else if (arg == "-jit") {
+          jit = true;
+        } else if (arg == "-counters") {
+          options.values = false;
+          options.counters = true;
+        } else if (arg == "-minimal") {
+          options.minimal = true;
+        } else if (arg == "-batched") {
+          options.batched = true;
+        } else if (arg == "-aggregate") {
+          logName = "runtime.agg";
+        } else if (arg == "-mmap") {
+          logName = "runtime.mtrace";
+        } else if (arg == "-stream") {
+          logName = "runtime.fifo";
+        } else if (outDir.empty()) {
+          outDir = arg;
+        } else {
+          std::cerr << "error: unexpected argument: " << arg << "\n";
+          return 1;
+        }
+      }
+      if (options.counters && endsWith(logName, ".fifo")) {
+        std::cerr << "error: -counters has nothing to stream\n";
+        return 1;
+      }
+      if (jit && logName != "runtime.trace") {
+        std::cerr << "error: -jit records in process, it takes no trace "
+                     "format\n";
+        return 1;
+      }
+      if (!inputs.empty() &&
+          (jit || options.minimal || endsWith(logName, ".fifo"))) {
+        std::cerr << "error: -inputs runs the built program, without "
+                     "-jit, -stream and -minimal\n";
+        return 1;
+      }
+      return doAnalyze(input, outDir, logName, options, bitcode, jit, inputs);
     }
 
     if (cmd == "-emit-llvm") {
@@ -310,10 +1381,26 @@ int main(int argc, char **argv) {
 
     if (cmd == "-instrument") {
       if (argc < 4) {
-        std::cerr << "error: -instrument <in.ll> <out.ll>\n";
+        std::cerr << "error: -instrument <in.ll> <out.ll> "
+                     "[-counters|-minimal|-batched]\n";
         return 1;
       }
-      return instrumentll(argv[2], argv[3]) ? 0 : 2;
+      InstrumentationOptions options;
+      for (int i = 4; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-counters") {
+          options.values = false;
+          options.counters = true;
+        } else if (arg == "-minimal") {
+          options.minimal = true;
+        } else if (arg == "-batched") {
+          options.batched = true;
+        } else {
+          std::cerr << "error: unexpected argument: " << arg << "\n";
+          return 1;
+        }
+      }
+      return instrumentll(argv[2], argv[3], options) ? 0 : 2;
     }
 
     if (cmd == "-run") {
@@ -327,13 +1414,52 @@ int main(int argc, char **argv) {
 
     if (cmd == "-graph") { // TODO[Dkay]: argument parsing / dispatching should be a function
       if (argc < 3) {
-        std::cerr << "error: -graph <in.ll> [runtime.log] [out.dot]\n";  // TODO[Dkay]: Should be a function
+        std::cerr << "error: -graph <in.ll|in.dgraph> [runtime.log] [out.dot] "
+                     "[runtime.counts]\n";  // TODO[Dkay]: Should be a function
         return 1;
       }
       std::string inLl = argv[2];
       std::string rt = (argc >= 4) ? argv[3] : "";
       std::string outDot = (argc >= 5) ? argv[4] : "enhanced_graph.dot";
-      return buildGraph(inLl, rt, outDot) ? 0 : 2;
+      std::string counts = (argc >= 6) ? argv[5] : "";
+      return buildGraph(inLl, rt, outDot, counts) ? 0 : 2;
+    }
+
+    if (cmd == "-query") {
+      if (argc < 4) {
+        std::cerr << "error: -query <in.ll|in.dgraph> <queries.txt> "
+                     "[answers.txt]\n";
+        return 1;
+      }
+      return queryGraph(argv[2], argv[3], argc >= 5 ? argv[4] : "") ? 0 : 2;
+    }
+
+    if (cmd == "-save-graph") {
+      if (argc < 4) {
+        std::cerr << "error: -save-graph <in.ll> <out.dgraph>\n";
+        return 1;
+      }
+      return saveGraph(argv[2], argv[3]) ? 0 : 2;
+    }
+
+    if (cmd == "-watch") {
+      if (argc < 3) {
+        std::cerr << "error: -watch <in.c|in.ll> [out.dot]\n";
+        return 1;
+      }
+      std::string outDot = (argc >= 4) ? argv[3] : "enhanced_graph.dot";
+      return watchGraph(argv[2], outDot) ? 0 : 2;
+    }
+
+    if (cmd == "-stream") {
+      if (argc < 4) {
+        std::cerr << "error: -stream <in.ll> <trace_fifo> [out.dot] "
+                     "[interval_ms]\n";
+        return 1;
+      }
+      std::string outDot = (argc >= 5) ? argv[4] : "enhanced_graph.dot";
+      unsigned intervalMs = (argc >= 6) ? unsigned(std::atoi(argv[5])) : 1000;
+      return streamGraph(argv[2], argv[3], outDot, intervalMs) ? 0 : 2;
     }
 
     std::cerr << "error: unknown option: " << cmd << "\n";
@@ -0,0 +1,4 @@
+int bfun(int x) {
+    int q = x * 3 + 6;
+    return q;
+}
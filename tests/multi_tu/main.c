@@ -0,0 +1,7 @@
+int bfun(int x);
+
+int main(void) {
+    int r = bfun(40);
+    int s = r + 1;
+    return s - 127;
+}